@@ -28,8 +28,15 @@
 #ifndef COMMAND_CONSTANTS_H
 #define COMMAND_CONSTANTS_H
 
-// List of command indicies in below array
-#define COMMAND_COUNT 52
+// List of command indicies in below array. These indicies are also the opcodes of binary command frames (see README).
+#define COMMAND_COUNT 76
+
+// Device-specific commands take binary frame opcodes from here on (plus the device command index), so their opcodes do
+// not move when core commands are added
+#define DEVICE_COMMAND_OPCODE_BASE 0x80
+#if COMMAND_COUNT > DEVICE_COMMAND_OPCODE_BASE
+#error "Core command opcodes run into DEVICE_COMMAND_OPCODE_BASE"
+#endif
 
 #define CMD_HELP_IDX 0
 #define CMD_ABOUT_IDX 1
@@ -93,6 +100,44 @@
 #define CMD_SET_PN 50
 #define CMD_SET_SN 51
 
+#define CMD_BENCHMARK_DISPATCH 52
+#define CMD_PRINT_PARSER_STATS 53
+
+#define CMD_BEGIN_BATCH 54
+#define CMD_COMMIT_BATCH 55
+
+#define CMD_MACHINE_MODE 56
+
+#define CMD_TASK_STATUS 57
+#define CMD_ABORT_TASK 58
+
+#define CMD_PRINT_LATENCY 59
+
+#define CMD_DRAW_IMAGE 60
+
+#define CMD_SET_SEQ_BULK 61
+
+#define CMD_COMPILE_SEQ 62
+
+#define CMD_PRINT_MEMORY 63
+
+#define CMD_SAVE_SEQ_FLASH 64
+#define CMD_LOAD_SEQ_FLASH 65
+#define CMD_DELETE_SEQ_FLASH 66
+#define CMD_LIST_SEQ_FLASH 67
+
+#define CMD_GENERATE_SEQ 68
+
+#define CMD_SELECT_SEQ_SLOT 69
+#define CMD_SET_PLAYLIST 70
+#define CMD_RUN_PLAYLIST 71
+
+#define CMD_PUSH_STREAM 72
+#define CMD_RUN_STREAM 73
+#define CMD_END_STREAM 74
+
+#define CMD_PRINT_SEQ_HASH 75
+
 // Syntax is: {short command, long command, description, syntax}
 const char* command_list[COMMAND_COUNT][4] = {
 
@@ -130,7 +175,7 @@ const char* command_list[COMMAND_COUNT][4] = {
   {"scb", "scanBrightfield", "Scan all brightfield LEDs. Sends trigger pulse in between images. Outputs LED list to serial terminal.", "scb,[delay_ms]"},
 
   // Custom Sequence Scanning
-  {"ssl",   "setSeqLength", "Set sequence length in terms of independent patterns", "ssl,[Sequence length]"},
+  {"ssl",   "setSeqLength", "Set sequence length in terms of independent patterns, and optionally the total number of LEDs in all patterns (storage is allocated once if given, 0 if unknown) and whether to store patterns as changes from the previous one (delta, 0 or 1)", "ssl.[Sequence length] --or-- ssl.[Sequence length].[Total LED count] --or-- ssl.[Sequence length].[Total LED count].[Delta]"},
   {"ssv",   "setSeqValue", "Set sequence value", "ssl.[1st LED #]. [1st rVal]. [1st gVal]. [1st bVal]. [2nd LED #]. [2nd rVal]. [2nd gVal]. [2nd bVal] ..."},
   {"rseq",  "runSequence", "Runs sequence with specified delay between each update. If update speed is too fast, a :( is shown on the LED array.", "rseq,[Delay between each pattern in ms].[trigger mode for index 0].[trigger mode for index 1].[trigger mode for index 2] "},
   {"rseqf",  "runSequenceFast", "Runs sequence with specified delay between each update. Uses parallel digital IO to acheive very fast speeds. Only available on certain LED arrays.", "rseqf,[Delay between each pattern in ms].[trigger mode for index 0].[trigger mode for index 1].[trigger mode for index 2] "},
@@ -166,7 +211,59 @@ const char* command_list[COMMAND_COUNT][4] = {
 
   // Set part and serial number in EEPROM
   {"setsn", "setSerialNumber", "Sets device serial number in EEPROM (DO NOT USE UNLESS YOU KNOW WHAT YOU ARE DOING"},
-  {"setpn", "setPartNumber", "Sets device part number in EEPROM (DO NOT USE UNLESS YOU KNOW WHAT YOU ARE DOING"}
+  {"setpn", "setPartNumber", "Sets device part number in EEPROM (DO NOT USE UNLESS YOU KNOW WHAT YOU ARE DOING"},
+
+  // Benchmarking
+  {"bdisp", "benchmarkDispatch", "Prints the time taken to look up each command name using the dispatch table and using a linear scan (lookup only, see plat for end-to-end command latency)", "bdisp --or-- bdisp.[iterations]"},
+  {"pstat", "printParserStats", "Prints parse arena size and high-water mark", "pstat"},
+
+  // Batches
+  {"batch", "beginBatch", "Starts a batch: following drawing commands only change the LED buffer until commit", "batch"},
+  {"commit", "commitBatch", "Ends a batch and updates the array once with the combined pattern", "commit"},
+
+  // Response protocol
+  {"mm", "machineMode", "Toggles machine response mode, in which each command answers with one line: request ID, status code and optional payload", "mm --or-- mm.[0/1]"},
+
+  // Long-running tasks
+  {"tstat", "taskStatus", "Prints the running task (rseq, scf, scb, trt, disco, demo or water), its pattern and frame index and elapsed time", "tstat"},
+  {"abort", "abortTask", "Stops the running task", "abort"},
+
+  // Diagnostics
+  {"plat", "printLatency", "Prints and resets the latency histogram (receive, parse and run time) of each command", "plat"},
+
+  // Images
+  {"img", "drawImage", "Draws a full-array image from packed 8- or 16-bit hex values (every color channel of every LED, in LED number order) with a single update. Values are not scaled by brightness or color.", "img.[8/16].[hex values, 2 or 4 digits each]"},
+
+  // Bulk sequence upload
+  {"sseqb", "setSeqBulk", "Replaces the sequence with many patterns in one command: a uint16 pattern count, then the ssv frame payload of each pattern (uint16 led count, then an int16 led number and one value per color channel for each led, with 2-byte values for 16-bit sequences), little-endian. Answers with the pattern count and the CRC-16 of the payload.", "sseqb.[payload as hex digits] --or-- binary frame"},
+
+  // Compiled sequences
+  {"cseq", "compileSequence", "Renders every sequence pattern into a frame of the bytes the LED drivers take, so rseq and rpl only shift out each frame. Needs one frame of memory per pattern; changing the sequence drops the frames.", "cseq"},
+
+  // Memory
+  {"pmem", "printMemory", "Prints the memory used by the sequence, compiled frames, NA list and driver buffers, and the largest free heap block. With a pattern count and average led count per pattern (and optional bit depth), predicts whether that sequence fits.", "pmem --or-- pmem.[pattern count].[average led count].[bit depth]"},
+
+  // Flash sequence store
+  {"fsave", "saveSeqFlash", "Stores the sequence in spare program flash under an ID (replacing a sequence stored with that ID). Stored sequences survive a power cycle, but not loading new firmware.", "fsave.[id]"},
+  {"fload", "loadSeqFlash", "Makes a sequence stored in flash the current sequence. It plays from flash without using RAM, and can not be changed.", "fload.[id]"},
+  {"fdel", "deleteSeqFlash", "Deletes a sequence stored in flash", "fdel.[id]"},
+  {"flist", "listSeqFlash", "Lists the sequences stored in flash and the free flash", "flist"},
+
+  // Sequence generators
+  {"gseq", "generateSequence", "Replaces the sequence with one built on the device, at the current LED value: a single-LED scan over an NA range, over the brightfield (bf) or darkfield (df) LEDs, the four DPC half circles (t, b, l, r) at the objective NA, or annuli of a fixed NA width", "gseq.scan.[start NA*100].[end NA*100] --or-- gseq.bf --or-- gseq.df --or-- gseq.dpc --or-- gseq.an.[start NA*100].[end NA*100].[step NA*100]"},
+
+  // Sequence slots and playlist
+  {"sslot", "selectSeqSlot", "Selects the sequence slot used by the sequence commands. Each slot keeps its own sequence, and a slot can be uploaded while another one is played. Without arguments, lists the slots.", "sslot.[slot] --or-- sslot"},
+  {"spl", "setPlaylist", "Sets the playlist played by rpl: pairs of a sequence slot and the number of times its sequence is played. Without arguments, prints the playlist.", "spl.[slot].[acquisition count].[slot].[acquisition count] ..."},
+  {"rpl", "runPlaylist", "Plays the sequences of the playlist in order, with the arguments of rseq. The acquisition count is the number of times the whole playlist is played.", "rpl.[Delay between each pattern in ms].[# playlist repeats].[trigger output mode 0].[trigger output mode 1].[trigger input mode 0].[trigger input mode 1]"},
+
+  // Streamed sequences
+  {"spsh", "pushStreamPattern", "Appends a pattern (with the arguments of ssv) to the stream played by rstr. While the stream plays, patterns wait for room in the stream buffer. In machine mode, answers with the buffered pattern count, free buffer bytes, underrun count and index of the pattern of the last underrun.", "spsh.[led count].[1st LED #].[1st rVal].[1st gVal].[1st bVal] ..."},
+  {"rstr", "runStream", "Plays the streamed patterns as they arrive, with the arguments of rseq. The acquisition count is the number of patterns buffered before the first one is shown. Patterns which arrive late are reported as underruns.", "rstr.[Delay between each pattern in ms].[# patterns to buffer first].[trigger output mode 0].[trigger output mode 1].[trigger input mode 0].[trigger input mode 1]"},
+  {"estr", "endStream", "Ends the stream once the buffered patterns have been played", "estr"},
+
+  // Sequence hash
+  {"phash", "printSeqHash", "Prints the xxHash32 of the sequence (its parameters, LED numbers and values as uploaded), so the host can skip uploading a sequence the device already holds", "phash"}
 };
 
 #endif
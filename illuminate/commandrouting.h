@@ -31,25 +31,127 @@
 #include <SPI.h>
 #include <mk20dx128.h>
 
-#define MAX_ARGUMENT_ELEMENT_LENGTH 10
+#define MAX_ARGUMENT_ELEMENT_LENGTH 16
 #define MAX_COMMAND_LENGTH 20
-#define MAX_ARGUMENT_COUNT_CHAR 1500
+#define PARSE_ARENA_SIZE 8192        // Bytes of static storage for the arguments of queued commands
+#define SERIAL_BUFFER_SIZE 256       // Bytes read ahead from serial (must be a power of two)
+#define COMMAND_QUEUE_LENGTH 16      // Max number of parsed commands waiting to run
+#define FRAME_TIMEOUT_MS 1000        // A partially received binary frame is dropped after this long without new bytes
+
+// Parser states
+#define PARSER_IDLE 0            // Waiting for the first byte of a command
+#define PARSER_COMMAND 1         // Reading an ASCII command name
+#define PARSER_ARGUMENTS 2       // Reading dot-delimited ASCII arguments
+#define PARSER_DISCARD_LINE 3    // Skipping the rest of an ASCII command which did not fit in the parse arena
+#define PARSER_FRAME_HEADER 4    // Reading a binary frame header
+#define PARSER_FRAME_PAYLOAD 5   // Reading a binary frame payload and crc
+#define PARSER_DISCARD_FRAME 6   // Skipping the rest of a binary frame which did not fit in the parse arena
+#define PARSER_IMAGE_HEX 7       // Decoding the hex values of an ASCII img command into the array buffer
+#define PARSER_IMAGE_FRAME 8     // Decoding the payload of an img frame into the array buffer
+#define PARSER_PAYLOAD_HEX 9     // Decoding a hex payload (the ASCII form of a frame payload) into the parse arena
+
+// Errors reported when a queued command is run
+#define COMMAND_ERROR_NONE 0
+#define COMMAND_ERROR_ARENA_FULL 1
+#define COMMAND_ERROR_FRAME_CRC 2
+#define COMMAND_ERROR_FRAME_TIMEOUT 3
+#define COMMAND_ERROR_FRAME_OPCODE 4
+#define COMMAND_ERROR_FRAME_LENGTH 5
+#define COMMAND_ERROR_ARGUMENT_COUNT 6
+
+// Results of CommandRouter::ensureParseArena
+#define PARSE_ARENA_OK 0
+#define PARSE_ARENA_WAIT 1       // Space is used by queued commands which have not run yet
+#define PARSE_ARENA_FULL 2       // Command does not fit in the parse arena
+
+// Binary frame layout: [start byte][opcode][flags][length (2 bytes)][payload][crc16 (2 bytes)]
+#define FRAME_HEADER_LENGTH 4     // opcode, flags and payload length (start byte not included)
+#define FRAME_CRC_LENGTH 2
+#define FRAME_CRC_INITIAL 0xFFFF  // CRC-16/CCITT-FALSE
+#define FRAME_CRC_POLYNOMIAL 0x1021
+#define FRAME_FLAG_REQUEST_ID 0x01  // Payload starts with a little-endian uint16 request ID
 
 #include "commandconstants.h"
 #include "ledarray.h"
 
+#define BENCHMARK_DISPATCH_ITERATIONS_DEFAULT 1000
+
+// Command latency histograms, kept per command index. Bucket n counts times below 4^(n+1) us (the last bucket has no upper limit).
+#define LATENCY_BUCKET_COUNT 8
+#define LATENCY_PHASE_COUNT 3
+#define LATENCY_PHASE_RECEIVE 0   // First byte of the command to its newline (or last frame byte), including incremental parsing
+#define LATENCY_PHASE_PARSE 1     // Newline to queued (command lookup, argument slicing, frame CRC and decoding)
+#define LATENCY_PHASE_RUN 2       // Dispatch to return, including the array update
+
+// Entry in the sorted command name lookup table
+struct CommandTableEntry {
+  const char * name;
+  int16_t command_index;    // Index in command_list, or COMMAND_COUNT + device command index
+};
+
+// Parsed command waiting in the command queue
+struct QueuedCommand {
+  char command[MAX_COMMAND_LENGTH + 1];
+  int16_t command_index;
+  uint16_t argc;
+  void ** argv;              // Points into the parse arena
+  int16_t * led_numbers;     // Led number list of setSeqValue
+  bool led_list_frame;       // led command from a binary frame (argv holds argc uint16 led numbers)
+  uint8_t error;
+  uint16_t request_id;       // Echoed in machine mode responses
+  uint32_t receive_us;       // Receive and parse phases of the latency histogram
+  uint32_t parse_us;
+  uint16_t arena_start;      // Range of the parse arena used by this command
+  uint16_t arena_end;
+};
+
 class CommandRouter {
   public:
-    int getArgumentBitDepth(char * command_header);
-    void route(char * command_header, int16_t argc, void ** argv, int16_t * argument_led_number_list);
+    int getArgumentBitDepth(int16_t command_index);
+    bool isLedValueListCommand(int16_t command_index);
+    void dispatch(int16_t command_index, int16_t argc, void ** argv, int16_t * argument_led_number_list);
+    int16_t getCommandIndex(const char * command_header);
+    int16_t getCommandIndexLinear(const char * command_header);
+    void buildCommandTable();
+    void benchmarkDispatch(int16_t argc, char * * argv);
     void processSerialStream();
-    int getArgumentLedNumberPitch(char * command_header);
+    void runNextCommand();
+    uint16_t getCrc16(const uint8_t * data, uint16_t length, uint16_t crc);
+    int getArgumentLedNumberPitch(int16_t command_index);
     void printHelp();
     void setLedArray(LedArray *  new_led_array);
     void printTerminator();
+    void printResponse(uint16_t request_id);
+    void runTask();
+    void abortTask();
+    bool isTaskSafe(int16_t command_index);
+    void setMachineMode(int16_t argc, char * * argv);
+    void printNotImplemented(const char * command_header);
     void setDebug(int16_t argc, char * * argv);
+    void printParserStats();
+    void recordLatency(int16_t command_index, uint8_t phase, uint32_t elapsed_us);
+    void printLatency();
+    void setSequenceBulk(uint16_t length, const uint8_t * payload);
 
   private:
+    bool parseByte(uint8_t new_byte);
+    void beginCommand();
+    void discardCommand();
+    bool finishArgument();
+    void storeNumericArgument();
+    bool finishAsciiCommand();
+    void finishBinaryFrame();
+    int16_t getOpcodeCommandIndex(uint8_t opcode);
+    void queueCommand(uint8_t error, uint16_t argc, void ** argv, int16_t * led_numbers, bool led_list_frame);
+    uint8_t ensureParseArena(uint32_t byte_count);
+    uint16_t reserveParseArena(uint16_t byte_count, bool align);
+    void * getRecordPointer(uint16_t offset);
+    bool isCommandQueued(int16_t queued_command_index);
+    int8_t getHexDigitValue(uint8_t character);
+    void beginImage(uint8_t bit_depth);
+    void storeImageBits(uint8_t bits, uint8_t bit_count);
+    void finishImageFrame();
+
     // Standard element variables
     int debug = 0;
 
@@ -57,14 +159,71 @@ class CommandRouter {
     LedArray * led_array;
     bool send_termination_char = true;
     char command [MAX_COMMAND_LENGTH + 1]; // Allow for terminating null byte
-    char * * argv;
     char current_argument[MAX_ARGUMENT_ELEMENT_LENGTH + 1];
 
-    char * * argument_list = NULL;
-    bool * argument_list_bool = NULL;
-    uint8_t * argument_list_uint8 = NULL;
-    uint16_t * argument_list_uint16 = NULL;
-    int16_t * argument_led_number_list = NULL;
+    // Serial input which has not been parsed yet
+    uint8_t serial_buffer[SERIAL_BUFFER_SIZE];
+    uint16_t serial_buffer_head = 0;
+    uint16_t serial_buffer_count = 0;
+
+    // Parser state, kept between calls to processSerialStream
+    uint8_t parser_state = PARSER_IDLE;
+    elapsedMicros command_elapsed_us;
+    uint32_t receive_us = 0;
+    uint16_t command_position = 0;
+    uint16_t argument_element_position = 0;
+    uint16_t argument_count = 0;
+    uint16_t argument_led_count = 0;
+    uint16_t argument_total_count = 0;
+    uint16_t argument_max_led_count = 0;
+    uint16_t argument_max_value_count = 0;
+    int argument_bit_depth = -1;
+    int argument_led_number_pitch = -1;
+    int16_t command_index = -1;
+    uint16_t request_id = 0;
+    uint16_t argument_values_offset = 0;       // Offsets of numeric argument lists in the current record
+    uint16_t argument_led_numbers_offset = 0;
+    uint16_t argument_range_count = 0;         // LED ranges in the current led number list (see LED_NUMBER_RANGE)
+    uint8_t argument_error = COMMAND_ERROR_NONE; // Error found while parsing the arguments (reported when the command runs)
+    uint8_t frame_header[FRAME_HEADER_LENGTH + 1];
+    uint8_t frame_header_position = 0;
+    uint16_t frame_payload_length = 0;
+    uint16_t frame_payload_position = 0;
+    elapsedMillis frame_elapsed_ms;
+
+    // Commands which have been parsed but not run yet
+    QueuedCommand command_queue[COMMAND_QUEUE_LENGTH];
+    uint8_t command_queue_head = 0;
+    uint8_t command_queue_count = 0;
+    uint8_t command_queue_high_water_mark = 0;
+
+    // Parse arena, which holds the arguments of queued commands (in order, wrapping around to the start of the
+    // arena) followed by the record of the command being parsed, so no heap memory is used while parsing
+    uint8_t parse_arena[PARSE_ARENA_SIZE] __attribute__((aligned(4)));
+    uint16_t record_start = 0;
+    uint16_t record_length = 0;
+    uint16_t parse_arena_queued = 0;
+    uint16_t parse_arena_high_water_mark = 0;
+
+    // Image (img command) being decoded into the array buffer. Only one image is in flight at a time,
+    // since an image is not started until all queued commands have run.
+    uint8_t image_bit_depth = 0;
+    uint16_t image_value_count = 0;    // Complete values received
+    uint16_t image_value = 0;          // Value being received
+    uint8_t image_digit_count = 0;     // Hex digits (ASCII) or bytes (frame) of the value being received
+    uint16_t image_crc = 0;            // CRC of an img frame, computed as it is received
+    uint16_t image_frame_crc = 0;      // CRC sent at the end of an img frame
+
+    // Request ID of the command which started the running task, which responds when the task ends
+    uint16_t task_request_id = 0;
+
+    // Short and long command names (including device commands), sorted for binary search
+    CommandTableEntry * command_table = NULL;
+    uint16_t command_table_length = 0;
+
+    // Latency histogram counts, indexed by [command index][phase][bucket]
+    uint16_t * latency_histogram = NULL;
+    uint16_t latency_command_count = 0;
 };
 
 void CommandRouter::printHelp()
@@ -93,6 +252,121 @@ void CommandRouter::printHelp()
 void CommandRouter::setLedArray(LedArray* new_led_array)
 {
   led_array = new_led_array;
+
+  // Device commands are only known once the led array is set
+  buildCommandTable();
+}
+
+/* Builds a table of all short and long command names (standard and device-specific), sorted by name so commands can be looked up by binary search */
+void CommandRouter::buildCommandTable()
+{
+  if (command_table != NULL)
+    delete[] command_table;
+
+  uint8_t device_command_count = led_array->getDeviceCommandCount();
+  command_table_length = 2 * (COMMAND_COUNT + device_command_count);
+  command_table = new CommandTableEntry[command_table_length];
+
+  if (latency_histogram != NULL)
+    delete[] latency_histogram;
+  latency_command_count = COMMAND_COUNT + device_command_count;
+  latency_histogram = new uint16_t[latency_command_count * LATENCY_PHASE_COUNT * LATENCY_BUCKET_COUNT]();
+
+  uint16_t table_index = 0;
+  for (int16_t command_index = 0; command_index < COMMAND_COUNT; command_index++)
+  {
+    command_table[table_index++] = {command_list[command_index][0], command_index};
+    command_table[table_index++] = {command_list[command_index][1], command_index};
+  }
+  for (int16_t device_command_index = 0; device_command_index < device_command_count; device_command_index++)
+  {
+    command_table[table_index++] = {led_array->getDeviceCommandNameShort(device_command_index), (int16_t)(COMMAND_COUNT + device_command_index)};
+    command_table[table_index++] = {led_array->getDeviceCommandNameLong(device_command_index), (int16_t)(COMMAND_COUNT + device_command_index)};
+  }
+
+  // Insertion sort (only run once, at setup)
+  for (uint16_t sort_index = 1; sort_index < command_table_length; sort_index++)
+  {
+    CommandTableEntry entry = command_table[sort_index];
+    int16_t insert_index = sort_index - 1;
+    while ((insert_index >= 0) && (strcmp(command_table[insert_index].name, entry.name) > 0))
+    {
+      command_table[insert_index + 1] = command_table[insert_index];
+      insert_index--;
+    }
+    command_table[insert_index + 1] = entry;
+  }
+
+  for (table_index = 1; table_index < command_table_length; table_index++)
+    if (strcmp(command_table[table_index - 1].name, command_table[table_index].name) == 0)
+      Serial.printf(F("ERROR (CommandRouter::buildCommandTable): Duplicate command name %s%s"), command_table[table_index].name, SERIAL_LINE_ENDING);
+}
+
+/* Returns the command index for a short or long command name, or -1 if the command does not exist */
+int16_t CommandRouter::getCommandIndex(const char * command_header)
+{
+  int16_t low = 0;
+  int16_t high = command_table_length - 1;
+  while (low <= high)
+  {
+    int16_t middle = (low + high) / 2;
+    int comparison = strcmp(command_header, command_table[middle].name);
+    if (comparison == 0)
+      return (command_table[middle].command_index);
+    else if (comparison < 0)
+      high = middle - 1;
+    else
+      low = middle + 1;
+  }
+  return (-1);
+}
+
+/* Linear scan over all command names, used only as a reference by benchmarkDispatch */
+int16_t CommandRouter::getCommandIndexLinear(const char * command_header)
+{
+  for (int16_t command_index = 0; command_index < COMMAND_COUNT; command_index++)
+    if ((strcmp(command_header, command_list[command_index][0]) == 0) || (strcmp(command_header, command_list[command_index][1]) == 0))
+      return (command_index);
+
+  for (int16_t device_command_index = 0; device_command_index < led_array->getDeviceCommandCount(); device_command_index++)
+    if ((strcmp(command_header, led_array->getDeviceCommandNameShort(device_command_index)) == 0) || (strcmp(command_header, led_array->getDeviceCommandNameLong(device_command_index)) == 0))
+      return (COMMAND_COUNT + device_command_index);
+
+  return (-1);
+}
+
+/* Prints the average time to look up every command name using the lookup table and using a linear scan. Only the
+   lookup is timed (the commands are not run); printLatency gives the end-to-end time of each command. */
+void CommandRouter::benchmarkDispatch(int16_t argc, char * * argv)
+{
+  uint32_t iterations = BENCHMARK_DISPATCH_ITERATIONS_DEFAULT;
+  if (argc >= 1)
+    iterations = max((uint32_t)strtoul(argv[0], NULL, 0), (uint32_t)1);
+
+  volatile int16_t command_index_sink = 0;
+  uint32_t table_total_ns = 0;
+  uint32_t linear_total_ns = 0;
+  for (uint16_t table_index = 0; table_index < command_table_length; table_index++)
+  {
+    const char * command_name = command_table[table_index].name;
+
+    elapsedMicros elapsed_us;
+    for (uint32_t iteration = 0; iteration < iterations; iteration++)
+      command_index_sink = getCommandIndex(command_name);
+    uint32_t table_ns = (uint32_t)(((uint64_t)elapsed_us * 1000) / iterations);
+
+    elapsed_us = 0;
+    for (uint32_t iteration = 0; iteration < iterations; iteration++)
+      command_index_sink = getCommandIndexLinear(command_name);
+    uint32_t linear_ns = (uint32_t)(((uint64_t)elapsed_us * 1000) / iterations);
+
+    table_total_ns += table_ns;
+    linear_total_ns += linear_ns;
+    Serial.printf(F("%s: table %lu ns, linear %lu ns%s"), command_name, table_ns, linear_ns, SERIAL_LINE_ENDING);
+  }
+  (void)command_index_sink;
+
+  Serial.printf(F("Average over %d command names: table %lu ns, linear %lu ns%s"), command_table_length, table_total_ns / command_table_length, linear_total_ns / command_table_length, SERIAL_LINE_ENDING);
 }
 
 void CommandRouter::setDebug(int16_t argc, char * * argv)
@@ -123,525 +397,1403 @@ void CommandRouter::setDebug(int16_t argc, char * * argv)
     interface_debug = 10 * (uint8_t)atoi(argv[1]) + (uint8_t)atoi(argv[2]);
   }
   else
-    Serial.printf(F("ERROR (CommandRouter::setDebug): Invalud argument count.%s"), SERIAL_LINE_ENDING);
+    led_array->printError(F("ERROR (CommandRouter::setDebug): Invalud argument count.%s"), SERIAL_LINE_ENDING);
 
   // User feedback
-  Serial.printf(F("(CommandRouter::setDebug): Debug level is %d \n"), debug);
+  if (led_array->getMachineMode())
+    led_array->setResponsePayload(F("%d"), debug);
+  else
+    Serial.printf(F("(CommandRouter::setDebug): Debug level is %d \n"), debug);
 
   // Set lower-level debug
   led_array->setDebug(interface_debug); // Set all to the same vaue
 }
 
-int CommandRouter::getArgumentBitDepth(char * command_header)
+void CommandRouter::setMachineMode(int16_t argc, char * * argv)
+{
+  if (argc == 0)
+    led_array->setMachineMode(!led_array->getMachineMode());
+  else if (argc == 1)
+    led_array->setMachineMode(atoi(argv[0]) > 0);
+  else
+    led_array->printError(F("ERROR (CommandRouter::setMachineMode): Invalid argument count.%s"), SERIAL_LINE_ENDING);
+
+  if (!led_array->getMachineMode())
+    Serial.printf(F("Machine response mode is now 0%s"), SERIAL_LINE_ENDING);
+}
+
+void CommandRouter::printParserStats()
+{
+  Serial.printf(F("Parse arena: %d bytes, high-water mark %d bytes%s"), PARSE_ARENA_SIZE, parse_arena_high_water_mark, SERIAL_LINE_ENDING);
+  Serial.printf(F("Command queue: %d commands, high-water mark %d commands%s"), COMMAND_QUEUE_LENGTH, command_queue_high_water_mark, SERIAL_LINE_ENDING);
+}
+
+/* Adds a phase time of a command to its latency histogram. Counts saturate instead of wrapping around. */
+void CommandRouter::recordLatency(int16_t command_index, uint8_t phase, uint32_t elapsed_us)
+{
+  if ((command_index < 0) || (command_index >= latency_command_count))
+    return;
+
+  // Buckets are powers of 4, so the bucket is half the bit length of the time
+  uint8_t bucket = min((uint8_t)((31 - __builtin_clz(elapsed_us | 1)) / 2), (uint8_t)(LATENCY_BUCKET_COUNT - 1));
+  uint16_t * count = latency_histogram + (command_index * LATENCY_PHASE_COUNT + phase) * LATENCY_BUCKET_COUNT + bucket;
+  if (*count < UINT16_MAX)
+    (*count)++;
+}
+
+/* Prints one line per command which has run since the last call: the short command name followed by the bucket counts
+   of the receive, parse and run phases, then clears all counts */
+void CommandRouter::printLatency()
+{
+  Serial.printf(F("Latency buckets (us): <4,<16,<64,<256,<1024,<4096,<16384,>=16384. Phases: receive parse run%s"), SERIAL_LINE_ENDING);
+  for (int16_t command_index = 0; command_index < latency_command_count; command_index++)
+  {
+    uint16_t * counts = latency_histogram + command_index * LATENCY_PHASE_COUNT * LATENCY_BUCKET_COUNT;
+    bool empty = true;
+    for (uint16_t count_index = 0; count_index < LATENCY_PHASE_COUNT * LATENCY_BUCKET_COUNT; count_index++)
+      empty = empty && (counts[count_index] == 0);
+    if (empty)
+      continue;
+
+    if (command_index < COMMAND_COUNT)
+      Serial.print(command_list[command_index][0]);
+    else
+      Serial.print(led_array->getDeviceCommandNameShort(command_index - COMMAND_COUNT));
+    for (uint16_t count_index = 0; count_index < LATENCY_PHASE_COUNT * LATENCY_BUCKET_COUNT; count_index++)
+      Serial.printf(F("%s%u"), (count_index % LATENCY_BUCKET_COUNT == 0) ? " " : ",", counts[count_index]);
+    Serial.print(SERIAL_LINE_ENDING);
+  }
+  memset(latency_histogram, 0, latency_command_count * LATENCY_PHASE_COUNT * LATENCY_BUCKET_COUNT * sizeof(uint16_t));
+}
+
+/* Replaces the sequence with a bulk upload (see LedArray::setSequencePatterns) and acknowledges it with the
+   pattern count and the CRC-16 of the payload, which the host can compare with the CRC of what it sent */
+void CommandRouter::setSequenceBulk(uint16_t length, const uint8_t * payload)
+{
+  if (!led_array->setSequencePatterns(length, payload))
+    return;
+
+  uint16_t crc = getCrc16(payload, length, FRAME_CRC_INITIAL);
+  if (led_array->getMachineMode())
+    led_array->setResponsePayload(F("%d,%u"), led_array->getSequenceLength(), crc);
+  else
+    Serial.printf(F("Stored %d patterns (checksum 0x%04X)%s"), led_array->getSequenceLength(), crc, SERIAL_LINE_ENDING);
+}
+
+/* Returns true for commands which take an led count, then an led number and one value per color channel for each led
+   (ssv, and spsh which streams patterns in the same format) */
+bool CommandRouter::isLedValueListCommand(int16_t command_index)
 {
-  if ((strcmp(command_header, command_list[CMD_SET_SEQ_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_SEQ_IDX][1]) == 0))
+  return ((command_index == CMD_SET_SEQ_IDX) || (command_index == CMD_PUSH_STREAM));
+}
+
+int CommandRouter::getArgumentBitDepth(int16_t command_index)
+{
+  if (isLedValueListCommand(command_index))
     return (led_array->getSequenceBitDepth());
   else
     return (-1);
 }
 
 /* This function is used to dictate the pitch of led numbers in a command stream. Very value at this pitch will be stored as a uint16_t instead of the default datatype */
-int CommandRouter::getArgumentLedNumberPitch(char * command_header)
+int CommandRouter::getArgumentLedNumberPitch(int16_t command_index)
 {
-  if ((strcmp(command_header, command_list[CMD_SET_SEQ_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_SEQ_IDX][1]) == 0))
+  if (isLedValueListCommand(command_index))
     return (led_array->getColorChannelCount() + 1);
   else
     return (-1);
 }
 
-void CommandRouter::route(char * command_header, int16_t argc, void ** argv, int16_t * argument_led_number_list)
-{
-  if ((strcmp(command_header, command_list[CMD_HELP_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_HELP_IDX][1]) == 0))
-    printHelp();
-  else if ((strcmp(command_header, command_list[CMD_ABOUT_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_ABOUT_IDX][1]) == 0))
-    led_array->printAbout();
-  else if ((strcmp(command_header, command_list[CMD_REBOOT_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_REBOOT_IDX][1]) == 0))
-    led_array->reset();
-  else if ((strcmp(command_header, command_list[CMD_SHOW_VERSION][0]) == 0) || (strcmp(command_header, command_list[CMD_SHOW_VERSION][1]) == 0))
-    led_array->printVersion();
-
-  else if ((strcmp(command_header, command_list[CMD_AUTOCLEAR_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_AUTOCLEAR_IDX][1]) == 0))
-    led_array->toggleAutoClear(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_NA_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_NA_IDX][1]) == 0))
-    led_array->setNa(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_SET_COLOR_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_COLOR_IDX][1]) == 0))
-    led_array->setColor(argc, (char * *) argv);
- else if ((strcmp(command_header, command_list[CMD_SET_BRIGHTNESS][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_BRIGHTNESS][1]) == 0))
-    led_array->setBrightness(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_SET_ARRAY_DIST][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_ARRAY_DIST][1]) == 0))
-    led_array->setDistanceZ(argc, (char * *) argv);
-
-  else if ((strcmp(command_header, command_list[CMD_LED_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_LED_IDX][1]) == 0))
-    led_array->drawLedList(argc, (char * *)argv);
-
-  else if ((strcmp(command_header, command_list[CMD_CLEAR_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_CLEAR_IDX][1]) == 0))
-    led_array->clear();
-  else if ((strcmp(command_header, command_list[CMD_FILL_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_FILL_IDX][1]) == 0))
-    led_array->fillArray();
-  else if ((strcmp(command_header, command_list[CMD_BF_IDX][0]) == 0)  || (strcmp(command_header, command_list[CMD_BF_IDX][1]) == 0))
-    led_array->drawBrightfield(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_DF_IDX][0]) == 0)  || (strcmp(command_header, command_list[CMD_DF_IDX][1]) == 0))
-    led_array->drawDarkfield();
-  else if ((strcmp(command_header, command_list[CMD_DPC_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_DPC_IDX][1]) == 0))
-    led_array->drawDpc(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_CDPC_IDX][0]) == 0)  || (strcmp(command_header, command_list[CMD_CDPC_IDX][1]) == 0))
-    led_array->drawCdpc(argc, (char * *)argv);
-  else if ((strcmp(command_header, command_list[CMD_AN_IDX][0]) == 0)  || (strcmp(command_header, command_list[CMD_AN_IDX][1]) == 0))
-    led_array->drawAnnulus(argc, (char * *)argv);
-  else if ((strcmp(command_header, command_list[CMD_HALF_ANNULUS][0]) == 0) || (strcmp(command_header, command_list[CMD_HALF_ANNULUS][1]) == 0))
-    led_array->drawHalfAnnulus(argc, (char * *)argv);
-  else if ((strcmp(command_header, command_list[CMD_CDF_IDX][0]) == 0)  || (strcmp(command_header, command_list[CMD_CDF_IDX][1]) == 0))
-    led_array->drawColorDarkfield(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_NAV_DPC_IDX][0]) == 0)  || (strcmp(command_header, command_list[CMD_NAV_DPC_IDX][1]) == 0))
-    led_array->drawNavDpc();
-
-  else if ((strcmp(command_header, command_list[CMD_SCF_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_SCB_IDX][1]) == 0))
-    led_array->scanAllLeds(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_SCB_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_SCB_IDX][1]) == 0))
-    led_array->scanBrightfieldLeds(argc, (char * *) argv);
-
-  else if ((strcmp(command_header, command_list[CMD_LEN_SEQ_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_LEN_SEQ_IDX][1]) == 0))
-    led_array->setSequenceLength(strtoul((char *) argv[0], NULL, 0), false);
-  else if ((strcmp(command_header, command_list[CMD_SET_SEQ_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_SEQ_IDX][1]) == 0))
-    led_array->setSequenceValue(argc, argv, argument_led_number_list);
-  else if ((strcmp(command_header, command_list[CMD_RUN_SEQ_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_RUN_SEQ_IDX][1]) == 0))
-    led_array->runSequence(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_RUN_SEQ_FAST_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_RUN_SEQ_FAST_IDX][1]) == 0))
-    led_array->runSequenceFast(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_PRINT_SEQ_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_PRINT_SEQ_IDX][1]) == 0))
-    led_array->printSequence();
-  else if ((strcmp(command_header, command_list[CMD_PRINT_SEQ_LENGTH_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_PRINT_SEQ_LENGTH_IDX][1]) == 0))
-    led_array->printSequenceLength();
-  else if ((strcmp(command_header, command_list[CMD_STEP_SEQ_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_STEP_SEQ_IDX][1]) == 0))
-    led_array->stepSequence(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_RESET_SEQ_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_RESET_SEQ_IDX][1]) == 0))
-    led_array->resetSequence();
-  else if ((strcmp(command_header, command_list[CMD_SET_SEQ_BIT_DEPTH][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_SEQ_BIT_DEPTH][1]) == 0))
-    led_array->setSequenceBitDepth(atoi((char *) argv[0]), false); // second arg is quiet
-  else if ((strcmp(command_header, command_list[CMD_SET_SEQ_ZEROS][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_SEQ_ZEROS][1]) == 0))
-    led_array->setSequenceZeros(argc, (char * *) argv);
-
-  else if ((strcmp(command_header, command_list[CMD_TRIG_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_TRIG_IDX][1]) == 0))
-  {
-    if (argc == 0)
-      led_array->sendTriggerPulse(0, true);
-    else if (argc == 1)
-      led_array->sendTriggerPulse(atoi((char *) argv[0]), true);
-  }
-  else if ((strcmp(command_header, command_list[CMD_TRIG_SETUP_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_TRIG_SETUP_IDX][1]) == 0))
-    led_array->triggerSetup(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_TRIG_PRINT_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_TRIG_PRINT_IDX][1]) == 0))
-    led_array->printTriggerSettings();
-  else if ((strcmp(command_header, command_list[CMD_TRIG_TEST_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_TRIG_TEST_IDX][1]) == 0))
-    led_array->triggerInputTest(strtoul((char *) argv[0], NULL, 0));
-
-
-  else if ((strcmp(command_header, command_list[CMD_PRINT_VALS_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_PRINT_VALS_IDX][1]) == 0))
-    led_array->printCurrentLedValues();
-  else if ((strcmp(command_header, command_list[CMD_CHANNEL_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_CHANNEL_IDX][1]) == 0))
-    led_array->drawChannel(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_TOGGLE_DEBUG_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_TOGGLE_DEBUG_IDX][1]) == 0))
-    setDebug(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_PIN_ORDER_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_PIN_ORDER_IDX][1]) == 0))
-    led_array->setPinOrder(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_PRINT_LED_POSITIONS][0]) == 0) || (strcmp(command_header, command_list[CMD_PRINT_LED_POSITIONS][1]) == 0))
-    led_array->printLedPositions(false);
-  else if ((strcmp(command_header, command_list[CMD_PRINT_LED_POSITIONS_NA][0]) == 0) || (strcmp(command_header, command_list[CMD_PRINT_LED_POSITIONS_NA][1]) == 0))
-    led_array->printLedPositions(true);
-  else if ((strcmp(command_header, command_list[CMD_DELAY][0]) == 0) || (strcmp(command_header, command_list[CMD_DELAY][1]) == 0))
-    delay(strtoul((char *) argv[0], NULL, 0));
-  else if ((strcmp(command_header, command_list[CMD_SET_MAX_CURRENT][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_MAX_CURRENT][1]) == 0))
-    led_array->setMaxCurrentLimit(argc, (char * *) argv);
-  else if ((strcmp(command_header, command_list[CMD_SET_MAX_CURRENT_ENFORCEMENT][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_MAX_CURRENT_ENFORCEMENT][1]) == 0))
-    led_array->setMaxCurrentEnforcement(argc, (char * *) argv);
-
-  else if ((strcmp(command_header, command_list[CMD_DISCO_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_DISCO_IDX][1]) == 0))
-    led_array->drawDiscoPattern();
-  else if ((strcmp(command_header, command_list[CMD_PRINT_PARAMS][0]) == 0) || (strcmp(command_header, command_list[CMD_PRINT_PARAMS][1]) == 0))
-    led_array->printSystemParams();
-  else if ((strcmp(command_header, command_list[CMD_DEMO_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_DEMO_IDX][1]) == 0))
-    led_array->demo();
-  else if ((strcmp(command_header, command_list[CMD_WATER_IDX][0]) == 0) || (strcmp(command_header, command_list[CMD_WATER_IDX][1]) == 0))
-    led_array->waterDrop();
-  else if ((strcmp(command_header, command_list[CMD_SET_SN][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_SN][1]) == 0))
-    led_array->setPartNumber(strtoul((char *) argv[0], NULL, 0));
-  else if ((strcmp(command_header, command_list[CMD_SET_PN][0]) == 0) || (strcmp(command_header, command_list[CMD_SET_PN][1]) == 0))
-    led_array->setSerialNumber(strtoul((char *) argv[0], NULL, 0));
-  
-  else
+void CommandRouter::printNotImplemented(const char * command_header)
+{
+  led_array->printError(F("Command [%s] is not implemented yet.%s"), command_header, SERIAL_LINE_ENDING);
+}
+
+/* Runs a command by index (see commandconstants.h). Device-specific commands follow at COMMAND_COUNT + device command index. */
+void CommandRouter::dispatch(int16_t command_index, int16_t argc, void ** argv, int16_t * argument_led_number_list)
+{
+  // Animated commands update the array many times, so they can not be deferred to a commit
+  if (led_array->isBatchOpen())
   {
-    // Check if the command is equal to any device-specific commands
-    bool command_found = false;
-    for (uint16_t command_index = 0; command_index < led_array->getDeviceCommandCount(); command_index++)
+    switch (command_index)
     {
-      if ((strcmp(command_header, led_array->getDeviceCommandNameShort(command_index)) == 0) || (strcmp(command_header, led_array->getDeviceCommandNameLong(command_index)) == 0))
+      case CMD_SCF_IDX:
+      case CMD_SCB_IDX:
+      case CMD_RUN_SEQ_IDX:
+      case CMD_RUN_SEQ_FAST_IDX:
+      case CMD_RUN_PLAYLIST:
+      case CMD_RUN_STREAM:
+      case CMD_DISCO_IDX:
+      case CMD_DEMO_IDX:
+      case CMD_WATER_IDX:
+      case CMD_TRIG_TEST_IDX:
+      case CMD_COMPILE_SEQ:
+      case CMD_SAVE_SEQ_FLASH:
+      case CMD_DELETE_SEQ_FLASH:
+        led_array->setResponseStatus(RESPONSE_STATUS_REJECTED);
+        led_array->printError(F("ERROR (CommandRouter::dispatch): Command %s can not be run inside a batch%s"), command_list[command_index][0], SERIAL_LINE_ENDING);
+        return;
+    }
+  }
+
+  switch (command_index)
+  {
+    case CMD_HELP_IDX:
+      printHelp();
+      break;
+    case CMD_ABOUT_IDX:
+      led_array->printAbout();
+      break;
+    case CMD_REBOOT_IDX:
+      led_array->reset();
+      break;
+    case CMD_SHOW_VERSION:
+      led_array->printVersion();
+      break;
+
+    case CMD_AUTOCLEAR_IDX:
+      led_array->toggleAutoClear(argc, (char * *) argv);
+      break;
+    case CMD_NA_IDX:
+      led_array->setNa(argc, (char * *) argv);
+      break;
+    case CMD_SET_COLOR_IDX:
+      led_array->setColor(argc, (char * *) argv);
+      break;
+    case CMD_SET_BRIGHTNESS:
+      led_array->setBrightness(argc, (char * *) argv);
+      break;
+    case CMD_SET_ARRAY_DIST:
+      led_array->setDistanceZ(argc, (char * *) argv);
+      break;
+
+    case CMD_LED_IDX:
+      led_array->drawLedList(argc, (char * *)argv);
+      break;
+
+    case CMD_CLEAR_IDX:
+      led_array->clear();
+      break;
+    case CMD_FILL_IDX:
+      led_array->fillArray();
+      break;
+    case CMD_BF_IDX:
+      led_array->drawBrightfield(argc, (char * *) argv);
+      break;
+    case CMD_DF_IDX:
+      led_array->drawDarkfield();
+      break;
+    case CMD_DPC_IDX:
+      led_array->drawDpc(argc, (char * *) argv);
+      break;
+    case CMD_CDPC_IDX:
+      led_array->drawCdpc(argc, (char * *)argv);
+      break;
+    case CMD_AN_IDX:
+      led_array->drawAnnulus(argc, (char * *)argv);
+      break;
+    case CMD_HALF_ANNULUS:
+      led_array->drawHalfAnnulus(argc, (char * *)argv);
+      break;
+    case CMD_CDF_IDX:
+      led_array->drawColorDarkfield(argc, (char * *) argv);
+      break;
+    case CMD_NAV_DPC_IDX:
+      led_array->drawNavDpc();
+      break;
+
+    case CMD_SCF_IDX:
+      led_array->scanAllLeds(argc, (char * *) argv);
+      break;
+    case CMD_SCB_IDX:
+      led_array->scanBrightfieldLeds(argc, (char * *) argv);
+      break;
+
+    case CMD_LEN_SEQ_IDX:
+      led_array->setSequenceLength(strtoul((char *) argv[0], NULL, 0), (argc >= 2) ? strtoul((char *) argv[1], NULL, 0) : 0, (argc >= 3) && (strtoul((char *) argv[2], NULL, 0) != 0), false);
+      break;
+    case CMD_SET_SEQ_IDX:
+      if (argument_led_number_list != NULL)
+        led_array->setSequenceValue(argc, argv, argument_led_number_list);
+      else
+        led_array->printError(F("ERROR (CommandRouter::dispatch): Missing led count for setSeqValue%s"), SERIAL_LINE_ENDING);
+      break;
+    case CMD_PUSH_STREAM:
+      if (argument_led_number_list != NULL)
+        led_array->pushStreamPattern(argc, argv, argument_led_number_list);
+      else
+        led_array->printError(F("ERROR (CommandRouter::dispatch): Missing led count for pushStreamPattern%s"), SERIAL_LINE_ENDING);
+      break;
+    case CMD_RUN_SEQ_IDX:
+      led_array->runSequence(argc, (char * *) argv);
+      break;
+    case CMD_RUN_SEQ_FAST_IDX:
+      led_array->runSequenceFast(argc, (char * *) argv);
+      break;
+    case CMD_PRINT_SEQ_IDX:
+      led_array->printSequence();
+      break;
+    case CMD_PRINT_SEQ_LENGTH_IDX:
+      led_array->printSequenceLength();
+      break;
+    case CMD_STEP_SEQ_IDX:
+      led_array->stepSequence(argc, (char * *) argv);
+      break;
+    case CMD_RESET_SEQ_IDX:
+      led_array->resetSequence();
+      break;
+    case CMD_SET_SEQ_BIT_DEPTH:
+      led_array->setSequenceBitDepth(atoi((char *) argv[0]), false); // second arg is quiet
+      break;
+    case CMD_SET_SEQ_ZEROS:
+      led_array->setSequenceZeros(argc, (char * *) argv);
+      break;
+
+    case CMD_TRIG_IDX:
+      if (argc == 0)
+        led_array->sendTriggerPulse(0, true);
+      else if (argc == 1)
+        led_array->sendTriggerPulse(atoi((char *) argv[0]), true);
+      break;
+    case CMD_TRIG_SETUP_IDX:
+      led_array->triggerSetup(argc, (char * *) argv);
+      break;
+    case CMD_TRIG_PRINT_IDX:
+      led_array->printTriggerSettings();
+      break;
+    case CMD_TRIG_TEST_IDX:
+      led_array->triggerInputTest(strtoul((char *) argv[0], NULL, 0));
+      break;
+
+    case CMD_PRINT_VALS_IDX:
+      led_array->printCurrentLedValues();
+      break;
+    case CMD_CHANNEL_IDX:
+      led_array->drawChannel(argc, (char * *) argv);
+      break;
+    case CMD_TOGGLE_DEBUG_IDX:
+      setDebug(argc, (char * *) argv);
+      break;
+    case CMD_PIN_ORDER_IDX:
+      led_array->setPinOrder(argc, (char * *) argv);
+      break;
+    case CMD_PRINT_LED_POSITIONS:
+      led_array->printLedPositions(false);
+      break;
+    case CMD_PRINT_LED_POSITIONS_NA:
+      led_array->printLedPositions(true);
+      break;
+    case CMD_DELAY:
+      delay(strtoul((char *) argv[0], NULL, 0));
+      break;
+    case CMD_SET_MAX_CURRENT:
+      led_array->setMaxCurrentLimit(argc, (char * *) argv);
+      break;
+    case CMD_SET_MAX_CURRENT_ENFORCEMENT:
+      led_array->setMaxCurrentEnforcement(argc, (char * *) argv);
+      break;
+
+    case CMD_DISCO_IDX:
+      led_array->drawDiscoPattern();
+      break;
+    case CMD_PRINT_PARAMS:
+      led_array->printSystemParams();
+      break;
+    case CMD_DEMO_IDX:
+      led_array->demo();
+      break;
+    case CMD_WATER_IDX:
+      led_array->waterDrop();
+      break;
+    case CMD_SET_SN:
+      led_array->setPartNumber(strtoul((char *) argv[0], NULL, 0));
+      break;
+    case CMD_SET_PN:
+      led_array->setSerialNumber(strtoul((char *) argv[0], NULL, 0));
+      break;
+
+
+    case CMD_BENCHMARK_DISPATCH:
+      benchmarkDispatch(argc, (char * *) argv);
+      break;
+    case CMD_PRINT_PARSER_STATS:
+      printParserStats();
+      break;
+
+    case CMD_BEGIN_BATCH:
+      led_array->beginBatch();
+      break;
+    case CMD_COMMIT_BATCH:
+      led_array->commitBatch();
+      break;
+
+    case CMD_MACHINE_MODE:
+      setMachineMode(argc, (char * *) argv);
+      break;
+
+    case CMD_TASK_STATUS:
+      led_array->printTaskStatus();
+      break;
+    case CMD_ABORT_TASK:
+      abortTask();
+      break;
+
+    case CMD_PRINT_LATENCY:
+      printLatency();
+      break;
+
+    case CMD_DRAW_IMAGE:
+      led_array->drawImage(image_bit_depth, image_value_count);
+      beginImage(0);
+      break;
+
+    case CMD_SET_SEQ_BULK:
+      setSequenceBulk(argc, (const uint8_t *) argv);
+      break;
+
+    case CMD_COMPILE_SEQ:
+      led_array->compileSequence();
+      break;
+
+    case CMD_PRINT_MEMORY:
+      led_array->printMemory(argc, (char * *) argv);
+      break;
+
+    case CMD_SAVE_SEQ_FLASH:
+      led_array->saveSequenceToFlash(argc, (char * *) argv);
+      break;
+
+    case CMD_LOAD_SEQ_FLASH:
+      led_array->loadSequenceFromFlash(argc, (char * *) argv);
+      break;
+
+    case CMD_DELETE_SEQ_FLASH:
+      led_array->deleteFlashSequence(argc, (char * *) argv);
+      break;
+
+    case CMD_LIST_SEQ_FLASH:
+      led_array->printFlashSequences();
+      break;
+
+    case CMD_GENERATE_SEQ:
+      led_array->generateSequence(argc, (char * *) argv);
+      break;
+
+    case CMD_SELECT_SEQ_SLOT:
+      led_array->selectSequenceSlot(argc, (char * *) argv);
+      break;
+
+    case CMD_SET_PLAYLIST:
+      led_array->setPlaylist(argc, (char * *) argv);
+      break;
+
+    case CMD_RUN_PLAYLIST:
+      led_array->runPlaylist(argc, (char * *) argv);
+      break;
+
+    case CMD_RUN_STREAM:
+      led_array->runStream(argc, (char * *) argv);
+      break;
+
+    case CMD_END_STREAM:
+      led_array->endStream();
+      break;
+
+    case CMD_PRINT_SEQ_HASH:
+      led_array->printSequenceHash();
+      break;
+
+    default:
+      if ((command_index >= COMMAND_COUNT) && (command_index < COMMAND_COUNT + led_array->getDeviceCommandCount()))
+        led_array->deviceCommand(command_index - COMMAND_COUNT, argc, (char * *) argv);
+      else if ((command_index >= 0) && (command_index < COMMAND_COUNT))
       {
-        led_array->deviceCommand(command_index, argc, (char * *) argv);
-        command_found = true;
+        led_array->setResponseStatus(RESPONSE_STATUS_NOT_IMPLEMENTED);
+        printNotImplemented(command_list[command_index][0]);
       }
-    }
+      break;
+  }
+}
 
-    if (!command_found)
+/* CRC-16/CCITT-FALSE used to validate binary frames */
+uint16_t CommandRouter::getCrc16(const uint8_t * data, uint16_t length, uint16_t crc)
+{
+  for (uint16_t byte_index = 0; byte_index < length; byte_index++)
+  {
+    crc ^= ((uint16_t)data[byte_index]) << 8;
+    for (uint8_t bit_index = 0; bit_index < 8; bit_index++)
     {
-      Serial.print(F("Command ["));
-      Serial.print(command_header);
-      Serial.print(F("] is not implemented yet."));
+      if (crc & 0x8000)
+        crc = (crc << 1) ^ FRAME_CRC_POLYNOMIAL;
+      else
+        crc = crc << 1;
     }
   }
+  return (crc);
+}
+
+void CommandRouter::printTerminator()
+{
+  if (send_termination_char)
+  {
+    Serial.print(SERIAL_COMMAND_TERMINATOR);
+    Serial.print(SERIAL_LINE_ENDING);
+  }
+}
+
+/* Ends the output of a command. In machine mode this is a single line with the request ID, status code and optional
+   payload of the command, otherwise the command terminator. */
+void CommandRouter::printResponse(uint16_t request_id)
+{
+  if (!led_array->getMachineMode())
+    printTerminator();
+  else if (led_array->getResponsePayload()[0] != 0)
+    Serial.printf(F("%u %u %s%s"), request_id, led_array->getResponseStatus(), led_array->getResponsePayload(), SERIAL_LINE_ENDING);
+  else
+    Serial.printf(F("%u %u%s"), request_id, led_array->getResponseStatus(), SERIAL_LINE_ENDING);
 }
 
+/* Reads all available serial input into the serial buffer and parses as much of it as possible. Completed
+   commands are added to the command queue, which is run by runNextCommand. This function never blocks. */
 void CommandRouter::processSerialStream()
 {
-  // Initialize command string
-  memset(command, 0, sizeof(command));
+  // Move new bytes to the serial buffer
+  uint32_t available_count = Serial.available();
+  while ((available_count > 0) && (serial_buffer_count < SERIAL_BUFFER_SIZE))
+  {
+    uint16_t tail = (serial_buffer_head + serial_buffer_count) & (SERIAL_BUFFER_SIZE - 1);
+    uint16_t read_count = min(available_count, (uint32_t)min(SERIAL_BUFFER_SIZE - serial_buffer_count, SERIAL_BUFFER_SIZE - tail));
+    read_count = Serial.readBytes((char *) serial_buffer + tail, read_count);
+    if (read_count == 0)
+      break;
+    serial_buffer_count += read_count;
+    available_count -= read_count;
+  }
 
-  // Initialize empty argument element
-  memset(current_argument, 0, sizeof(current_argument));
+  // Parse buffered bytes until the parser has to wait for queued commands to run
+  while ((serial_buffer_count > 0) && parseByte(serial_buffer[serial_buffer_head]))
+  {
+    serial_buffer_head = (serial_buffer_head + 1) & (SERIAL_BUFFER_SIZE - 1);
+    serial_buffer_count--;
+  }
 
-  // Initialize indexing variables used locally by this function
-  uint16_t command_position = 0;
-  uint16_t argument_element_position = 0;
-  uint16_t argument_count = 0;
-  uint16_t argument_led_count = 0;
-  uint16_t argument_total_count = 0;
-  uint16_t argument_max_led_count = 0;
-  bool argument_flag = false;
-  int argument_bit_depth = -1;
-  int argument_led_number_pitch = -1;
-
-  while (Serial.available() > 0)
-  {
-    const byte new_byte = Serial.read();
-    switch (new_byte)
-    {
-      case '\n':   // end of text
-        {
-          command[command_position] = 0;     // terminating null byte
-          if (argument_flag)
-          {
-            if (debug > 0) {
-              Serial.print(F("Copying new argument inside newline with index "));
-              Serial.print(argument_total_count);
-              Serial.print(F(" with bit depth "));
-              Serial.print(argument_bit_depth);
-              Serial.print(SERIAL_LINE_ENDING);
-            }
+  // Drop binary frames which stopped arriving part-way through
+  if (((parser_state == PARSER_FRAME_HEADER) || (parser_state == PARSER_FRAME_PAYLOAD) || (parser_state == PARSER_DISCARD_FRAME) || (parser_state == PARSER_IMAGE_FRAME))
+      && (serial_buffer_count == 0) && (frame_elapsed_ms > FRAME_TIMEOUT_MS) && (command_queue_count < COMMAND_QUEUE_LENGTH))
+  {
+    record_length = 0;
+    queueCommand(COMMAND_ERROR_FRAME_TIMEOUT, 0, NULL, NULL, false);
+  }
+}
 
-            // Character argument (standard)
-            if (argument_bit_depth == -1)
-            {
-              argument_list[argument_count] = new char[argument_element_position + 1]; // Allow for null terminating byte
-              memcpy(argument_list[argument_count], current_argument, sizeof(char) * argument_element_position + 1); // Also copy null terminating byte
-            }
-            else
-            {
-              if ((argument_bit_depth > 0) && (argument_total_count == 1))
-              {
-                if (argument_bit_depth == 1) // numerical argument (standard)
-                  argument_list_bool = new bool[1];
-                else if (argument_bit_depth == 8)
-                  argument_list_uint8 = new uint8_t[1];
-                else
-                  argument_list_uint16 = new uint16_t[1];
-
-                argument_led_number_list = new int16_t[1];
-                argument_led_number_list[0] = 0;
-              }
-              if (argument_bit_depth == 1) // numerical argument (standard)
-                argument_list_bool[argument_count]  = atoi(current_argument) > 0;
-              else if (argument_bit_depth == 8)
-                argument_list_uint8[argument_count]  = (uint8_t)atoi(current_argument);
-              else
-                argument_list_uint16[argument_count]  = strtoul(current_argument, NULL, 0);
-            }
+/* Parses one byte of serial input. Returns false if the byte can not be used until a queued command has run
+   (because the command queue or parse arena is full), in which case the same byte should be passed again. */
+bool CommandRouter::parseByte(uint8_t new_byte)
+{
+  switch (parser_state)
+  {
+    case PARSER_IDLE:
+      {
+        beginCommand();
+        if (new_byte == SERIAL_FRAME_START)
+        {
+          // Binary frames are recognized by their start byte, which never begins an ASCII command
+          frame_header[0] = new_byte;
+          frame_header_position = 1;
+          frame_elapsed_ms = 0;
+          parser_state = PARSER_FRAME_HEADER;
+          return (true);
+        }
+        parser_state = PARSER_COMMAND;
+        return (parseByte(new_byte));
+      }
+    case PARSER_COMMAND:
+      {
+        if (new_byte == '\n')
+          return (finishAsciiCommand());
+        else if (new_byte == SERIAL_DELIMITER[0])
+        {
+          command[command_position] = 0; // Add null terminating byte
+          command_index = getCommandIndex(command);
 
-            if (debug > 0)
-            {
-              Serial.print("Copied new argument with value: ");
-              Serial.print(current_argument);
-              Serial.print(" and desired bit depth ");
-              Serial.print(argument_bit_depth);
-              Serial.print(" to new variable which is now ");
-              if (argument_bit_depth == -1)
-              {
-                Serial.print(argument_list[argument_count]);
-                Serial.print(SERIAL_LINE_ENDING);
-              }
-              else if (argument_bit_depth == 1)
-              {
-                Serial.print(argument_list_bool[argument_count]);
-                Serial.print(SERIAL_LINE_ENDING);
-              }
-              else if (argument_bit_depth == 8)
-              {
-                Serial.print(argument_list_uint8[argument_count]);
-                Serial.print(SERIAL_LINE_ENDING);
-              }
-              else if (argument_bit_depth == 16)
-              {
-                Serial.print(argument_list_uint16[argument_count]);
-                Serial.print(SERIAL_LINE_ENDING);
-              }
-            }
+          // The argument format of setSeqValue depends on the sequence bit depth, which may be changed by a queued ssbd
+          // (or sslot, which selects another sequence)
+          if ((getArgumentBitDepth(command_index) > 0) && (isCommandQueued(CMD_SET_SEQ_BIT_DEPTH) || isCommandQueued(CMD_SELECT_SEQ_SLOT)))
+            return (false);
 
-            // Increment number of optional arguments
-            argument_count++;
-            argument_total_count++;
+          // Images are written to the array buffer as they are received, so all earlier commands must run first
+          if (command_index == CMD_DRAW_IMAGE)
+          {
+            if (command_queue_count > 0)
+              return (false);
+            abortTask();
           }
 
-          if (debug > 0)
+          // Bulk uploads carry their frame payload as a single hex argument
+          if (command_index == CMD_SET_SEQ_BULK)
           {
-            Serial.print("Command: ");
-            Serial.print(command);
-            Serial.print(SERIAL_LINE_ENDING);
-            if (argument_flag)
-            {
-              for (uint16_t arg_index = 0; arg_index < argument_count; arg_index++)
-              {
-                Serial.print(" Argument ");
-                Serial.print(arg_index);
-                Serial.print(": ");
-                if (argument_bit_depth == -1)
-                  Serial.print(argument_list[arg_index]);
-                else
-                {
-                  if (argument_bit_depth == 1)
-                    Serial.print(argument_list_bool[arg_index]);
-                  else if (argument_bit_depth == 8)
-                    Serial.print(argument_list_uint8[arg_index]);
-                  else if (argument_bit_depth == 16)
-                    Serial.print(argument_list_uint16[arg_index]);
-                }
-                Serial.print(SERIAL_LINE_ENDING);
-              }
-            }
+            parser_state = PARSER_PAYLOAD_HEX;
+            return (true);
           }
-          if (argument_flag)
-            if (argument_led_count > 0)
-              argument_led_number_list[0] = argument_led_count;
 
-          // Parse command and arguments based on bit depth
+          // Get argument bit depth and LED number pitch from command header
+          argument_bit_depth = getArgumentBitDepth(command_index);
+          argument_led_number_pitch = getArgumentLedNumberPitch(command_index);
+          parser_state = PARSER_ARGUMENTS;
+
+          if (debug > 1)
+            Serial.printf(F("Switching to argument mode%s"), SERIAL_LINE_ENDING);
+        }
+        else if ((new_byte == SERIAL_REQUEST_ID_DELIMITER[0]) && (command_position > 0) && (strspn(command, "0123456789") == command_position))
+        {
+          // Digits before the delimiter are a request ID, the command name follows
+          request_id = strtoul(command, NULL, 10);
+          memset(command, 0, sizeof(command));
+          command_position = 0;
+        }
+        else if (command_position >= MAX_COMMAND_LENGTH)
+          Serial.printf(F("ERROR: Command was too long! %s"), SERIAL_LINE_ENDING);
+        else
+          command[command_position++] = new_byte;
+        return (true);
+      }
+    case PARSER_ARGUMENTS:
+      {
+        if (new_byte == '\n')
+          return (finishAsciiCommand());
+        else if (new_byte == SERIAL_DELIMITER[0])
+          return (finishArgument());
+        else if (argument_element_position >= MAX_ARGUMENT_ELEMENT_LENGTH)
+          Serial.printf(F("ERROR: Optional element was too long!%s"), SERIAL_LINE_ENDING);
+        else
+        {
+          // Character arguments are written directly to the parse arena
           if (argument_bit_depth == -1)
-            route(command, argument_count, (void **) argument_list, argument_led_number_list);
-          else if (argument_bit_depth == 1)
-            route(command, argument_count, (void **) argument_list_bool, argument_led_number_list);
-          else if (argument_bit_depth == 8)
-            route(command, argument_count, (void **) argument_list_uint8, argument_led_number_list);
-          else if (argument_bit_depth == 16)
-            route(command, argument_count, (void **) argument_list_uint16, argument_led_number_list);
-
-          // Clear serial buffer so we don't act on any serial input received during command processing.
-          while (Serial.available())
-            Serial.read();
-
-          if (argument_count > 0)
           {
-            // Delete argument list elements
-            if (argument_bit_depth == -1)
+            uint8_t arena_status = ensureParseArena(1);
+            if (arena_status == PARSE_ARENA_WAIT)
+              return (false);
+            else if (arena_status == PARSE_ARENA_FULL)
             {
-              for (uint16_t argument_index = 0; argument_index < argument_count; argument_index++)
-              {
-                delete[] argument_list[argument_index];
-                if (debug > 1)
-                {
-                  Serial.print(" Deallocated argument ");
-                  Serial.print(argument_index);
-                  Serial.print(SERIAL_LINE_ENDING);
-                }
-              }
-              delete[] argument_list;
+              discardCommand();
+              return (true);
             }
-            else if (argument_bit_depth == 1)
-              delete[] argument_list_bool;
-            else if (argument_bit_depth == 8)
-              delete[] argument_list_uint8;
-            else if (argument_bit_depth == 16)
-              delete[] argument_list_uint16;
-
-            if (argument_led_number_pitch >= 0)
-              delete[] argument_led_number_list;
+            *(char *) getRecordPointer(reserveParseArena(1, false)) = new_byte;
           }
-
-          if (send_termination_char)
+          current_argument[argument_element_position++] = new_byte;
+        }
+        return (true);
+      }
+    case PARSER_DISCARD_LINE:
+      {
+        if (new_byte == '\n')
+        {
+          if (command_queue_count >= COMMAND_QUEUE_LENGTH)
+            return (false);
+          queueCommand(COMMAND_ERROR_ARENA_FULL, 0, NULL, NULL, false);
+        }
+        return (true);
+      }
+    case PARSER_IMAGE_HEX:
+      {
+        if (new_byte == '\n')
+        {
+          if (command_queue_count >= COMMAND_QUEUE_LENGTH)
+            return (false);
+          receive_us = command_elapsed_us;
+          record_length = 0;
+          if (image_digit_count > 0)
+          {
+            led_array->discardImage();
+            beginImage(0);
+            queueCommand(COMMAND_ERROR_FRAME_LENGTH, 0, NULL, NULL, false);
+          }
+          else
+            queueCommand(COMMAND_ERROR_NONE, 0, NULL, NULL, false);
+        }
+        else if (getHexDigitValue(new_byte) >= 0)
+          storeImageBits(getHexDigitValue(new_byte), 4);
+        return (true);
+      }
+    case PARSER_PAYLOAD_HEX:
+      {
+        if (new_byte == '\n')
+        {
+          if (command_queue_count >= COMMAND_QUEUE_LENGTH)
+            return (false);
+          receive_us = command_elapsed_us;
+          if (argument_element_position > 0)
+          {
+            record_length = 0;
+            queueCommand(COMMAND_ERROR_FRAME_LENGTH, 0, NULL, NULL, false);
+          }
+          else
+            queueCommand(COMMAND_ERROR_NONE, record_length, (void **) getRecordPointer(0), NULL, false);
+        }
+        else if (getHexDigitValue(new_byte) >= 0)
+        {
+          // Each pair of digits is one payload byte, most significant digit first
+          if (argument_element_position == 0)
           {
-            Serial.print(SERIAL_COMMAND_TERMINATOR);
-            Serial.print(SERIAL_LINE_ENDING);
+            uint8_t arena_status = ensureParseArena(1);
+            if (arena_status == PARSE_ARENA_WAIT)
+              return (false);
+            else if (arena_status == PARSE_ARENA_FULL)
+            {
+              discardCommand();
+              return (true);
+            }
+            *(uint8_t *) getRecordPointer(reserveParseArena(1, false)) = getHexDigitValue(new_byte) << 4;
           }
-          break;
+          else
+            *(uint8_t *) getRecordPointer(record_length - 1) |= getHexDigitValue(new_byte);
+          argument_element_position ^= 1;
         }
-      case '.':   // dot SERIAL_DELIMITER
+        return (true);
+      }
+    case PARSER_FRAME_HEADER:
+      {
+        frame_header[frame_header_position] = new_byte;
+        frame_elapsed_ms = 0;
+        if (frame_header_position < FRAME_HEADER_LENGTH)
         {
-          if (!argument_flag) { // This is the case where we've just finished a command and need to initialize argument parameters
-            argument_flag = true;
-            argument_count = 0;
-            command[command_position] = 0; // Add null terminating byte
+          frame_header_position++;
+          return (true);
+        }
 
-            // Get argument bit depth from command header
-            argument_bit_depth = getArgumentBitDepth(command);
+        // Reserve the payload (with room for a terminating null byte) and the lists decoded from it
+        uint8_t opcode = frame_header[1];
+        frame_payload_length = frame_header[3] | ((uint16_t)frame_header[4] << 8);
 
-            // Get LED number Pitch from command header
-            argument_led_number_pitch = getArgumentLedNumberPitch(command);
+        // Sequence values are decoded at the sequence bit depth, which may be changed by a queued ssbd (or sslot)
+        if (isLedValueListCommand(opcode) && (isCommandQueued(CMD_SET_SEQ_BIT_DEPTH) || isCommandQueued(CMD_SELECT_SEQ_SLOT)))
+          return (false);
 
-            // Initialize charater argument list if we're using
-            if (argument_bit_depth <= 0)
-              argument_list = new char * [MAX_ARGUMENT_COUNT_CHAR];
+        // Images are decoded into the array buffer as they are received instead (after all earlier commands have run)
+        if (opcode == CMD_DRAW_IMAGE)
+        {
+          if (command_queue_count > 0)
+            return (false);
+          abortTask();
+          command_index = opcode;
+          strncpy(command, command_list[opcode][0], MAX_COMMAND_LENGTH);
+          beginImage(0);
+          image_crc = getCrc16(frame_header + 1, FRAME_HEADER_LENGTH, FRAME_CRC_INITIAL);
+          image_frame_crc = 0;
+          frame_header_position++;
+          frame_payload_position = 0;
+          parser_state = PARSER_IMAGE_FRAME;
+          return (true);
+        }
+        uint32_t byte_count = frame_payload_length + FRAME_CRC_LENGTH + 1;
+        if (isLedValueListCommand(opcode))
+          byte_count += 3 * (uint32_t)frame_payload_length + 16;
+        else if ((opcode != CMD_LED_IDX) && (opcode != CMD_SET_SEQ_BULK))
+          byte_count += (frame_payload_length + 1) * sizeof(char *) + 4;
 
-            if (debug > 1)
-              Serial.printf("Switching to argument mode%s", SERIAL_LINE_ENDING);
-          }
+        uint8_t arena_status = ensureParseArena(byte_count);
+        if (arena_status == PARSE_ARENA_WAIT)
+          return (false);
 
-          else if (argument_bit_depth > 0 && (argument_flag && argument_total_count == 1))
-          { // This is the case where we're running a numeric storage command (such as setSequenceValue) and need to collect the number of LEDs in the list (first argument), as provided by the user.
-            if (debug > 1) {
-              Serial.print("Processing LED count at index ");
-              Serial.print(argument_total_count);
-              Serial.print(SERIAL_LINE_ENDING);
-              delay(10);
-            }
-            // Get argument LED count
-            argument_max_led_count = strtoul(current_argument, NULL, 0);
+        frame_header_position++;
+        frame_payload_position = 0;
+        if (arena_status == PARSE_ARENA_FULL)
+          parser_state = PARSER_DISCARD_FRAME;
+        else
+        {
+          reserveParseArena(frame_payload_length + FRAME_CRC_LENGTH + 1, true); // Payload is always at the start of the record
+          parser_state = PARSER_FRAME_PAYLOAD;
+        }
+        return (true);
+      }
+    case PARSER_FRAME_PAYLOAD:
+    case PARSER_DISCARD_FRAME:
+      {
+        bool last_byte = (frame_payload_position + 1 == frame_payload_length + FRAME_CRC_LENGTH);
+        if (last_byte && (command_queue_count >= COMMAND_QUEUE_LENGTH))
+          return (false);
 
-            if (argument_max_led_count > 0)
-            {
-              // Initialize argument arrays using bit_depth
-              if (argument_bit_depth == 1)
-                argument_list_bool = new bool[argument_max_led_count];
-              else if (argument_bit_depth == 8)
-                argument_list_uint8 = new uint8_t[argument_max_led_count];
-              else if (argument_bit_depth == 16)
-                argument_list_uint16 = new uint16_t[argument_max_led_count];
-
-              // Initialize LED number list
-              argument_led_number_list = new int16_t [argument_max_led_count];
-            }
-            else
-            { // Case where user types ssl.0 (no leds on)
-              // Initialize argument arrays using bit_depth
-              if (argument_bit_depth == 1)
-              {
-                argument_list_bool = new bool[1];
-                argument_list_bool[0] = 0;
-              }
-              else if (argument_bit_depth == 8)
-              {
-                argument_list_uint8 = new uint8_t[1];
-                argument_list_uint8[0] = 0;
-              }
-              else if (argument_bit_depth == 16)
-              {
-                argument_list_uint16 = new uint16_t[1];
-                argument_list_uint16[0] = 0;
-              }
-
-              // Initialize LED number list
-              argument_led_number_list = new int16_t [1];
-              argument_led_number_list[0] = 0;
-            }
-          }
-          else if ((argument_led_number_pitch > 0) && (((argument_total_count) % argument_led_number_pitch ) == 0))
-          { // In this case, we store a LED number for a numerical list
-            if (debug > 1) {
-              Serial.print("Processing LED number at index ");
-              Serial.print(argument_total_count);
-              Serial.print(F(" ("));
-              Serial.print(current_argument);
-              Serial.printf(F(")%s"), SERIAL_LINE_ENDING);
-            }
+        if (parser_state == PARSER_FRAME_PAYLOAD)
+          ((uint8_t *) getRecordPointer(0))[frame_payload_position] = new_byte;
+        frame_payload_position++;
+        frame_elapsed_ms = 0;
 
-            // If this argument is a LED number, store it in the appropriate array
-            argument_led_number_list[argument_led_count + 1] = strtol(current_argument, NULL, 0);
-            argument_led_count++; // Increment number of leds measured
+        if (last_byte)
+        {
+          if (parser_state == PARSER_FRAME_PAYLOAD)
+            finishBinaryFrame();
+          else
+            queueCommand(COMMAND_ERROR_ARENA_FULL, 0, NULL, NULL, false);
+        }
+        return (true);
+      }
+    case PARSER_IMAGE_FRAME:
+      {
+        // Payload: [request ID (2 bytes, if flagged)][bit depth (1 byte)][values, little-endian]
+        bool last_byte = (frame_payload_position + 1 == frame_payload_length + FRAME_CRC_LENGTH);
+        if (last_byte && (command_queue_count >= COMMAND_QUEUE_LENGTH))
+          return (false);
 
-            if (argument_led_count > argument_max_led_count)
-            {
-              Serial.print(F("ERROR - max led count (")); Serial.print(argument_max_led_count); Serial.printf(F(") reached!%s"), SERIAL_LINE_ENDING);
-            }
-          }
+        uint16_t bit_depth_position = (frame_header[2] & FRAME_FLAG_REQUEST_ID) ? 2 : 0;
+        if (frame_payload_position < frame_payload_length)
+        {
+          image_crc = getCrc16(&new_byte, 1, image_crc);
+          if (frame_payload_position < bit_depth_position)
+            request_id |= (uint16_t)new_byte << (8 * frame_payload_position);
+          else if (frame_payload_position == bit_depth_position)
+            beginImage(new_byte);
           else
-          {
-            if (debug > 1) {
-              Serial.print("Processing argument at index ");
-              Serial.print(argument_total_count);
-              Serial.print(SERIAL_LINE_ENDING);
-              delay(10);
-            }
-            // Copy argument or led value an argument_list
+            storeImageBits(new_byte, 8);
+        }
+        else
+          image_frame_crc |= (uint16_t)new_byte << (8 * (frame_payload_position - frame_payload_length));
+        frame_payload_position++;
+        frame_elapsed_ms = 0;
 
-            // character argument (standard)
-            if (argument_bit_depth == -1)
-            {
-              argument_list[argument_count] = new char[argument_element_position + 1]; // Allow for null terminating byte
-              memcpy(argument_list[argument_count], current_argument, sizeof(char) * argument_element_position + 1); // Also copy null terminating byte
-            }
-            else if (argument_bit_depth == 1) // numerical argument (standard)
-              argument_list_bool[argument_count]  = atoi(current_argument) > 0;
-            else if (argument_bit_depth == 8)
-              argument_list_uint8[argument_count]  = (uint8_t)atoi(current_argument);
-            else
-              argument_list_uint16[argument_count]  = strtoul(current_argument, NULL, 0);
-
-            if (debug > 0)
-            {
-              Serial.print("Copied new argument with value: ");
-              Serial.print(current_argument);
-              Serial.print(" and desired bit depth ");
-              Serial.print(argument_bit_depth);
-              Serial.print(" to new variable which is now ");
-              if (argument_bit_depth == -1)
-              {
-                Serial.print(argument_list[argument_count]);
-                Serial.print(SERIAL_LINE_ENDING);
-              }
-              else if (argument_bit_depth == 1)
-              {
-                Serial.print(argument_list_bool[argument_count]);
-                Serial.print(SERIAL_LINE_ENDING);
-              }
-              else if (argument_bit_depth == 8)
-              {
-                Serial.print(argument_list_uint8[argument_count]);
-                Serial.print(SERIAL_LINE_ENDING);
-              }
-              else if (argument_bit_depth == 16)
-              {
-                Serial.print(argument_list_uint16[argument_count]);
-                Serial.print(SERIAL_LINE_ENDING);
-              }
-            }
-            argument_count++; // Increment number of optional arguments
-          }
-          argument_total_count++;
+        if (last_byte)
+          finishImageFrame();
+        return (true);
+      }
+  }
+  return (true);
+}
 
-          // Clear current argument string to save memory
-          memset(current_argument, 0, sizeof(current_argument));
-          argument_element_position = 0;
-          break;
-        }
-      default:
+/* Resets the parser for a new command, which is stored in the parse arena after the last queued command */
+void CommandRouter::beginCommand()
+{
+  command_elapsed_us = 0;
+  memset(command, 0, sizeof(command));
+  memset(current_argument, 0, sizeof(current_argument));
+  command_position = 0;
+  argument_element_position = 0;
+  argument_count = 0;
+  argument_led_count = 0;
+  argument_total_count = 0;
+  argument_max_led_count = 0;
+  argument_max_value_count = 0;
+  argument_bit_depth = -1;
+  argument_led_number_pitch = -1;
+  argument_range_count = 0;
+  argument_error = COMMAND_ERROR_NONE;
+  command_index = -1;
+  request_id = 0;
+  record_length = 0;
+}
+
+/* Drops the arguments of the current command and skips the rest of it */
+void CommandRouter::discardCommand()
+{
+  record_length = 0;
+  parser_state = PARSER_DISCARD_LINE;
+}
+
+/* Called when a delimiter is received after an argument */
+bool CommandRouter::finishArgument()
+{
+  if ((argument_bit_depth > 0) && (argument_total_count == 0))
+  { // This is the case where we're running a numeric storage command (such as setSequenceValue) and need to collect the number of LEDs in the list (first argument), as provided by the user.
+    uint16_t led_count = strtoul(current_argument, NULL, 0);
+
+    // Initialize argument arrays using bit_depth (one value per color channel of each LED). The case where
+    // user types ssl.0 (no leds on) still needs one value and an empty led number list.
+    uint16_t value_count = (led_count > 0) ? led_count * (argument_led_number_pitch - 1) : 1;
+    uint16_t value_size = (argument_bit_depth == 16) ? sizeof(uint16_t) : sizeof(uint8_t);
+    uint8_t arena_status = ensureParseArena((uint32_t)value_count * value_size + (led_count + 2) * sizeof(int16_t) + 4);
+    if (arena_status == PARSE_ARENA_WAIT)
+      return (false);
+    else if (arena_status == PARSE_ARENA_FULL)
+    {
+      discardCommand();
+      return (true);
+    }
+
+    argument_max_led_count = led_count;
+    argument_max_value_count = (led_count > 0) ? value_count : 0;
+    argument_led_numbers_offset = reserveParseArena((led_count + 2) * sizeof(int16_t), true);
+    argument_values_offset = reserveParseArena(value_count * value_size, true);
+    memset(getRecordPointer(argument_led_numbers_offset), 0, (led_count + 2) * sizeof(int16_t));
+    memset(getRecordPointer(argument_values_offset), 0, value_count * value_size);
+
+    if (debug > 1)
+      Serial.printf(F("Processing LED count (%d)%s"), led_count, SERIAL_LINE_ENDING);
+  }
+  else if ((argument_led_number_pitch > 0) && ((argument_total_count % argument_led_number_pitch) == 1))
+  { // In this case, we store a LED number for a numerical list
+    int16_t range[3];
+    if (argument_led_count >= argument_max_led_count)
+      argument_error = COMMAND_ERROR_ARGUMENT_COUNT;
+    else if (LedArray::parseLedRange(current_argument, range))
+    {
+      // Ranges are stored after the values, and the spare entry at the end of the led number list points to them (it is
+      // moved to follow the last LED number when the command is finished)
+      uint8_t arena_status = ensureParseArena(sizeof(range) + 4);
+      if (arena_status == PARSE_ARENA_WAIT)
+        return (false);
+      else if (arena_status == PARSE_ARENA_FULL)
+      {
+        discardCommand();
+        return (true);
+      }
+      uint16_t range_offset = reserveParseArena(sizeof(range), argument_range_count == 0);
+      memcpy(getRecordPointer(range_offset), range, sizeof(range));
+      int16_t * led_numbers = (int16_t *) getRecordPointer(argument_led_numbers_offset);
+      if (argument_range_count == 0)
+        led_numbers[argument_max_led_count + 1] = (range_offset - argument_led_numbers_offset) / sizeof(int16_t);
+      led_numbers[argument_led_count + 1] = LED_NUMBER_RANGE(argument_range_count);
+      argument_range_count++;
+    }
+    else
+      ((int16_t *) getRecordPointer(argument_led_numbers_offset))[argument_led_count + 1] = strtol(current_argument, NULL, 0);
+    argument_led_count++; // Increment number of leds measured
+
+    if (debug > 1)
+      Serial.printf(F("Processing LED number at index %d (%s)%s"), argument_total_count, current_argument, SERIAL_LINE_ENDING);
+  }
+  else
+  {
+    if (argument_bit_depth == -1)
+    {
+      // Terminate character argument in place
+      uint8_t arena_status = ensureParseArena(1);
+      if (arena_status == PARSE_ARENA_WAIT)
+        return (false);
+      else if (arena_status == PARSE_ARENA_FULL)
+      {
+        discardCommand();
+        return (true);
+      }
+      *(char *) getRecordPointer(reserveParseArena(1, false)) = 0;
+    }
+    else
+      storeNumericArgument();
+
+    if (debug > 1)
+      Serial.printf(F("Processing argument at index %d (%s)%s"), argument_total_count, current_argument, SERIAL_LINE_ENDING);
+    argument_count++; // Increment number of optional arguments
+
+    // The bit depth of an image is followed by its hex values, which are decoded as they are received
+    if (command_index == CMD_DRAW_IMAGE)
+    {
+      beginImage(strtoul(current_argument, NULL, 0));
+      parser_state = PARSER_IMAGE_HEX;
+    }
+  }
+  argument_total_count++;
+
+  // Clear current argument string
+  memset(current_argument, 0, sizeof(current_argument));
+  argument_element_position = 0;
+  return (true);
+}
+
+/* Stores the current argument in the value list of a numeric command */
+void CommandRouter::storeNumericArgument()
+{
+  void * values = getRecordPointer(argument_values_offset);
+  if (argument_count >= argument_max_value_count)
+    argument_error = COMMAND_ERROR_ARGUMENT_COUNT;
+  else if (argument_bit_depth == 1)
+    ((bool *) values)[argument_count] = atoi(current_argument) > 0;
+  else if (argument_bit_depth == 8)
+    ((uint8_t *) values)[argument_count] = (uint8_t)atoi(current_argument);
+  else
+    ((uint16_t *) values)[argument_count] = strtoul(current_argument, NULL, 0);
+}
+
+/* Called when a newline is received. Adds the command to the command queue. */
+bool CommandRouter::finishAsciiCommand()
+{
+  if (command_queue_count >= COMMAND_QUEUE_LENGTH)
+    return (false);
+  receive_us = command_elapsed_us;
+
+  void ** argv = NULL;
+  int16_t * led_numbers = NULL;
+  if (parser_state == PARSER_COMMAND)
+  {
+    // Commands without arguments are looked up here, others when the first delimiter is received
+    command[command_position] = 0;
+    command_index = getCommandIndex(command);
+  }
+  else if (argument_bit_depth == -1)
+  {
+    // Terminate last argument and slice all character arguments, which are stored back-to-back in the arena
+    uint8_t arena_status = ensureParseArena(1 + (argument_count + 1) * sizeof(char *) + 4);
+    if (arena_status == PARSE_ARENA_WAIT)
+      return (false);
+    else if (arena_status == PARSE_ARENA_FULL)
+    {
+      record_length = 0;
+      queueCommand(COMMAND_ERROR_ARENA_FULL, 0, NULL, NULL, false);
+      return (true);
+    }
+
+    *(char *) getRecordPointer(reserveParseArena(1, false)) = 0;
+    argument_count++;
+    argument_total_count++;
+
+    char ** argument_list = (char **) getRecordPointer(reserveParseArena(argument_count * sizeof(char *), true));
+    char * argument = (char *) getRecordPointer(0);
+    for (uint16_t argument_index = 0; argument_index < argument_count; argument_index++)
+    {
+      argument_list[argument_index] = argument;
+      argument += strlen(argument) + 1;
+    }
+    argv = (void **) argument_list;
+  }
+  else
+  {
+    // Numeric command without any led numbers (e.g. ssv.0)
+    if (argument_total_count == 0)
+    {
+      uint8_t arena_status = ensureParseArena(2 * sizeof(int16_t) + sizeof(uint16_t) + 8);
+      if (arena_status == PARSE_ARENA_WAIT)
+        return (false);
+      argument_max_value_count = 1;
+      argument_led_numbers_offset = reserveParseArena(2 * sizeof(int16_t), true);
+      argument_values_offset = reserveParseArena(sizeof(uint16_t), true);
+      memset(getRecordPointer(argument_led_numbers_offset), 0, 2 * sizeof(int16_t) + sizeof(uint16_t));
+    }
+
+    storeNumericArgument();
+    argument_count++;
+    argument_total_count++;
+
+    argv = (void **) getRecordPointer(argument_values_offset);
+    led_numbers = (int16_t *) getRecordPointer(argument_led_numbers_offset);
+    if (argument_led_count > 0)
+      led_numbers[0] = argument_led_count;
+
+    // The range table offset was stored after the last entry of the list, and moves up to follow the last LED number
+    // given (see LED_NUMBER_RANGE) if the list is not full
+    if (argument_led_count < argument_max_led_count)
+    {
+      led_numbers[argument_led_count + 1] = led_numbers[argument_max_led_count + 1];
+      led_numbers[argument_max_led_count + 1] = 0;
+    }
+  }
+
+  if (debug > 0)
+  {
+    Serial.printf(F("Command: %s%s"), command, SERIAL_LINE_ENDING);
+    if ((argument_bit_depth == -1) && (argv != NULL))
+      for (uint16_t argument_index = 0; argument_index < argument_count; argument_index++)
+        Serial.printf(F(" Argument %d: %s%s"), argument_index, ((char **) argv)[argument_index], SERIAL_LINE_ENDING);
+    Serial.printf(F("Parsed command with %d arguments in %lu us%s"), argument_total_count, (uint32_t)command_elapsed_us, SERIAL_LINE_ENDING);
+  }
+
+  queueCommand(argument_error, argument_count, argv, led_numbers, false);
+  return (true);
+}
+
+/* Returns the command index of a binary frame opcode, or -1 if no command has this opcode. Core commands have their
+   index in command_list as opcode, device-specific commands DEVICE_COMMAND_OPCODE_BASE + device command index. */
+int16_t CommandRouter::getOpcodeCommandIndex(uint8_t opcode)
+{
+  if (opcode < COMMAND_COUNT)
+    return (opcode);
+  else if ((opcode >= DEVICE_COMMAND_OPCODE_BASE) && (opcode - DEVICE_COMMAND_OPCODE_BASE < led_array->getDeviceCommandCount()))
+    return (COMMAND_COUNT + opcode - DEVICE_COMMAND_OPCODE_BASE);
+  return (-1);
+}
+
+/* Called when the last byte of a binary frame is received (see getOpcodeCommandIndex for opcodes). The led and
+   setSeqValue commands carry typed payloads, all other commands carry their usual dot-delimited argument string as
+   the payload. */
+void CommandRouter::finishBinaryFrame()
+{
+  receive_us = command_elapsed_us;
+  uint8_t opcode = frame_header[1];
+  uint8_t * payload = (uint8_t *) getRecordPointer(0);
+  int16_t opcode_command_index = getOpcodeCommandIndex(opcode);
+  command_index = (opcode_command_index >= 0) ? opcode_command_index : opcode; // Unknown opcodes are kept for the error message
+  if (opcode_command_index >= COMMAND_COUNT)
+    strncpy(command, led_array->getDeviceCommandNameShort(opcode_command_index - COMMAND_COUNT), MAX_COMMAND_LENGTH);
+  else if (opcode_command_index >= 0)
+    strncpy(command, command_list[opcode_command_index][0], MAX_COMMAND_LENGTH);
+
+  // Check CRC (computed over header and payload)
+  uint16_t frame_crc = payload[frame_payload_length] | ((uint16_t)payload[frame_payload_length + 1] << 8);
+  uint16_t crc = getCrc16(frame_header + 1, FRAME_HEADER_LENGTH, FRAME_CRC_INITIAL);
+  crc = getCrc16(payload, frame_payload_length, crc);
+  payload[frame_payload_length] = 0;
+
+  if (debug > 0)
+    Serial.printf(F("Received frame with opcode %d and %d payload bytes in %lu us%s"), opcode, frame_payload_length, (uint32_t)command_elapsed_us, SERIAL_LINE_ENDING);
+
+  // Remove the request ID from the start of the payload
+  bool request_id_missing = false;
+  if ((crc == frame_crc) && (frame_header[2] & FRAME_FLAG_REQUEST_ID))
+  {
+    if (frame_payload_length < 2)
+      request_id_missing = true;
+    else
+    {
+      request_id = payload[0] | ((uint16_t)payload[1] << 8);
+      payload += 2;
+      frame_payload_length -= 2;
+    }
+  }
+
+  if (crc != frame_crc)
+    queueCommand(COMMAND_ERROR_FRAME_CRC, 0, NULL, NULL, false);
+  else if (request_id_missing)
+    queueCommand(COMMAND_ERROR_FRAME_LENGTH, 0, NULL, NULL, false);
+  else if (opcode == CMD_LED_IDX)
+  {
+    // Payload is a list of little-endian uint16 led numbers, which is used in place (the payload is 2-byte aligned)
+    queueCommand(COMMAND_ERROR_NONE, frame_payload_length / 2, (void **) payload, NULL, true);
+  }
+  else if (isLedValueListCommand(opcode))
+  {
+    // Payload is a uint16 led count followed by an int16 led number and one value per color channel for each led
+    // (one byte, or two little-endian bytes for 16-bit sequences, which are aligned when copied)
+    uint16_t color_channel_count = led_array->getColorChannelCount();
+    uint16_t value_size = (led_array->getSequenceBitDepth() == 16) ? 2 : 1;
+    uint16_t led_count = (frame_payload_length >= 2) ? (payload[0] | ((uint16_t)payload[1] << 8)) : 0;
+    if (frame_payload_length != 2 + led_count * (2 + color_channel_count * value_size))
+      queueCommand(COMMAND_ERROR_FRAME_LENGTH, 0, NULL, NULL, false);
+    else
+    {
+      int16_t * led_numbers = (int16_t *) getRecordPointer(reserveParseArena((led_count + 2) * sizeof(int16_t), true));
+      uint8_t * values = (uint8_t *) getRecordPointer(reserveParseArena(led_count > 0 ? led_count * color_channel_count * value_size : 2, true));
+      memset(led_numbers, 0, (led_count + 2) * sizeof(int16_t));
+      led_numbers[0] = led_count;
+      const uint8_t * entry = payload + 2;
+      for (uint16_t led_index = 0; led_index < led_count; led_index++)
+      {
+        led_numbers[led_index + 1] = (int16_t)(entry[0] | ((uint16_t)entry[1] << 8));
+        memcpy(values + led_index * color_channel_count * value_size, entry + 2, color_channel_count * value_size);
+        entry += 2 + color_channel_count * value_size;
+      }
+      queueCommand(COMMAND_ERROR_NONE, led_count * color_channel_count, (void **) values, led_numbers, false);
+    }
+  }
+  else if (opcode == CMD_SET_SEQ_BULK)
+  {
+    // Payload is used in place (see LedArray::setSequencePatterns)
+    queueCommand(COMMAND_ERROR_NONE, frame_payload_length, (void **) payload, NULL, false);
+  }
+  else if (opcode_command_index >= 0)
+  {
+    // Split the argument string in place
+    uint16_t argument_count = 0;
+    if (frame_payload_length > 0)
+    {
+      argument_count = 1;
+      for (uint16_t byte_index = 0; byte_index < frame_payload_length; byte_index++)
+        if (payload[byte_index] == SERIAL_DELIMITER[0])
+          argument_count++;
+    }
+
+    char * * argument_list_frame = (char * *) getRecordPointer(reserveParseArena(argument_count * sizeof(char *), true));
+    if (argument_count > 0)
+    {
+      uint16_t argument_index = 0;
+      argument_list_frame[argument_index++] = (char *) payload;
+      for (uint16_t byte_index = 0; byte_index < frame_payload_length; byte_index++)
+      {
+        if (payload[byte_index] == SERIAL_DELIMITER[0])
         {
-          // keep adding if not full ... allow for terminating null byte
-          if (argument_flag)
-          {
-            if (argument_element_position > MAX_ARGUMENT_ELEMENT_LENGTH)
-              Serial.printf(F("ERROR: Optional element was too long!%s"), SERIAL_LINE_ENDING);
-            else
-            {
-              // append this to the current optional argument
-              current_argument[argument_element_position] = new_byte;
-              argument_element_position++; // increment optional position
-            }
-          }
-          else
-          {
-            if (command_position >= MAX_COMMAND_LENGTH)
-              Serial.printf(F("ERROR: Command was too long! %s"), SERIAL_LINE_ENDING);
-            else
-              command [command_position++] = new_byte;
-          }
-          break;
+          payload[byte_index] = 0;
+          argument_list_frame[argument_index++] = (char *) payload + byte_index + 1;
         }
-    }  // end of switch
+      }
+    }
+    queueCommand(COMMAND_ERROR_NONE, argument_count, (void **) argument_list_frame, NULL, false);
+  }
+  else
+    queueCommand(COMMAND_ERROR_FRAME_OPCODE, 0, NULL, NULL, false);
+}
+
+/* Returns true if a command with this index is waiting in the command queue */
+bool CommandRouter::isCommandQueued(int16_t queued_command_index)
+{
+  for (uint8_t queue_index = 0; queue_index < command_queue_count; queue_index++)
+    if (command_queue[(command_queue_head + queue_index) % COMMAND_QUEUE_LENGTH].command_index == queued_command_index)
+      return (true);
+  return (false);
+}
+
+/* Returns the value of a hex digit (either case), or -1 for any other character */
+int8_t CommandRouter::getHexDigitValue(uint8_t character)
+{
+  if ((character >= '0') && (character <= '9'))
+    return (character - '0');
+  else if (((character | 0x20) >= 'a') && ((character | 0x20) <= 'f'))
+    return ((character | 0x20) - 'a' + 10);
+  else
+    return (-1);
+}
+
+/* Starts decoding the values of an image */
+void CommandRouter::beginImage(uint8_t bit_depth)
+{
+  image_bit_depth = bit_depth;
+  image_value_count = 0;
+  image_value = 0;
+  image_digit_count = 0;
+}
+
+/* Adds a hex digit (bit_count 4, most significant digit first) or a frame byte (bit_count 8, least significant byte first)
+   to the current image value, and writes the value to the array buffer once it is complete */
+void CommandRouter::storeImageBits(uint8_t bits, uint8_t bit_count)
+{
+  if (bit_count == 4)
+    image_value = (image_value << 4) | bits;
+  else
+    image_value |= (uint16_t)bits << (8 * image_digit_count);
+  image_digit_count++;
+  if (image_digit_count * bit_count < image_bit_depth)
+    return;
+
+  if (image_bit_depth == 8)
+    led_array->setImageValue(image_value_count, (uint16_t)(image_value * UINT16_MAX / UINT8_MAX));
+  else if (image_bit_depth == 16)
+    led_array->setImageValue(image_value_count, image_value);
+  image_value_count++;
+  image_value = 0;
+  image_digit_count = 0;
+}
+
+/* Called when the last byte of an img frame is received */
+void CommandRouter::finishImageFrame()
+{
+  receive_us = command_elapsed_us;
+  record_length = 0;
+
+  uint16_t values_position = (frame_header[2] & FRAME_FLAG_REQUEST_ID) ? 3 : 1;
+  if (debug > 0)
+    Serial.printf(F("Received image frame with %d values in %lu us%s"), image_value_count, (uint32_t)command_elapsed_us, SERIAL_LINE_ENDING);
+
+  // Failed images are not drawn, and the values already written are cleared from the array buffer
+  uint8_t error = COMMAND_ERROR_NONE;
+  if (image_crc != image_frame_crc)
+  {
+    request_id = 0;
+    error = COMMAND_ERROR_FRAME_CRC;
+  }
+  else if ((frame_payload_length < values_position) || (image_digit_count > 0))
+    error = COMMAND_ERROR_FRAME_LENGTH;
+
+  if (error != COMMAND_ERROR_NONE)
+  {
+    led_array->discardImage();
+    beginImage(0);
+  }
+  queueCommand(error, 0, NULL, NULL, false);
+}
+
+/* Adds the current command (stored in the current parse arena record) to the command queue */
+void CommandRouter::queueCommand(uint8_t error, uint16_t argc, void ** argv, int16_t * led_numbers, bool led_list_frame)
+{
+  QueuedCommand * queued_command = &command_queue[(command_queue_head + command_queue_count) % COMMAND_QUEUE_LENGTH];
+  memcpy(queued_command->command, command, sizeof(command));
+  queued_command->command_index = command_index;
+  queued_command->argc = argc;
+  queued_command->argv = argv;
+  queued_command->led_numbers = led_numbers;
+  queued_command->led_list_frame = led_list_frame;
+  queued_command->error = error;
+  queued_command->request_id = request_id;
+  queued_command->receive_us = receive_us;
+  queued_command->parse_us = (uint32_t)command_elapsed_us - receive_us;
+  queued_command->arena_start = record_start;
+  queued_command->arena_end = record_start + record_length;
+
+  parse_arena_queued += record_length;
+  command_queue_count++;
+  if (command_queue_count > command_queue_high_water_mark)
+    command_queue_high_water_mark = command_queue_count;
+
+  // The next command is stored after this one
+  record_start = min((uint16_t)((record_start + record_length + 3) & ~3), (uint16_t)PARSE_ARENA_SIZE);
+  record_length = 0;
+  parser_state = PARSER_IDLE;
+}
+
+/* Runs the oldest command in the command queue (if any) */
+void CommandRouter::runNextCommand()
+{
+  if (command_queue_count == 0)
+    return;
+
+  QueuedCommand * queued_command = &command_queue[command_queue_head];
+
+  // Streamed patterns wait for room in the buffer of the playing stream. Serial input is no longer read once the parse
+  // arena or command queue fills up meanwhile, which holds back the host.
+  if ((queued_command->command_index == CMD_PUSH_STREAM) && (queued_command->error == COMMAND_ERROR_NONE) && !led_array->hasStreamSpace(queued_command->led_numbers))
+    return;
+
+  // Commands other than status queries stop the running task, as any serial input used to
+  if (led_array->isTaskRunning() && ((queued_command->error != COMMAND_ERROR_NONE) || !isTaskSafe(queued_command->command_index)))
+    abortTask();
+
+  bool task_running = led_array->isTaskRunning();
+  elapsedMicros elapsed_us;
+  led_array->beginResponse();
+
+  if (queued_command->error == COMMAND_ERROR_ARENA_FULL)
+  {
+    led_array->setResponseStatus(RESPONSE_STATUS_ARENA_FULL);
+    led_array->printError(F("ERROR (CommandRouter::runNextCommand): Command [%s] was not run since its arguments did not fit in the parse arena (%d bytes).%s"), queued_command->command, PARSE_ARENA_SIZE, SERIAL_LINE_ENDING);
+  }
+  else if (queued_command->error == COMMAND_ERROR_FRAME_CRC)
+  {
+    led_array->setResponseStatus(RESPONSE_STATUS_FRAME_CRC);
+    led_array->printError(F("ERROR (CommandRouter::runNextCommand): Frame CRC mismatch.%s"), SERIAL_LINE_ENDING);
+  }
+  else if (queued_command->error == COMMAND_ERROR_FRAME_TIMEOUT)
+  {
+    led_array->setResponseStatus(RESPONSE_STATUS_FRAME_TIMEOUT);
+    led_array->printError(F("ERROR (CommandRouter::runNextCommand): Timed out reading frame.%s"), SERIAL_LINE_ENDING);
+  }
+  else if (queued_command->error == COMMAND_ERROR_FRAME_OPCODE)
+  {
+    led_array->setResponseStatus(RESPONSE_STATUS_UNKNOWN_COMMAND);
+    led_array->printError(F("ERROR (CommandRouter::runNextCommand): Invalid opcode (%d)%s"), queued_command->command_index, SERIAL_LINE_ENDING);
+  }
+  else if (queued_command->error == COMMAND_ERROR_FRAME_LENGTH)
+  {
+    led_array->setResponseStatus(RESPONSE_STATUS_FRAME_LENGTH);
+    led_array->printError(F("ERROR (CommandRouter::runNextCommand): Invalid %s payload length%s"), queued_command->command, SERIAL_LINE_ENDING);
+  }
+  else if (queued_command->error == COMMAND_ERROR_ARGUMENT_COUNT)
+    led_array->printError(F("ERROR (CommandRouter::runNextCommand): Command [%s] was not run since it has more LED numbers or values than its LED count allows.%s"), queued_command->command, SERIAL_LINE_ENDING);
+  else if (queued_command->command_index < 0)
+  {
+    led_array->setResponseStatus(RESPONSE_STATUS_UNKNOWN_COMMAND);
+    printNotImplemented(queued_command->command);
+  }
+  else if (queued_command->led_list_frame)
+    led_array->drawLedList(queued_command->argc, (uint16_t *) queued_command->argv);
+  else
+    dispatch(queued_command->command_index, queued_command->argc, queued_command->argv, queued_command->led_numbers);
+
+  uint32_t run_us = elapsed_us;
+  if (queued_command->error == COMMAND_ERROR_NONE)
+  {
+    recordLatency(queued_command->command_index, LATENCY_PHASE_RECEIVE, queued_command->receive_us);
+    recordLatency(queued_command->command_index, LATENCY_PHASE_PARSE, queued_command->parse_us);
+    recordLatency(queued_command->command_index, LATENCY_PHASE_RUN, run_us);
+  }
+
+  if (debug > 0)
+    Serial.printf(F("Ran command %s in %lu us%s"), queued_command->command, run_us, SERIAL_LINE_ENDING);
+
+  // Release this command's arguments
+  parse_arena_queued -= queued_command->arena_end - queued_command->arena_start;
+  command_queue_head = (command_queue_head + 1) % COMMAND_QUEUE_LENGTH;
+  command_queue_count--;
+
+  // Commands which start a task respond when the task ends (see runTask)
+  if (!task_running && led_array->isTaskRunning())
+    task_request_id = queued_command->request_id;
+  else
+    printResponse(queued_command->request_id);
+}
+
+/* Runs one step of the running task (if any), and sends the response of the command which started it once it ends */
+void CommandRouter::runTask()
+{
+  if (!led_array->isTaskRunning())
+    return;
+
+  led_array->beginResponse();
+  led_array->runTask();
+  if (!led_array->isTaskRunning())
+    printResponse(task_request_id);
+}
+
+/* Stops the running task (if any) and sends the response of the command which started it */
+void CommandRouter::abortTask()
+{
+  if (!led_array->isTaskRunning())
+    return;
+
+  led_array->beginResponse();
+  led_array->setResponseStatus(RESPONSE_STATUS_ABORTED);
+  led_array->stopTask();
+  printResponse(task_request_id);
+  led_array->beginResponse();
+}
+
+/* Returns true for commands which can run while a task is running (status queries, and sequence uploads into a slot
+   which is not being played) */
+bool CommandRouter::isTaskSafe(int16_t command_index)
+{
+  switch (command_index)
+  {
+    case CMD_TASK_STATUS:
+    case CMD_ABORT_TASK:
+    case CMD_ABOUT_IDX:
+    case CMD_SHOW_VERSION:
+    case CMD_PRINT_SEQ_LENGTH_IDX:
+    case CMD_TRIG_PRINT_IDX:
+    case CMD_PRINT_PARAMS:
+    case CMD_PRINT_PARSER_STATS:
+    case CMD_PRINT_LATENCY:
+    case CMD_PRINT_MEMORY:
+    case CMD_LIST_SEQ_FLASH:
+    case CMD_SELECT_SEQ_SLOT:
+    case CMD_PUSH_STREAM:
+    case CMD_END_STREAM:
+    case CMD_PRINT_SEQ_HASH:
+      return (true);
+
+    // Sequence uploads can run while a sequence in another slot is played
+    case CMD_LEN_SEQ_IDX:
+    case CMD_SET_SEQ_IDX:
+    case CMD_SET_SEQ_BULK:
+    case CMD_SET_SEQ_BIT_DEPTH:
+    case CMD_SET_SEQ_ZEROS:
+    case CMD_PRINT_SEQ_IDX:
+    case CMD_LOAD_SEQ_FLASH:
+    case CMD_GENERATE_SEQ:
+      return (led_array->isSequenceSlotIdle());
+    case CMD_SET_PLAYLIST:
+      return (!led_array->isPlaylistPlaying());
+    default:
+      return (false);
   }
 }
 
+/* Checks that byte_count more bytes (including alignment) fit in the current parse arena record. The record is
+   moved to the start of the arena if it does not fit at the end but does fit in front of the oldest queued command. */
+uint8_t CommandRouter::ensureParseArena(uint32_t byte_count)
+{
+  uint32_t record_size = record_length + byte_count + 3;
+  if (record_size > PARSE_ARENA_SIZE)
+    return (PARSE_ARENA_FULL);
+
+  // Queued commands lie in [oldest_start, PARSE_ARENA_SIZE) and [0, record_start) if the arena has wrapped around
+  uint16_t oldest_start = (command_queue_count > 0) ? command_queue[command_queue_head].arena_start : PARSE_ARENA_SIZE;
+  bool wrapped = (command_queue_count > 0) && (record_start < oldest_start);
+  if (record_start + record_size <= (wrapped ? oldest_start : PARSE_ARENA_SIZE))
+    return (PARSE_ARENA_OK);
+  else if (!wrapped && (record_size <= oldest_start))
+  {
+    memmove(parse_arena, parse_arena + record_start, record_length);
+    record_start = 0;
+    return (PARSE_ARENA_OK);
+  }
+  else
+    return (PARSE_ARENA_WAIT);
+}
+
+/* Reserves space in the current parse arena record (ensureParseArena must be called first). Returns the offset within the record. */
+uint16_t CommandRouter::reserveParseArena(uint16_t byte_count, bool align)
+{
+  uint16_t offset = align ? ((record_length + 3) & ~3) : record_length;
+  record_length = offset + byte_count;
+  if (parse_arena_queued + record_length > parse_arena_high_water_mark)
+    parse_arena_high_water_mark = parse_arena_queued + record_length;
+  return (offset);
+}
+
+void * CommandRouter::getRecordPointer(uint16_t offset)
+{
+  return (parse_arena + record_start + offset);
+}
+
 #endif
@@ -49,4 +49,25 @@ static const char SERIAL_COMMAND_TERMINATOR[] = "-==-";
 // Serial delimeter
 static const char SERIAL_DELIMITER[] = ".";
 
+// Start byte of a binary command frame (never sent as part of an ASCII command)
+static const unsigned char SERIAL_FRAME_START = 0xA5;
+
+// Separates an optional request ID from the command name (e.g. "12:bf")
+static const char SERIAL_REQUEST_ID_DELIMITER[] = ":";
+
+// Status codes returned in machine mode responses
+#define RESPONSE_STATUS_OK 0                // Command ran without errors
+#define RESPONSE_STATUS_ERROR 1             // Command reported an error (message in payload)
+#define RESPONSE_STATUS_UNKNOWN_COMMAND 2   // Command name or frame opcode is not known
+#define RESPONSE_STATUS_NOT_IMPLEMENTED 3   // Command is not implemented on this device
+#define RESPONSE_STATUS_REJECTED 4          // Command can not be run in the current state (e.g. inside a batch)
+#define RESPONSE_STATUS_ARENA_FULL 5        // Command arguments did not fit in the parse arena
+#define RESPONSE_STATUS_FRAME_CRC 6         // Binary frame CRC mismatch
+#define RESPONSE_STATUS_FRAME_TIMEOUT 7     // Binary frame stopped arriving part-way through
+#define RESPONSE_STATUS_FRAME_LENGTH 8      // Binary frame payload length does not match its contents
+#define RESPONSE_STATUS_ABORTED 9           // Task was stopped before it finished
+
+// Maximum length of a response payload or error message
+#define RESPONSE_PAYLOAD_LENGTH 191
+
 #endif
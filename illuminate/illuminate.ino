@@ -62,7 +62,8 @@ void setup() {
 // This command runs continuously after setup() runs once
 void loop()
 {
-  // Loop until we recieve a command, then parse it.
-  if (Serial.available())
-    cmd.processSerialStream();
+  // Parse any new serial input, run the oldest queued command, then run a step of the running task (rseq, scf, disco, ...)
+  cmd.processSerialStream();
+  cmd.runNextCommand();
+  cmd.runTask();
 }
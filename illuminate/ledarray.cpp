@@ -27,6 +27,11 @@
 
 #include "ledarray.h"
 
+#include <stdarg.h>
+
+// Ends of the firmware code and of the RAM data whose initial values follow it in flash (from the linker script)
+extern unsigned long _etext, _sdata, _edata;
+
 volatile uint16_t LedArray::pattern_index = 0;
 volatile uint16_t LedArray::frame_index = 0;
 
@@ -35,7 +40,18 @@ volatile uint32_t * LedArray::trigger_pulse_width_list_us;
 volatile uint32_t * LedArray::trigger_start_delay_list_us;
 volatile int * LedArray::trigger_input_mode_list;
 volatile int * LedArray::trigger_output_mode_list;
-LedSequence LedArray::led_sequence;
+LedSequence LedArray::led_sequence_slots[SEQUENCE_SLOT_COUNT];
+LedSequence * LedArray::led_sequence = &LedArray::led_sequence_slots[0];
+
+IntervalTimer LedArray::sequence_timer;
+LedArrayInterface * LedArray::sequence_timer_interface = NULL;
+volatile bool LedArray::sequence_timer_frame_ready = false;
+volatile uint8_t LedArray::sequence_timer_trigger_mask = 0;
+volatile uint32_t LedArray::sequence_timer_late_count = 0;
+IntervalTimer LedArray::sequence_trigger_timer;
+volatile bool LedArray::sequence_trigger_active = false;
+volatile int8_t LedArray::sequence_trigger_index = -1;
+volatile bool LedArray::sequence_trigger_pulse_high = false;
 
 uint8_t LedArray::getDeviceCommandCount()
 {
@@ -66,7 +82,7 @@ void LedArray::deviceCommand(int device_command_index, int argc, char * *argv)
     pattern_number = strtoul(argv[0], NULL, 0);
   else
   {
-    Serial.printf("ERROR (LedArray::deviceCommand) Invalid number of arguments (%d) %s", argc, SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::deviceCommand) Invalid number of arguments (%d) %s"), argc, SERIAL_LINE_ENDING);
     return;
   }
 
@@ -189,8 +205,13 @@ void LedArray::printCurrentLedValues()
 /* A function to the version of this device */
 void LedArray::printVersion()
 {
-  Serial.print(VERSION);
-  Serial.print(SERIAL_LINE_ENDING);
+  if (machine_mode)
+    setResponsePayload(F("%.2f"), VERSION);
+  else
+  {
+    Serial.print(VERSION);
+    Serial.print(SERIAL_LINE_ENDING);
+  }
 }
 
 /* A function to print a human-readable about page */
@@ -260,7 +281,7 @@ void LedArray::setMaxCurrentLimit(int argc, char ** argv)
   if (argc == 1)
     led_array_interface->setMaxCurrentLimit(atof(argv[0]));
   else
-    Serial.printf(F("ERROR (LedArray::setMaxCurrentLimit): Invalid number of arguments.%s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::setMaxCurrentLimit): Invalid number of arguments.%s"), SERIAL_LINE_ENDING);
 }
 
 void LedArray::setMaxCurrentEnforcement(int argc, char ** argv)
@@ -268,7 +289,7 @@ void LedArray::setMaxCurrentEnforcement(int argc, char ** argv)
   if (argc == 1)
     led_array_interface->setMaxCurrentEnforcement(atoi(argv[0]) > 0);
   else
-    Serial.printf(F("ERROR (LedArray::setMaxCurrentEnforcement): Invalid number of arguments.%s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::setMaxCurrentEnforcement): Invalid number of arguments.%s"), SERIAL_LINE_ENDING);
 }
 
 void LedArray::printMacAddress()
@@ -276,6 +297,99 @@ void LedArray::printMacAddress()
   print_mac();
 }
 
+/* Returns the largest block which can currently be allocated on the heap (found by trying allocations) */
+uint32_t LedArray::getLargestFreeBlock()
+{
+  uint32_t min_size = 0;
+  uint32_t max_size = HEAP_SIZE_MAX;
+  while (min_size < max_size)
+  {
+    uint32_t size = (min_size + max_size + 1) / 2;
+    void * block = malloc(size);
+    if (block != NULL)
+    {
+      free(block);
+      min_size = size;
+    }
+    else
+      max_size = size - 1;
+  }
+  return (min_size);
+}
+
+/* Prints the memory used by the sequence in the selected slot, its compiled frames, the other slots, the NA list and
+   driver buffers, and the largest free heap block. Given a pattern count, average LED count per pattern and optional bit
+   depth, also predicts whether such a sequence fits in the selected slot. */
+void LedArray::printMemory(uint16_t argc, char ** argv)
+{
+  uint32_t sequence_size = LedArray::led_sequence->getHeapSize();
+  uint32_t frames_size = sequence_frames_size[sequence_slot];
+  uint32_t na_list_size = (uint32_t)led_array_interface->led_count * (sizeof(float *) + 3 * sizeof(float));
+  uint32_t driver_size = led_array_interface->getDriverMemorySize();
+  uint32_t free_size = getLargestFreeBlock();
+
+  if (argc == 0)
+  {
+    if (machine_mode)
+      setResponsePayload(F("%lu,%lu,%lu,%lu,%lu"), sequence_size, frames_size, na_list_size, driver_size, free_size);
+    else
+    {
+      uint32_t other_slots_size = 0;
+      for (uint8_t slot = 0; slot < SEQUENCE_SLOT_COUNT; slot++)
+      {
+        if (slot != sequence_slot)
+          other_slots_size += led_sequence_slots[slot].getHeapSize() + sequence_frames_size[slot];
+      }
+      Serial.printf(F("Sequence (slot %d): %lu bytes (%d patterns, %d leds)%s"), sequence_slot, sequence_size, LedArray::led_sequence->number_of_patterns_assigned, LedArray::led_sequence->getAssignedLedCount(), SERIAL_LINE_ENDING);
+      Serial.printf(F("Compiled sequence frames: %lu bytes%s"), frames_size, SERIAL_LINE_ENDING);
+      Serial.printf(F("Other sequence slots: %lu bytes%s"), other_slots_size, SERIAL_LINE_ENDING);
+      Serial.printf(F("NA list: %lu bytes%s"), na_list_size, SERIAL_LINE_ENDING);
+      Serial.printf(F("Driver buffers: %lu bytes (static)%s"), driver_size, SERIAL_LINE_ENDING);
+      Serial.printf(F("Largest free heap block: %lu bytes%s"), free_size, SERIAL_LINE_ENDING);
+    }
+    return;
+  }
+  else if (argc < 2 || argc > 3)
+  {
+    printError(F("ERROR (LedArray::printMemory): Invalid number of arguments (expected pattern count, average led count and optional bit depth)%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+
+  uint16_t pattern_count = strtoul(argv[0], NULL, 0);
+  uint16_t average_led_count = strtoul(argv[1], NULL, 0);
+  uint8_t bit_depth = (argc == 3) ? strtoul(argv[2], NULL, 0) : LedArray::led_sequence->bit_depth;
+  if ((bit_depth != 1) && (bit_depth != 8) && (bit_depth != 16))
+  {
+    printError(F("ERROR (LedArray::printMemory): Invalid bit depth (%d)%s"), bit_depth, SERIAL_LINE_ENDING);
+    return;
+  }
+
+  // A sequence holds at most UINT16_MAX LEDs. ssl releases the current sequence (and compiled frames) first, but the
+  // space they free only helps if it joins the largest free block.
+  uint32_t led_total_count = (uint32_t)pattern_count * average_led_count;
+  uint32_t required_size = LedArray::led_sequence->getStorageSize(pattern_count, led_total_count, bit_depth) + LedArray::led_sequence->getScratchSize(false, bit_depth);
+  uint8_t fit = 0;
+  if (led_total_count > UINT16_MAX)
+    fit = 0;
+  else if (required_size <= free_size)
+    fit = 2;
+  else if (required_size <= free_size + sequence_size + frames_size)
+    fit = 1;
+
+  if (machine_mode)
+    setResponsePayload(F("%lu,%lu,%lu,%lu,%lu,%lu,%d"), sequence_size, frames_size, na_list_size, driver_size, free_size, required_size, fit);
+  else
+  {
+    Serial.printf(F("Planned sequence (%d patterns x %d leds, %d-bit): %lu bytes of %lu free - "), pattern_count, average_led_count, bit_depth, required_size, free_size);
+    if (fit == 2)
+      Serial.printf(F("fits%s"), SERIAL_LINE_ENDING);
+    else if (fit == 1)
+      Serial.printf(F("fits only if the current sequence is released first (%lu bytes)%s"), sequence_size + frames_size, SERIAL_LINE_ENDING);
+    else
+      Serial.printf(F("does not fit%s"), SERIAL_LINE_ENDING);
+  }
+}
+
 uint16_t LedArray::getSerialNumber()
 {
   return led_array_interface->getSerialNumber();
@@ -299,44 +413,58 @@ void LedArray::setPartNumber(uint16_t new_part_number)
 /* A function to reset the device to power-on state */
 void LedArray::reset()
 {
-  Serial.printf(F("Resetting Array%s"), SERIAL_LINE_ENDING);
+  if (!machine_mode)
+    Serial.printf(F("Resetting Array%s"), SERIAL_LINE_ENDING);
   led_array_interface->deviceReset();
 }
 
-/* A function to draw a random "disco" pattern. For parties, mostly. */
+/* A function to draw a random "disco" pattern. For parties, mostly. Runs as a task until stopped. */
 void LedArray::drawDiscoPattern()
 {
-  // Determine number of LEDs to illuminate at once
-  int led_on_count = (int)round(led_array_interface->led_count / 4.0);
-
   // Clear the array
   led_array_interface->clear();
 
   // Party time
-  while (Serial.available() == 0)
-  {
-    led_array_interface->clear();
+  startTask(TASK_DISCO);
+}
 
-    for (uint16_t led_index = 0; led_index < led_on_count; led_index++)
-    {
-      led_index = random(0, led_array_interface->led_count);
-      for (int color_channel_index = 0; color_channel_index <  led_array_interface->color_channel_count; color_channel_index++)
-        led_array_interface->setLed(led_index, color_channel_index, (uint8_t)random(0, 255));
-    }
-    led_array_interface->update();
-    delay(10);
-  }
+/* Draws a new disco pattern 10ms after the last one */
+void LedArray::runDiscoTask()
+{
+  if (task_stage_elapsed_us < 10000)
+    return;
+
+  // Determine number of LEDs to illuminate at once
+  int led_on_count = (int)round(led_array_interface->led_count / 4.0);
 
-  // Clear the array
   led_array_interface->clear();
+
+  for (uint16_t led_index = 0; led_index < led_on_count; led_index++)
+  {
+    led_index = random(0, led_array_interface->led_count);
+    for (int color_channel_index = 0; color_channel_index <  led_array_interface->color_channel_count; color_channel_index++)
+      led_array_interface->setLed(led_index, color_channel_index, (uint8_t)random(0, 255));
+  }
+  led_array_interface->update();
+  task_pattern_index++;
+  task_stage_elapsed_us = 0;
 }
 
-/* A function to draw a water drop (radial sine pattern)*/
+/* A function to draw a water drop (radial sine pattern). Runs as a task until stopped. */
 void LedArray::waterDrop()
 {
   // Clear the array
   led_array_interface->clear();
 
+  startTask(TASK_WATER_DROP);
+}
+
+/* Draws the next phase of the water drop 1ms after the last one */
+void LedArray::runWaterDropTask()
+{
+  if (task_stage_elapsed_us < 1000)
+    return;
+
   float na_period = led_position_list_na[led_array_interface->led_count - 1][0] * led_position_list_na[led_array_interface->led_count - 1][0];
   na_period += led_position_list_na[led_array_interface->led_count - 1][1] * led_position_list_na[led_array_interface->led_count - 1][1];
   na_period = sqrt(na_period) / 2.0;
@@ -344,28 +472,20 @@ void LedArray::waterDrop()
   uint8_t value;
   float na;
   uint8_t max_led_value = 32;
+  uint8_t phase_counter = task_pattern_index;
 
-  uint8_t phase_counter = 0;
-  while (Serial.available() == 0)
+  // Clear array
+  led_array_interface->setLed(-1, -1, false);
+  for (uint16_t led_index = 0; led_index < led_array_interface->led_count; led_index++)
   {
-    // Clear array
-    led_array_interface->setLed(-1, -1, false);
-    for (uint16_t led_index = 0; led_index < led_array_interface->led_count; led_index++)
-    {
-      na = sqrt(led_position_list_na[led_index][0] * led_position_list_na[led_index][0] + led_position_list_na[led_index][1] * led_position_list_na[led_index][1]);
-      value = (uint8_t)round((1.0 + sin(((na / na_period) + ((float)phase_counter / 100.0)) * 2.0 * 3.14)) * max_led_value);
-      for (int color_channel_index = 0; color_channel_index <  led_array_interface->color_channel_count; color_channel_index++)
-        led_array_interface->setLed(led_index, color_channel_index, value);
-    }
-    led_array_interface->update();
-    delay(1);
-    phase_counter++;
-    if (phase_counter == 100)
-      phase_counter = 0;
+    na = sqrt(led_position_list_na[led_index][0] * led_position_list_na[led_index][0] + led_position_list_na[led_index][1] * led_position_list_na[led_index][1]);
+    value = (uint8_t)round((1.0 + sin(((na / na_period) + ((float)phase_counter / 100.0)) * 2.0 * 3.14)) * max_led_value);
+    for (int color_channel_index = 0; color_channel_index <  led_array_interface->color_channel_count; color_channel_index++)
+      led_array_interface->setLed(led_index, color_channel_index, value);
   }
-
-  // Clear the array
-  led_array_interface->clear();
+  led_array_interface->update();
+  task_pattern_index = (task_pattern_index + 1) % 100;
+  task_stage_elapsed_us = 0;
 }
 
 /* A function to clear the calculated NA positions of each LED */
@@ -446,6 +566,193 @@ void LedArray::clear()
   led_array_interface->clear();
 }
 
+/* Starts a batch, during which drawing commands only change the LED buffer */
+void LedArray::beginBatch()
+{
+  if (led_array_interface->batch_open)
+  {
+    printError(F("ERROR (LedArray::beginBatch): A batch is already open%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+  led_array_interface->batch_update_pending = false;
+  led_array_interface->batch_open = true;
+}
+
+/* Ends a batch, updating the array once if any command in the batch changed it */
+void LedArray::commitBatch()
+{
+  if (!led_array_interface->batch_open)
+  {
+    printError(F("ERROR (LedArray::commitBatch): No batch is open%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+  led_array_interface->batch_open = false;
+  if (led_array_interface->batch_update_pending)
+    led_array_interface->update();
+  led_array_interface->batch_update_pending = false;
+}
+
+bool LedArray::isBatchOpen()
+{
+  return led_array_interface->batch_open;
+}
+
+void LedArray::setMachineMode(bool enabled)
+{
+  machine_mode = enabled;
+}
+
+bool LedArray::getMachineMode()
+{
+  return machine_mode;
+}
+
+/* Clears the status and payload of the response to the next command */
+void LedArray::beginResponse()
+{
+  response_status = RESPONSE_STATUS_OK;
+  response_payload[0] = 0;
+}
+
+/* Sets the response status, keeping the first error reported by a command */
+void LedArray::setResponseStatus(uint8_t status)
+{
+  if (response_status == RESPONSE_STATUS_OK)
+    response_status = status;
+}
+
+uint8_t LedArray::getResponseStatus()
+{
+  return response_status;
+}
+
+/* Sets the payload returned with the response status in machine mode (unless an error was reported) */
+void LedArray::setResponsePayload(const __FlashStringHelper * format, ...)
+{
+  if (response_status != RESPONSE_STATUS_OK)
+    return;
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(response_payload, sizeof(response_payload), (const char *) format, args);
+  va_end(args);
+}
+
+const char * LedArray::getResponsePayload()
+{
+  return response_payload;
+}
+
+/* Prints an error message. In machine mode the first error of a command is returned as its response payload instead. */
+void LedArray::printError(const __FlashStringHelper * format, ...)
+{
+  char message[RESPONSE_PAYLOAD_LENGTH + 1];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(message, sizeof(message), (const char *) format, args);
+  va_end(args);
+
+  bool first_error = (response_status == RESPONSE_STATUS_OK) || (response_payload[0] == 0);
+  setResponseStatus(RESPONSE_STATUS_ERROR);
+
+  if (!machine_mode)
+    Serial.print(message);
+  else if (first_error)
+  {
+    // Keep the response on one line
+    uint16_t length = 0;
+    for (uint16_t char_index = 0; message[char_index] != 0; char_index++)
+      response_payload[length++] = ((message[char_index] == '\n') || (message[char_index] == '\r')) ? ' ' : message[char_index];
+    while ((length > 0) && (response_payload[length - 1] == ' '))
+      length--;
+    response_payload[length] = 0;
+  }
+}
+
+bool LedArray::isTaskRunning()
+{
+  return (task_type != TASK_NONE);
+}
+
+/* Runs one step of the current task. Steps return as soon as the task has to wait, so loop() can keep reading serial input. */
+void LedArray::runTask()
+{
+  switch (task_type)
+  {
+    case TASK_DISCO:
+      runDiscoTask();
+      break;
+    case TASK_WATER_DROP:
+      runWaterDropTask();
+      break;
+    case TASK_DEMO:
+      runDemoTask();
+      break;
+    case TASK_SCAN:
+      runScanTask();
+      break;
+    case TASK_SEQUENCE:
+      runSequenceTask();
+      break;
+    case TASK_TRIGGER_TEST:
+      runTriggerTestTask();
+      break;
+  }
+}
+
+/* Stops the current task before it has finished */
+void LedArray::stopTask()
+{
+  if (task_type == TASK_DISCO || task_type == TASK_WATER_DROP)
+    led_array_interface->clear();
+  else if (task_type == TASK_DEMO)
+    clear();
+  else if (task_type == TASK_SCAN)
+  {
+    if (task_stage != TASK_STAGE_FINISH)
+    {
+      if (task_print_indicies)
+        Serial.print(F(":scan_end"));
+      Serial.print(SERIAL_LINE_ENDING);
+    }
+    led_array_interface->clear();
+  }
+  finishTask();
+}
+
+void LedArray::printTaskStatus()
+{
+  const char * task_names[] = {"none", "disco", "water", "demo", "scan", "sequence", "trigger_test"};
+  uint32_t elapsed_ms = isTaskRunning() ? (uint32_t)task_elapsed_ms : 0;
+  if (machine_mode)
+    setResponsePayload(F("%s %u %u %lu"), task_names[task_type], task_pattern_index, task_frame_index, elapsed_ms);
+  else
+    Serial.printf(F("Task: %s, pattern %u, frame %u, elapsed %lu ms%s"), task_names[task_type], task_pattern_index, task_frame_index, elapsed_ms, SERIAL_LINE_ENDING);
+}
+
+void LedArray::startTask(uint8_t new_task_type)
+{
+  task_type = new_task_type;
+  task_stage = TASK_STAGE_START;
+  task_pattern_index = 0;
+  task_frame_index = 0;
+  task_elapsed_ms = 0;
+  task_stage_elapsed_us = 0;
+}
+
+void LedArray::finishTask()
+{
+  task_type = TASK_NONE;
+  stopSequenceTimer();
+
+  // A stream ends with its task
+  if (task_stream)
+  {
+    led_stream.deallocate();
+    task_stream = false;
+  }
+}
+
 /* A function to set the numerical aperture of the system*/
 void LedArray::setNa(int argc, char ** argv)
 {
@@ -457,14 +764,19 @@ void LedArray::setNa(int argc, char ** argv)
     if ((new_na > 0) && new_na < 100 * led_array_interface->max_na)
       objective_na = (float)new_na / 100.0;
     else
-      Serial.printf(F("ERROR (LedArray::setNa): invalid NA. Make sure NA is 100*na%s"), SERIAL_LINE_ENDING);
+      printError(F("ERROR (LedArray::setNa): invalid NA. Make sure NA is 100*na%s"), SERIAL_LINE_ENDING);
   }
   else
-    Serial.printf(F("ERROR (LedArray::setNa): wrong number of arguments.%s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::setNa): wrong number of arguments.%s"), SERIAL_LINE_ENDING);
 
-  Serial.print(F("Current NA is: "));
-  Serial.print(objective_na);
-  Serial.print(SERIAL_LINE_ENDING);
+  if (machine_mode)
+    setResponsePayload(F("%.2f"), objective_na);
+  else
+  {
+    Serial.print(F("Current NA is: "));
+    Serial.print(objective_na);
+    Serial.print(SERIAL_LINE_ENDING);
+  }
 }
 
 void LedArray::printTriggerSettings()
@@ -529,7 +841,7 @@ void LedArray::drawCdpc(int argc, char * *argv)
       illumination_intensity = (uint8_t)atoi(argv[0]);
     else
     {
-      Serial.printf(F("ERROR (LedArray::drawCdpc): Invalid number of arguments %s"), SERIAL_LINE_ENDING);
+      printError(F("ERROR (LedArray::drawCdpc): Invalid number of arguments %s"), SERIAL_LINE_ENDING);
       return;
     }
 
@@ -581,7 +893,7 @@ void LedArray::drawHalfAnnulus(int argc, char * *argv)
   }
   else
   {
-    Serial.printf(F("ERROR (LedArray::drawHalfAnnulus) Invlaid number of arguments. %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::drawHalfAnnulus) Invlaid number of arguments. %s"), SERIAL_LINE_ENDING);
     return;
   }
 
@@ -609,7 +921,7 @@ void LedArray::drawHalfAnnulus(int argc, char * *argv)
   else if ( (strcmp(argv[0], DPC_RIGHT1) == 0) || (strcmp(argv[0], DPC_RIGHT2) == 0))
     half_annulus_type = 3;
   else
-    Serial.printf(F("ERROR - invalid half annulus circle type. Options are t, b, l, and r %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR - invalid half annulus circle type. Options are t, b, l, and r %s"), SERIAL_LINE_ENDING);
 
   if (half_annulus_type >= 0)
   {
@@ -648,7 +960,7 @@ void LedArray::drawColorDarkfield(int argc, char * * argv)
     }
     else
     {
-      Serial.printf(F("ERROR (LedArray::drawColorDarkfield): Invalid number of arguments %s"), SERIAL_LINE_ENDING);
+      printError(F("ERROR (LedArray::drawColorDarkfield): Invalid number of arguments %s"), SERIAL_LINE_ENDING);
       return;
     }
 
@@ -696,7 +1008,7 @@ void LedArray::drawAnnulus(int argc, char * * argv)
   }
   else
   {
-    Serial.printf(F("ERROR (LedArray::drawAnnulus): Invalid number of arguments! %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::drawAnnulus): Invalid number of arguments! %s"), SERIAL_LINE_ENDING);
     return;
   }
 
@@ -721,7 +1033,7 @@ void LedArray::drawAnnulus(int argc, char * * argv)
 void LedArray::drawChannel(int argc, char * *argv)
 {
   if (argc != 1)
-    Serial.printf(F("ERROR (LedArray::drawChannel): invalid argument count%s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::drawChannel): invalid argument count%s"), SERIAL_LINE_ENDING);
   else
   {
     if (auto_clear_flag)
@@ -744,7 +1056,7 @@ void LedArray::setPinOrder(int argc, char * *argv)
     for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
       led_array_interface->setPinOrder(strtoul(argv[0], NULL, 0) , color_channel_index, strtoul(argv[color_channel_index + 1], NULL, 0));
   else
-    Serial.printf(F("ERROR (LedArray::setPinOrder): Wrong number of arguments %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::setPinOrder): Wrong number of arguments %s"), SERIAL_LINE_ENDING);
 }
 
 /* Trigger setup function for setting the trigger pulse width and delay after sending */
@@ -779,7 +1091,7 @@ void LedArray::triggerSetup(int argc, char ** argv)
     }
   }
   else
-    Serial.printf(F("ERROR: Invalid number of arguments for setTriggerPulse! %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR: Invalid number of arguments for setTriggerPulse! %s"), SERIAL_LINE_ENDING);
 }
 
 /* Send a trigger pulse */
@@ -793,14 +1105,14 @@ void LedArray::sendTriggerPulse(int trigger_index, bool show_output)
   int status = led_array_interface->sendTriggerPulse(trigger_index, LedArray::trigger_pulse_width_list_us[trigger_index], false);
 
   if (status < 0)
-    Serial.printf(F("ERROR - pin not configured! %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR - pin not configured! %s"), SERIAL_LINE_ENDING);
 }
 
 void LedArray::setTriggerState(int trigger_index, bool state, bool show_output)
 {
   int status = led_array_interface->setTriggerState(trigger_index, state);
   if (status < 0)
-    Serial.printf(F("ERROR - pin not configured! %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR - pin not configured! %s"), SERIAL_LINE_ENDING);
 }
 
 bool LedArray::getTriggerState(int trigger_index)
@@ -828,13 +1140,36 @@ void LedArray::triggerInputTest(uint16_t channel)
 {
   led_array_interface->setLed(-1, -1, (uint8_t)0);
   led_array_interface->update();
-  Serial.print(LedArrayInterface::trigger_input_state[channel]); Serial.print(SERIAL_LINE_ENDING);
-  Serial.print("Begin trigger input test for channel "); Serial.print(channel); Serial.print(SERIAL_LINE_ENDING);
-  waitForTriggerState(channel, !LedArrayInterface::trigger_input_state[channel]);
-  Serial.print("Passed trigger input test for channel "); Serial.print(channel); Serial.print(SERIAL_LINE_ENDING);
+  if (!machine_mode)
+  {
+    Serial.print(LedArrayInterface::trigger_input_state[channel]); Serial.print(SERIAL_LINE_ENDING);
+    Serial.print("Begin trigger input test for channel "); Serial.print(channel); Serial.print(SERIAL_LINE_ENDING);
+  }
+
+  // Wait for the input to change as a task
+  task_trigger_index = channel;
+  task_trigger_state = !LedArrayInterface::trigger_input_state[channel];
+  task_trigger_elapsed_ms = 0;
+  startTask(TASK_TRIGGER_TEST);
+}
+
+void LedArray::runTriggerTestTask()
+{
+  if (digitalReadFast(led_array_interface->trigger_input_pin_list[task_trigger_index]) != task_trigger_state)
+  {
+    if (task_trigger_elapsed_ms <= MAX_TRIGGER_WAIT_TIME_S * 1000.0)
+      return;
+    Serial.printf(F("WARNING (LedArray::waitForTriggerState): Exceeding max delay for trigger input %d, %s"), task_trigger_index, SERIAL_LINE_ENDING);
+  }
+
+  if (!machine_mode)
+  {
+    Serial.print("Passed trigger input test for channel "); Serial.print(task_trigger_index); Serial.print(SERIAL_LINE_ENDING);
+  }
   led_array_interface->setLed(-1, -1, (uint8_t)0);
   led_array_interface->setLed(0, -1, (uint8_t)255);
   led_array_interface->update();
+  finishTask();
 }
 
 /* Draw a LED list */
@@ -849,6 +1184,22 @@ void LedArray::drawLedList(uint16_t argc, char ** argv)
 
   for (uint16_t led_index = 0; led_index < argc; led_index++)
   {
+    int16_t range[3];
+    if (parseLedRange(argv[led_index], range))
+    {
+      if (!isLedRangeValid(range))
+      {
+        printError(F("ERROR (LedArray::drawLedList): Invalid LED range (%s)%s"), argv[led_index], SERIAL_LINE_ENDING);
+        continue;
+      }
+      for (int16_t range_led_number = range[0]; range_led_number <= range[1]; range_led_number += range[2])
+      {
+        for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
+          led_array_interface->setLed(range_led_number, color_channel_index, led_value[color_channel_index]);
+      }
+      continue;
+    }
+
     led_number = strtoul(argv[led_index], NULL, 0);
     for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
       led_array_interface->setLed(led_number, color_channel_index, led_value[color_channel_index]);
@@ -856,6 +1207,94 @@ void LedArray::drawLedList(uint16_t argc, char ** argv)
   led_array_interface->update();
 }
 
+/* Parses an LED range argument, first:last or first:last:stride (the last LED is included). Returns false if the
+   argument is a single LED number. */
+bool LedArray::parseLedRange(const char * argument, int16_t * range)
+{
+  char * range_end;
+  range[0] = strtol(argument, &range_end, 0);
+  if (*range_end != ':')
+    return (false);
+  range[1] = strtol(range_end + 1, &range_end, 0);
+  range[2] = (*range_end == ':') ? strtol(range_end + 1, NULL, 0) : 1;
+  return (true);
+}
+
+bool LedArray::isLedRangeValid(const int16_t * range)
+{
+  return ((range[0] >= 0) && (range[0] <= range[1]) && (range[1] < led_array_interface->led_count) && (range[2] > 0));
+}
+
+/* Returns the range (first LED, last LED and stride) which the LED_NUMBER_RANGE entry led_number of an LED number list
+   (see setSequenceValue) stands for, or NULL if it is not a valid range */
+const int16_t * LedArray::getLedNumberRange(const int16_t * led_numbers, int16_t led_number)
+{
+  int16_t range_table_offset = led_numbers[led_numbers[0] + 1];
+  if (range_table_offset == 0)
+    return (NULL);
+  const int16_t * range = led_numbers + range_table_offset + 3 * (LED_NUMBER_RANGE(0) - led_number);
+  return (isLedRangeValid(range) ? range : NULL);
+}
+
+/* Draw a LED list which has already been decoded (binary frames) */
+void LedArray::drawLedList(uint16_t led_count, uint16_t * led_numbers)
+{
+  if (debug >= 2)
+    Serial.printf(F("LedArray::drawLedList called with %d decoded leds %s"), led_count, SERIAL_LINE_ENDING);
+
+  if (auto_clear_flag)
+    clear();
+
+  for (uint16_t led_index = 0; led_index < led_count; led_index++)
+  {
+    for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
+      led_array_interface->setLed(led_numbers[led_index], color_channel_index, led_value[color_channel_index]);
+  }
+  led_array_interface->update();
+}
+
+/* Writes one value of an image (value_index is led_number * color_channel_count + color channel) straight to
+   the array buffer, without updating the array. Used by the img command while the image is received. */
+void LedArray::setImageValue(uint16_t value_index, uint16_t value)
+{
+  if (value_index < led_array_interface->led_count * led_array_interface->color_channel_count)
+    led_array_interface->setImageValue(value_index, value);
+}
+
+/* Clears the values of a failed image from the array buffer, without updating the array (clear() also shows the
+   cleared array on TLC5955 arrays). Within a batch, the update is left to commitBatch as usual. */
+void LedArray::discardImage()
+{
+  bool batch_was_open = led_array_interface->batch_open;
+  led_array_interface->batch_open = true;
+  led_array_interface->clear();
+  led_array_interface->batch_open = batch_was_open;
+  if (!batch_was_open)
+    led_array_interface->batch_update_pending = false;
+}
+
+/* Updates the array once all values of an image have been written with setImageValue */
+void LedArray::drawImage(uint8_t bit_depth, uint16_t value_count)
+{
+  uint16_t image_value_count = led_array_interface->led_count * led_array_interface->color_channel_count;
+  if (value_count != image_value_count)
+  {
+    discardImage();
+    printError(F("ERROR (LedArray::drawImage): Received %d values, expected %d (%d LEDs x %d color channels)%s"), value_count, image_value_count, led_array_interface->led_count, led_array_interface->color_channel_count, SERIAL_LINE_ENDING);
+  }
+  else if ((bit_depth != 8) && (bit_depth != 16))
+  {
+    discardImage();
+    printError(F("ERROR (LedArray::drawImage): Invalid bit depth (%d), must be 8 or 16%s"), bit_depth, SERIAL_LINE_ENDING);
+  }
+  else
+  {
+    if (debug >= 2)
+      Serial.printf(F("LedArray::drawImage called with %d %d-bit values%s"), value_count, bit_depth, SERIAL_LINE_ENDING);
+    led_array_interface->update();
+  }
+}
+
 /* Scan brightfield LEDs */
 void LedArray::scanBrightfieldLeds(uint16_t argc, char ** argv)
 {
@@ -872,9 +1311,6 @@ void LedArray::scanBrightfieldLeds(uint16_t argc, char ** argv)
 
   // Scan the LEDs
   scanLedRange(delay_ms, 0.0, objective_na, true);
-
-  if (debug >= 1)
-    Serial.printf(F("Finished brightfield LED scan %s"), SERIAL_LINE_ENDING);
 }
 
 /* Scan all LEDs */
@@ -896,12 +1332,9 @@ void LedArray::scanAllLeds(uint16_t argc, char ** argv)
 
     // Initiate LED scan
     scanLedRange(delay_ms, 0.0, 1.0, true);
-
-    if (debug >= 1)
-      Serial.printf(F("Finished full LED scan.%s"), SERIAL_LINE_ENDING);
   }
   else
-    Serial.printf(F("ERROR - full scan delay too short/long %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR - full scan delay too short/long %s"), SERIAL_LINE_ENDING);
 }
 
 void LedArray::setBrightness(int16_t argc, char ** argv)
@@ -936,7 +1369,10 @@ void LedArray::setBrightness(int16_t argc, char ** argv)
     led_value[color_channel_index] = (uint8_t) (((float) led_color[color_channel_index] / UINT8_MAX) * (float) led_brightness);
 
   // Print current brightness
-  Serial.printf(F("Current LED brightness is: %d%s"), led_brightness, SERIAL_LINE_ENDING);
+  if (machine_mode)
+    setResponsePayload(F("%d"), led_brightness);
+  else
+    Serial.printf(F("Current LED brightness is: %d%s"), led_brightness, SERIAL_LINE_ENDING);
 }
 
 /* Allows setting of current color buffer, which is respected by most other commands */
@@ -1026,7 +1462,7 @@ void LedArray::setColor(int16_t argc, char ** argv)
       }
       else
       {
-        Serial.printf(F("ERROR (LedArray::setColor): Invalid color value %s"), SERIAL_LINE_ENDING);
+        printError(F("ERROR (LedArray::setColor): Invalid color value %s"), SERIAL_LINE_ENDING);
         return;
       }
     }
@@ -1037,7 +1473,7 @@ void LedArray::setColor(int16_t argc, char ** argv)
     }
     else
     {
-      Serial.printf(F("ERROR (LedArray::setColor): Invalid color value %s"), SERIAL_LINE_ENDING);
+      printError(F("ERROR (LedArray::setColor): Invalid color value %s"), SERIAL_LINE_ENDING);
       return;
     }
 
@@ -1054,18 +1490,25 @@ void LedArray::setColor(int16_t argc, char ** argv)
       led_value[color_channel_index] = (uint8_t) (((float) led_color[color_channel_index] / UINT8_MAX) * (float) led_brightness);
 
     // Print current colors regardless of input
-    Serial.print(F("Current color value: "));
-    for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
+    if (machine_mode && (led_array_interface->color_channel_count == 3))
+      setResponsePayload(F("%d,%d,%d"), led_color[0], led_color[1], led_color[2]);
+    else if (machine_mode)
+      setResponsePayload(F("%d"), led_color[0]);
+    else
     {
-      Serial.print(led_color[color_channel_index]);
-      if (color_channel_index < (led_array_interface->color_channel_count - 1))
-        Serial.print(',');
+      Serial.print(F("Current color value: "));
+      for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
+      {
+        Serial.print(led_color[color_channel_index]);
+        if (color_channel_index < (led_array_interface->color_channel_count - 1))
+          Serial.print(',');
+      }
+      Serial.print(SERIAL_LINE_ENDING);
     }
-    Serial.print(SERIAL_LINE_ENDING);
   }
   else
   {
-    Serial.printf(F("ERROR (LedArray::setColor): Current device does not support color illumination %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::setColor): Current device does not support color illumination %s"), SERIAL_LINE_ENDING);
   }
 }
 
@@ -1120,26 +1563,37 @@ void LedArray::drawHalfCircle(int8_t half_circle_type, float start_na, float end
     Serial.print(SERIAL_LINE_ENDING);
   }
 
-  float x, y, d;
   for ( int16_t led_index = 0; led_index < led_array_interface->led_count; led_index++)
   {
-    x = led_position_list_na[led_index][0];
-    y = led_position_list_na[led_index][1];
-    d = led_position_list_na[led_index][2];
-
-    if (d > (start_na) && (d <= (end_na)))
+    if (isLedInHalfCircle(led_index, half_circle_type, start_na, end_na))
     {
-      if (  (half_circle_type == 0 && (y > 0))      // Top
-            || (half_circle_type == 1 && (y < 0))   // Bottom
-            || (half_circle_type == 2 && (x < 0))   // Left
-            || (half_circle_type == 3 && (x > 0)))  // Right
-
-        for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-          led_array_interface->setLed(led_index, color_channel_index, led_value[color_channel_index]);
+      for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
+        led_array_interface->setLed(led_index, color_channel_index, led_value[color_channel_index]);
     }
   }
 }
 
+/* Whether an LED is in a half circle (0: top, 1: bottom, 2: left, 3: right) between two NAs, as drawn by dpc and ha */
+bool LedArray::isLedInHalfCircle(int16_t led_index, int8_t half_circle_type, float start_na, float end_na)
+{
+  float x = led_position_list_na[led_index][0];
+  float y = led_position_list_na[led_index][1];
+  float d = led_position_list_na[led_index][2];
+
+  return ((d > (start_na) && (d <= (end_na)))
+          && (  (half_circle_type == 0 && (y > 0))      // Top
+                || (half_circle_type == 1 && (y < 0))   // Bottom
+                || (half_circle_type == 2 && (x < 0))   // Left
+                || (half_circle_type == 3 && (x > 0)))); // Right
+}
+
+/* Whether an LED is between two NAs (inclusive), as drawn by bf, df and an */
+bool LedArray::isLedInNaRange(int16_t led_index, float start_na, float end_na)
+{
+  float d = led_position_list_na[led_index][2];
+  return (d >= (start_na) && (d <= (end_na)));
+}
+
 /* Draws a circle or annulus of LEDs */
 void LedArray::drawCircle(float start_na, float end_na)
 {
@@ -1155,11 +1609,9 @@ void LedArray::drawCircle(float start_na, float end_na)
   // Clear array first (helps eleminate weird patterns)
   clear();
 
-  float d;
   for ( int16_t led_index = 0; led_index < led_array_interface->led_count; led_index++)
   {
-    d = led_position_list_na[led_index][2];
-    if (d >= (start_na) && (d <= (end_na)))
+    if (isLedInNaRange(led_index, start_na, end_na))
     {
       for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
         led_array_interface->setLed(led_index, color_channel_index, led_value[color_channel_index]);
@@ -1167,11 +1619,9 @@ void LedArray::drawCircle(float start_na, float end_na)
   }
 }
 
-/* Scan brightfield LEDs */
+/* Scan LEDs within an NA range, one at a time. Runs as a task (see runScanTask). */
 void LedArray::scanLedRange(uint16_t delay_ms, float start_na, float end_na, bool print_indicies)
 {
-  float d;
-
   for (int trigger_index = 0; trigger_index < led_array_interface->trigger_output_count; trigger_index++)
   {
     if (LedArray::trigger_output_mode_list[trigger_index] == TRIG_MODE_START)
@@ -1181,50 +1631,74 @@ void LedArray::scanLedRange(uint16_t delay_ms, float start_na, float end_na, boo
   if (print_indicies)
     Serial.print(F("scan_start:"));
 
-  int16_t led_index = 0;
-  while (led_index < (int16_t)led_array_interface->led_count && !Serial.available())
-  {
-    d = led_position_list_na[led_index][2];
-
-    if (d >= start_na && d <= end_na)
-    {
-      // Clear all LEDs
-      led_array_interface->clear();
+  task_delay_ms = delay_ms;
+  task_start_na = start_na;
+  task_end_na = end_na;
+  task_print_indicies = print_indicies;
+  startTask(TASK_SCAN);
+  task_stage_elapsed_us = 1000 * (uint32_t)delay_ms; // Show the first LED right away
+}
 
-      // Set LEDs
-      for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-        led_array_interface->setLed(led_index, color_channel_index, led_value[color_channel_index]);
+/* Shows the next LED of a scan once the previous one has been shown for the scan delay */
+void LedArray::runScanTask()
+{
+  if (task_stage_elapsed_us < 1000 * (uint32_t)task_delay_ms)
+    return;
 
-      if (print_indicies)
-      {
-        Serial.print(led_index);
-        if (led_index < led_array_interface->led_count - 1)
-          Serial.print(SERIAL_DELIMITER);
-      }
+  // The array is cleared one delay after the last LED
+  if (task_stage == TASK_STAGE_FINISH)
+  {
+    led_array_interface->clear();
+    if (debug >= 1)
+      Serial.printf(F("Finished LED scan.%s"), SERIAL_LINE_ENDING);
+    finishTask();
+    return;
+  }
 
-      // Update LED Pattern
-      led_array_interface->update();
+  // Find the next LED in the NA range
+  int16_t led_index = task_pattern_index;
+  while ((led_index < (int16_t)led_array_interface->led_count) && !isLedInNaRange(led_index, task_start_na, task_end_na))
+    led_index++;
 
-      // Send trigger pulse
-      for (int trigger_index = 0; trigger_index < led_array_interface->trigger_output_count; trigger_index++)
-      {
-        if (LedArray::trigger_output_mode_list[trigger_index] == TRIG_MODE_ITERATION)
-          sendTriggerPulse(trigger_index, false);
-      }
+  if (led_index >= (int16_t)led_array_interface->led_count)
+  {
+    if (task_print_indicies)
+      Serial.print(F(":scan_end"));
+    Serial.print(SERIAL_LINE_ENDING);
 
-      // Delay for desired wait period
-      delay(delay_ms);
-    }
-    led_index++;
+    task_pattern_index = led_array_interface->led_count;
+    task_stage = TASK_STAGE_FINISH;
+    task_stage_elapsed_us = 0;
+    return;
   }
 
-  if (print_indicies)
-    Serial.print(F(":scan_end"));
+  // Clear all LEDs
+  led_array_interface->clear();
 
-  Serial.print(SERIAL_LINE_ENDING);
+  // Set LEDs
+  for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
+    led_array_interface->setLed(led_index, color_channel_index, led_value[color_channel_index]);
 
-  delay(delay_ms);
-  led_array_interface->clear();
+  if (task_print_indicies)
+  {
+    Serial.print(led_index);
+    if (led_index < led_array_interface->led_count - 1)
+      Serial.print(SERIAL_DELIMITER);
+  }
+
+  // Update LED Pattern
+  led_array_interface->update();
+
+  // Send trigger pulse
+  for (int trigger_index = 0; trigger_index < led_array_interface->trigger_output_count; trigger_index++)
+  {
+    if (LedArray::trigger_output_mode_list[trigger_index] == TRIG_MODE_ITERATION)
+      sendTriggerPulse(trigger_index, false);
+  }
+
+  // Wait for desired period before the next LED
+  task_pattern_index = led_index + 1;
+  task_stage_elapsed_us = 0;
 }
 
 /* Command parser for DPC */
@@ -1251,7 +1725,7 @@ void LedArray::drawDpc(uint16_t argc, char ** argv)
     else if ( (strcmp(argv[0], DPC_RIGHT1) == 0) || (strcmp(argv[0], DPC_RIGHT2) == 0))
       dpc_type = 3;
     else
-      Serial.printf(F("ERROR - invalid dpc circle type. Options are dpc.t, dpc.b, dpc.l, dpc.r%s"), SERIAL_LINE_ENDING);
+      printError(F("ERROR - invalid dpc circle type. Options are dpc.t, dpc.b, dpc.l, dpc.r%s"), SERIAL_LINE_ENDING);
 
     if (dpc_type >= 0)
     {
@@ -1267,7 +1741,7 @@ void LedArray::drawDpc(uint16_t argc, char ** argv)
   }
 
   else
-    Serial.printf(F("ERROR (LedArray::drawDpc) Invlaid number of arguments.%s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::drawDpc) Invlaid number of arguments.%s"), SERIAL_LINE_ENDING);
 }
 
 /* Draw brightfield pattern */
@@ -1284,16 +1758,40 @@ void LedArray::drawBrightfield(uint16_t argc, char ** argv)
   led_array_interface->update();
 }
 
-/* Set sequence length */
-void LedArray::setSequenceLength(uint16_t new_seq_length, bool quiet)
+/* Set sequence length, and the total number of LEDs in all patterns (if known, otherwise one LED per pattern is
+   allocated and the sequence grows as patterns are added). With delta_encoding, patterns are stored as the changes
+   from the previous one where that is smaller (this takes scratch for two pattern copies while patterns are added). */
+void LedArray::setSequenceLength(uint16_t new_seq_length, uint16_t led_capacity, bool delta_encoding, bool quiet)
 {
+  if (led_capacity == 0)
+    led_capacity = new_seq_length;
+
+  // Fail before touching the current sequence if the new one can not fit even once the current one is released
+  uint32_t storage_size = LedArray::led_sequence->getStorageSize(new_seq_length, led_capacity, LedArray::led_sequence->bit_depth) + LedArray::led_sequence->getScratchSize(delta_encoding, LedArray::led_sequence->bit_depth);
+  uint32_t available_size = getLargestFreeBlock() + LedArray::led_sequence->getHeapSize() + sequence_frames_size[sequence_slot];
+  if (storage_size > available_size)
+  {
+    printError(F("ERROR (LedArray::setSequenceLength): %d patterns with %d leds need %lu bytes, but at most %lu bytes are free.%s"), new_seq_length, led_capacity, storage_size, available_size, SERIAL_LINE_ENDING);
+    return;
+  }
+
   // Reset old sequence
-  LedArray::led_sequence.deallocate();
+  releaseSequenceFrames();
+  LedArray::led_sequence->deallocate();
 
   // Initalize new sequence
-  LedArray::led_sequence.allocate(new_seq_length);
+  LedArray::led_sequence->delta_encoding = delta_encoding;
+  if (!LedArray::led_sequence->allocate(new_seq_length, led_capacity))
+  {
+    printError(F("ERROR (LedArray::setSequenceLength): Could not allocate %d patterns with %d leds (%lu bytes, %lu bytes free).%s"), new_seq_length, led_capacity, storage_size, getLargestFreeBlock(), SERIAL_LINE_ENDING);
+    return;
+  }
 
-  if (!quiet)
+  if (quiet)
+    ; // pass
+  else if (machine_mode)
+    setResponsePayload(F("%d"), new_seq_length);
+  else
   {
     Serial.print(F("New sequence length is: "));
     Serial.print(new_seq_length);
@@ -1303,116 +1801,1103 @@ void LedArray::setSequenceLength(uint16_t new_seq_length, bool quiet)
 
 void LedArray::setSequenceBitDepth(uint8_t bit_depth, bool quiet)
 {
-  LedArray::led_sequence.setBitDepth(bit_depth);
+  if ((bit_depth != 1) && (bit_depth != 8) && (bit_depth != 16))
+  {
+    printError(F("ERROR (LedArray::setSequenceBitDepth): Invalid bit depth (%d, allowed values are 1, 8 or 16)%s"), bit_depth, SERIAL_LINE_ENDING);
+    return;
+  }
 
-  if (!quiet)
+  releaseSequenceFrames();
+  if (!LedArray::led_sequence->setBitDepth(bit_depth))
+  {
+    printError(F("ERROR (LedArray::setSequenceBitDepth): Not enough memory for the sequence at %d-bit (%lu bytes free)%s"), bit_depth, getLargestFreeBlock(), SERIAL_LINE_ENDING);
+    return;
+  }
+
+  if (quiet)
+    ; // pass
+  else if (machine_mode)
+    setResponsePayload(F("%d"), LedArray::led_sequence->bit_depth);
+  else
   {
     Serial.print(F("Sequence bit depth is now: "));
-    Serial.print(LedArray::led_sequence.bit_depth);
+    Serial.print(LedArray::led_sequence->bit_depth);
     Serial.print(SERIAL_LINE_ENDING);
   }
 }
 
 int LedArray::getSequenceBitDepth()
 {
-  return LedArray::led_sequence.bit_depth;
+  return LedArray::led_sequence->bit_depth;
+}
+
+int LedArray::getSequenceLength()
+{
+  return LedArray::led_sequence->length;
 }
 
 void LedArray::setSequenceZeros(uint16_t argc, char ** argv)
 {
   if (argc != 1)
   {
-    Serial.printf(F("ERROR (LedArray::setSequenceZeros): invalid number of arguments! %s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::setSequenceZeros): invalid number of arguments! %s"), SERIAL_LINE_ENDING);
     return;
   }
   else
   {
     uint16_t zero_count = strtoul(argv[0], NULL, 0);
-    if (zero_count + LedArray::led_sequence.number_of_patterns_assigned <= LedArray::led_sequence.length)
+    releaseSequenceFrames();
+    if (zero_count + LedArray::led_sequence->number_of_patterns_assigned <= LedArray::led_sequence->length)
     {
       for (uint16_t value_index = 0; value_index < zero_count; value_index++)
-        LedArray::led_sequence.incriment(0);
+        LedArray::led_sequence->incriment(0);
     }
     else
     {
-      Serial.printf(F("ERROR (LedArray::setSequenceZeros): number of zeros exceeds pattern length! %s"), SERIAL_LINE_ENDING);
+      printError(F("ERROR (LedArray::setSequenceZeros): number of zeros exceeds pattern length! %s"), SERIAL_LINE_ENDING);
       return;
     }
   }
 }
 
+/* Builds a common sequence on the device instead of uploading it: a single-LED scan over an NA range (or over the
+   brightfield or darkfield LEDs), the four DPC half circles at the objective NA, or annuli of a fixed NA width. Each
+   pattern is the one the matching draw command (scb, df, dpc, an) shows, at the current LED value (1-bit sequences
+   store the LEDs only). The sequence is allocated once at its exact size. */
+void LedArray::generateSequence(uint16_t argc, char ** argv)
+{
+  uint8_t generator = SEQUENCE_GENERATOR_SCAN;
+  float start_na = 0.0;
+  float end_na = objective_na;
+  float step_na = 0.0;
+  if ((argc == 3) && (strcmp(argv[0], "scan") == 0))
+  {
+    start_na = (float)atoi(argv[1]) / 100.0;
+    end_na = (float)atoi(argv[2]) / 100.0;
+  }
+  else if ((argc == 1) && (strcmp(argv[0], "bf") == 0))
+    ; // Brightfield scan (default values above)
+  else if ((argc == 1) && (strcmp(argv[0], "df") == 0))
+  {
+    start_na = objective_na;
+    end_na = 1.0;
+  }
+  else if ((argc == 1) && (strcmp(argv[0], "dpc") == 0))
+    generator = SEQUENCE_GENERATOR_DPC;
+  else if ((argc == 4) && (strcmp(argv[0], "an") == 0))
+  {
+    generator = SEQUENCE_GENERATOR_ANNULUS;
+    start_na = (float)atoi(argv[1]) / 100.0;
+    end_na = (float)atoi(argv[2]) / 100.0;
+    step_na = (float)atoi(argv[3]) / 100.0;
+    if ((step_na <= 0) || (end_na <= start_na))
+    {
+      printError(F("ERROR (LedArray::generateSequence): Invalid annulus range or step%s"), SERIAL_LINE_ENDING);
+      return;
+    }
+  }
+  else
+  {
+    printError(F("ERROR (LedArray::generateSequence): Invalid arguments (expected scan.[start NA*100].[end NA*100], bf, df, dpc or an.[start NA*100].[end NA*100].[step NA*100])%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+
+  // Count the patterns and LEDs, then allocate the sequence and store them
+  uint32_t led_total = 0;
+  uint16_t pattern_count = runSequenceGenerator(generator, start_na, end_na, step_na, NULL, &led_total);
+  if ((pattern_count == 0) || (led_total > UINT16_MAX))
+  {
+    printError(F("ERROR (LedArray::generateSequence): Can not store %d patterns with %lu leds%s"), pattern_count, led_total, SERIAL_LINE_ENDING);
+    return;
+  }
+  setSequenceLength(pattern_count, max(led_total, (uint32_t)1), false, true);
+  if ((LedArray::led_sequence->storage == NULL) || (LedArray::led_sequence->length != pattern_count))
+    return;
+
+  // Every LED gets the current value of each color channel
+  uint16_t values[STREAM_VALUE_SIZE_MAX / 2];
+  for (uint8_t color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
+  {
+    if (LedArray::led_sequence->bit_depth == 8)
+      ((uint8_t *) values)[color_channel_index] = led_value[color_channel_index];
+    else if (LedArray::led_sequence->bit_depth == 16)
+      values[color_channel_index] = led_value[color_channel_index] * UINT16_MAX / UINT8_MAX;
+  }
+  runSequenceGenerator(generator, start_na, end_na, step_na, (const uint8_t *) values, &led_total);
+
+  if (machine_mode)
+    setResponsePayload(F("%d,%lu"), pattern_count, led_total);
+  else
+    Serial.printf(F("Generated %d patterns (%lu leds)%s"), pattern_count, led_total, SERIAL_LINE_ENDING);
+}
+
+/* Runs a sequence generator, appending its patterns to the sequence with the given LED values (or, without values,
+   only counting its patterns and LEDs). Scans take one pass over the LEDs, other generators one pass per pattern. */
+uint16_t LedArray::runSequenceGenerator(uint8_t generator, float start_na, float end_na, float step_na, const uint8_t * values, uint32_t * led_total)
+{
+  bool store = (values != NULL);
+  uint16_t pattern_count = 0;
+  *led_total = 0;
+
+  if (generator == SEQUENCE_GENERATOR_SCAN)
+  {
+    for (int16_t led_index = 0; led_index < led_array_interface->led_count; led_index++)
+    {
+      if (!isLedInNaRange(led_index, start_na, end_na))
+        continue;
+      if (store && LedArray::led_sequence->incriment(1))
+      {
+        LedArray::led_sequence->appendValues(led_index, values);
+        LedArray::led_sequence->endPattern();
+      }
+      pattern_count++;
+      (*led_total)++;
+    }
+    return (pattern_count);
+  }
+
+  pattern_count = (generator == SEQUENCE_GENERATOR_DPC) ? 4 : (uint16_t)ceil((end_na - start_na) / step_na - 0.001);
+  for (uint16_t pattern_index = 0; pattern_index < pattern_count; pattern_index++)
+  {
+    if (store && !LedArray::led_sequence->incriment(0))
+      break;
+    for (int16_t led_index = 0; led_index < led_array_interface->led_count; led_index++)
+    {
+      bool in_pattern;
+      if (generator == SEQUENCE_GENERATOR_DPC)
+        in_pattern = isLedInHalfCircle(led_index, pattern_index, 0.0, objective_na);
+      else
+        in_pattern = isLedInNaRange(led_index, start_na + pattern_index * step_na, min(start_na + (pattern_index + 1) * step_na, end_na));
+      if (!in_pattern)
+        continue;
+      if (store)
+        LedArray::led_sequence->appendValues(led_index, values);
+      (*led_total)++;
+    }
+    if (store)
+      LedArray::led_sequence->endPattern();
+  }
+  return (pattern_count);
+}
+
 /* Set sequence value */
 void LedArray::setSequenceValue(uint16_t argc, void ** led_values, int16_t * led_numbers)
 {
   // Determine the number of LEDs in this pattern
-  int16_t pattern_led_count = 0;
-  if (led_numbers[1] == -1)
-    pattern_led_count = led_array_interface->led_count;
-  else if (led_numbers[1] == -2)
-    pattern_led_count = 0;
-  else
-    pattern_led_count = led_numbers[0];
+  int16_t pattern_led_count = (led_numbers[1] == -2) ? 0 : led_numbers[0];
 
   // Determine number of arguments to process
   int16_t led_argc = led_numbers[0];
 
+  // Compiled frames no longer match the sequence
+  releaseSequenceFrames();
+
   if (led_argc > 0 && (argc == (led_argc * led_array_interface->color_channel_count))) // Color (or white if one channel)
   {
-    // Switch to new led pattern
-    if (LedArray::led_sequence.incriment(pattern_led_count) && (pattern_led_count > 0))
+    // LED ranges (and -1, all LEDs) are stored as range entries, which take SEQUENCE_RANGE_ENTRY_COUNT entries
+    if (pattern_led_count > 0)
     {
-      // Assign LED indicies and values
-      uint8_t * values = ((uint8_t *) led_values);
+      pattern_led_count = 0;
       for (int led_argument_index = 0; led_argument_index < led_argc; led_argument_index++)
       {
-        // If the led number is -1, append all LEDs to the sequence
-        if (led_numbers[led_argument_index + 1] == -1)
+        int16_t led_number = led_numbers[led_argument_index + 1];
+        if ((led_number <= LED_NUMBER_RANGE(0)) && (getLedNumberRange(led_numbers, led_number) == NULL))
         {
-          for (int led_number = 0; led_number < led_array_interface->led_count; led_number++)
-          {
-            if (LedArray::led_sequence.bit_depth == 8)
-              LedArray::led_sequence.append(led_number, values[led_argument_index * led_array_interface->color_channel_count]);
-            else if (LedArray::led_sequence.bit_depth == 1)
-              LedArray::led_sequence.append(led_number, true);
-          }
+          printError(F("ERROR (LedArray::setSequenceValue): Invalid LED range (led %d of the pattern)%s"), led_argument_index, SERIAL_LINE_ENDING);
+          return;
         }
-        else // Normal LED value
+        pattern_led_count += ((led_number == -1) || (led_number <= LED_NUMBER_RANGE(0))) ? SEQUENCE_RANGE_ENTRY_COUNT : 1;
+      }
+    }
+
+    // Switch to new led pattern
+    if (LedArray::led_sequence->number_of_patterns_assigned >= LedArray::led_sequence->length)
+      printError(F("ERROR (LedArray::setSequenceValue): Sequence length (%d) reached.%s"), LedArray::led_sequence->length, SERIAL_LINE_ENDING);
+    else if (!LedArray::led_sequence->incriment(pattern_led_count))
+      printError(F("ERROR (LedArray::setSequenceValue): Not enough memory for pattern %d (%d leds, %lu bytes free). Set the total led count with ssl.[pattern count].[led count] to allocate the sequence once.%s"), LedArray::led_sequence->number_of_patterns_assigned, pattern_led_count, getLargestFreeBlock(), SERIAL_LINE_ENDING);
+    else if (pattern_led_count > 0)
+    {
+      // Assign LED indicies and values (the command router stores one value per color channel at the sequence bit depth)
+      for (int led_argument_index = 0; led_argument_index < led_argc; led_argument_index++)
+      {
+        const uint8_t * values = NULL;
+        if (LedArray::led_sequence->bit_depth > 1)
+          values = (const uint8_t *) led_values + led_argument_index * LedArray::led_sequence->getLedValueSize();
+
+        // If the led number is -1, append all LEDs to the sequence (as one range)
+        int16_t led_number = led_numbers[led_argument_index + 1];
+        if (led_number == -1)
+          LedArray::led_sequence->appendRange(0, led_array_interface->led_count - 1, 1, values);
+        else if (led_number <= LED_NUMBER_RANGE(0))
         {
-          // Append this LED to the sequence
-          if (LedArray::led_sequence.bit_depth == 8)
-            LedArray::led_sequence.append(led_numbers[led_argument_index + 1], values[led_argument_index * led_array_interface->color_channel_count]);
-          else if (LedArray::led_sequence.bit_depth == 1)
-            LedArray::led_sequence.append(led_numbers[led_argument_index + 1], true);
+          const int16_t * range = getLedNumberRange(led_numbers, led_number);
+          LedArray::led_sequence->appendRange(range[0], range[1], range[2], values);
         }
+        else // Normal LED value
+          LedArray::led_sequence->appendValues(led_number, values);
+      }
+      LedArray::led_sequence->endPattern();
+
+      if (debug > 0)
+        LedArray::led_sequence->print(LedArray::led_sequence->number_of_patterns_assigned - 1);
+    }
+  }
+  else if (pattern_led_count == 0)
+  {
+    // Add blank pattern
+    if (!LedArray::led_sequence->incriment(0))
+      printError(F("ERROR (LedArray::setSequenceValue): Sequence length (%d) reached.%s"), LedArray::led_sequence->length, SERIAL_LINE_ENDING);
+  }
+  else
+  {
+    printError(F("Error (LedArray::setSequenceValue) - invalid number of arguments (should be divisible by %d)%s"), led_array_interface->color_channel_count, SERIAL_LINE_ENDING);
+  }
+}
+
+/* Replaces the sequence with the patterns of a bulk upload (sseqb): a uint16 pattern count followed by a uint16 led count
+   and an int16 led number and one value per color channel (one byte, or two for 16-bit sequences) for each led of each
+   pattern (all little-endian). The whole upload is checked before the current sequence is replaced. Returns false if
+   the upload is invalid. */
+bool LedArray::setSequencePatterns(uint16_t length, const uint8_t * patterns)
+{
+  uint16_t value_size = (LedArray::led_sequence->bit_depth == 16) ? 2 : 1;
+  uint16_t entry_size = 2 + led_array_interface->color_channel_count * value_size;
+  uint16_t pattern_count = (length >= 2) ? (patterns[0] | ((uint16_t)patterns[1] << 8)) : 0;
+
+  // Check the layout and led numbers of all patterns
+  uint32_t position = 2;
+  uint32_t led_total_count = 0;
+  uint16_t pattern_index = 0;
+  for (; (pattern_index < pattern_count) && (position + 2 <= length); pattern_index++)
+  {
+    uint16_t led_count = patterns[position] | ((uint16_t)patterns[position + 1] << 8);
+    position += 2;
+    if (position + (uint32_t)led_count * entry_size > length)
+      break;
+    for (uint16_t led_index = 0; led_index < led_count; led_index++)
+    {
+      int16_t led_number = (int16_t)(patterns[position] | ((uint16_t)patterns[position + 1] << 8));
+      if ((led_number < -1) || (led_number >= led_array_interface->led_count))
+      {
+        printError(F("ERROR (LedArray::setSequencePatterns): Invalid LED number (%d) in pattern %d%s"), led_number, pattern_index, SERIAL_LINE_ENDING);
+        return (false);
+      }
+      led_total_count += (led_number == -1) ? SEQUENCE_RANGE_ENTRY_COUNT : 1;
+      position += entry_size;
+    }
+  }
+  if ((length < 2) || (pattern_index != pattern_count) || (position != length))
+  {
+    printError(F("ERROR (LedArray::setSequencePatterns): Payload length (%d bytes) does not match its %d patterns%s"), length, pattern_count, SERIAL_LINE_ENDING);
+    return (false);
+  }
+  else if (led_total_count > UINT16_MAX)
+  {
+    printError(F("ERROR (LedArray::setSequencePatterns): Too many LEDs (%lu)%s"), led_total_count, SERIAL_LINE_ENDING);
+    return (false);
+  }
+
+  setSequenceLength(pattern_count, led_total_count, false, true);
+  if (LedArray::led_sequence->length != pattern_count)
+    return (false);
+
+  position = 2;
+  for (uint16_t pattern_index = 0; pattern_index < pattern_count; pattern_index++)
+  {
+    uint16_t led_count = patterns[position] | ((uint16_t)patterns[position + 1] << 8);
+    position += 2;
+
+    // LED number -1 stands for all LEDs, which are stored as one range
+    uint16_t pattern_led_count = 0;
+    for (uint16_t led_index = 0; led_index < led_count; led_index++)
+    {
+      const uint8_t * entry = patterns + position + led_index * entry_size;
+      pattern_led_count += ((int16_t)(entry[0] | ((uint16_t)entry[1] << 8)) == -1) ? SEQUENCE_RANGE_ENTRY_COUNT : 1;
+    }
+    LedArray::led_sequence->incriment(pattern_led_count);
+
+    for (uint16_t led_index = 0; led_index < led_count; led_index++)
+    {
+      int16_t led_number = (int16_t)(patterns[position] | ((uint16_t)patterns[position + 1] << 8));
+      const uint8_t * values = (LedArray::led_sequence->bit_depth > 1) ? patterns + position + 2 : NULL;
+      if (led_number == -1)
+        LedArray::led_sequence->appendRange(0, led_array_interface->led_count - 1, 1, values);
+      else
+        LedArray::led_sequence->appendValues(led_number, values);
+      position += entry_size;
+    }
+    LedArray::led_sequence->endPattern();
+  }
+
+  if (debug > 0)
+    LedArray::led_sequence->print();
+  return (true);
+}
+
+/* Draws a sequence pattern in the array buffer (without updating the array). A delta pattern is drawn over the previous
+   pattern: if incremental is true that pattern is already shown, otherwise the array is rebuilt from the last pattern
+   stored in full. */
+void LedArray::drawSequencePattern(uint8_t slot, uint16_t pattern_index, bool incremental)
+{
+  const LedSequence * sequence = &led_sequence_slots[slot];
+  uint16_t first_pattern_index = pattern_index;
+  if (!incremental || (sequence->pattern_encodings[pattern_index] != SEQUENCE_ENCODING_DELTA))
+  {
+    while ((first_pattern_index > 0) && (sequence->pattern_encodings[first_pattern_index] == SEQUENCE_ENCODING_DELTA))
+      first_pattern_index--;
+    led_array_interface->clear();
+  }
+
+  for (; first_pattern_index <= pattern_index; first_pattern_index++)
+    drawSequenceEntries(slot, first_pattern_index);
+}
+
+/* Renders every pattern of the sequence and packs it into a frame, the bytes the LED drivers take (channel mapping and
+   color order included), so playback only shifts the frame out. Patterns are rendered in the LED buffer as in a batch,
+   and the buffer is put back afterwards, so compiling does not change what the array shows. Frames keep the brightness
+   and color used for 1-bit patterns at compile time, and are dropped when the sequence is changed. */
+void LedArray::compileSequence()
+{
+  releaseSequenceFrames();
+
+  uint16_t pattern_count = LedArray::led_sequence->number_of_patterns_assigned;
+  uint32_t frame_size = led_array_interface->getFrameSize();
+  if (pattern_count == 0)
+  {
+    printError(F("ERROR (LedArray::compileSequence): Sequence is empty%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+
+  // The frames are allocated first, so the copy of the LED buffer is freed back at the top of the heap
+  uint8_t * frames = new uint8_t[(uint32_t)pattern_count * frame_size];
+  uint8_t * saved_buffer = (frames != NULL) ? new uint8_t[led_array_interface->getBufferSize()] : NULL;
+  if (saved_buffer == NULL)
+  {
+    if (frames != NULL)
+      delete[] frames;
+    printError(F("ERROR (LedArray::compileSequence): Not enough memory for %d frames of %lu bytes%s"), pattern_count, frame_size, SERIAL_LINE_ENDING);
+    return;
+  }
+
+  led_array_interface->saveBuffer(saved_buffer);
+  led_array_interface->batch_open = true;
+  uint16_t pattern_index = 0;
+  for (; pattern_index < pattern_count; pattern_index++)
+  {
+    drawSequencePattern(sequence_slot, pattern_index, pattern_index > 0);
+    if (!led_array_interface->packFrame(frames + (uint32_t)pattern_index * frame_size))
+      break;
+  }
+  led_array_interface->batch_open = false;
+  led_array_interface->batch_update_pending = false;
+  led_array_interface->loadBuffer(saved_buffer);
+  delete[] saved_buffer;
+
+  if (pattern_index < pattern_count)
+  {
+    delete[] frames;
+    printError(F("ERROR (LedArray::compileSequence): Pattern %d exceeds the current limit%s"), pattern_index, SERIAL_LINE_ENDING);
+    return;
+  }
+  sequence_frames[sequence_slot] = frames;
+  sequence_frames_size[sequence_slot] = (uint32_t)pattern_count * frame_size;
+
+  if (machine_mode)
+    setResponsePayload(F("%d,%lu"), pattern_count, (uint32_t)pattern_count * frame_size);
+  else
+    Serial.printf(F("Compiled %d patterns (%lu bytes)%s"), pattern_count, (uint32_t)pattern_count * frame_size, SERIAL_LINE_ENDING);
+}
+
+/* Drops the compiled frames of the selected slot */
+void LedArray::releaseSequenceFrames()
+{
+  releaseSequenceFrames(sequence_slot);
+}
+
+void LedArray::releaseSequenceFrames(uint8_t slot)
+{
+  if (sequence_frames[slot] != NULL)
+    delete[] sequence_frames[slot];
+  sequence_frames[slot] = NULL;
+  sequence_frames_size[slot] = 0;
+}
+
+/* The flash sequence store takes the program flash sectors after the firmware (its code, then the initial values of
+   its data). Each stored sequence starts a sector with a FlashSequenceHeader, followed by the sequence image, and
+   takes whole sectors. Loading the firmware erases the store. */
+uint32_t LedArray::getFlashStoreStart()
+{
+  uint32_t firmware_end = (uint32_t) &_etext + ((uint32_t) &_edata - (uint32_t) &_sdata);
+  return ((firmware_end + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE);
+}
+
+/* Returns the stored sequence starting at a sector, or NULL */
+const FlashSequenceHeader * LedArray::getFlashSequence(uint32_t address)
+{
+  const FlashSequenceHeader * header = (const FlashSequenceHeader *) address;
+  if ((header->magic == FLASH_SEQUENCE_MAGIC) && (header->image_size <= FLASH_STORE_END - address - sizeof(FlashSequenceHeader)))
+    return (header);
+  return (NULL);
+}
+
+/* Returns the sector after the stored sequence starting at a sector (or after the sector if it holds none) */
+uint32_t LedArray::getFlashSequenceEnd(uint32_t address)
+{
+  const FlashSequenceHeader * header = getFlashSequence(address);
+  uint32_t stored_size = (header != NULL) ? sizeof(FlashSequenceHeader) + header->image_size : 1;
+  return (address + (stored_size + FLASH_SECTOR_SIZE - 1) / FLASH_SECTOR_SIZE * FLASH_SECTOR_SIZE);
+}
+
+const FlashSequenceHeader * LedArray::findFlashSequence(uint16_t id)
+{
+  for (uint32_t address = getFlashStoreStart(); address < FLASH_STORE_END; address = getFlashSequenceEnd(address))
+  {
+    const FlashSequenceHeader * header = getFlashSequence(address);
+    if ((header != NULL) && (header->id == id))
+      return (header);
+  }
+  return (NULL);
+}
+
+/* Returns the first run of free sectors which holds byte_count bytes (0 if there is none) */
+uint32_t LedArray::findFlashSpace(uint32_t byte_count)
+{
+  uint32_t run_start = getFlashStoreStart();
+  for (uint32_t address = run_start; address < FLASH_STORE_END; address = getFlashSequenceEnd(address))
+  {
+    if (getFlashSequence(address) != NULL)
+      run_start = getFlashSequenceEnd(address);
+    else if (address + FLASH_SECTOR_SIZE - run_start >= byte_count)
+      return (run_start);
+  }
+  return (0);
+}
+
+uint32_t LedArray::getFlashStoreFree()
+{
+  uint32_t free_size = 0;
+  for (uint32_t address = getFlashStoreStart(); address < FLASH_STORE_END; address = getFlashSequenceEnd(address))
+  {
+    if (getFlashSequence(address) == NULL)
+      free_size += FLASH_SECTOR_SIZE;
+  }
+  return (free_size);
+}
+
+/* Returns true if a sequence slot plays from the sectors of a stored sequence */
+bool LedArray::isSlotInFlashSequence(uint8_t slot, const FlashSequenceHeader * header)
+{
+  uint32_t address = (uint32_t) header;
+  uint32_t storage = (uint32_t) led_sequence_slots[slot].storage;
+  return (led_sequence_slots[slot].storage_attached && (storage >= address) && (storage < getFlashSequenceEnd(address)));
+}
+
+/* Erases a stored sequence, header sector first so an interrupted erase leaves no sequence behind. Sequence slots which
+   play from these sectors are dropped first; the erase is refused if one of them is being played. */
+bool LedArray::eraseFlashSequence(const FlashSequenceHeader * header)
+{
+  uint32_t address = (uint32_t) header;
+  uint32_t end = getFlashSequenceEnd(address);
+  for (uint8_t slot = 0; slot < SEQUENCE_SLOT_COUNT; slot++)
+  {
+    if (isSlotInFlashSequence(slot, header) && isSequenceSlotPlaying(slot))
+    {
+      printError(F("ERROR (LedArray::eraseFlashSequence): Sequence slot %d is playing this sequence%s"), slot, SERIAL_LINE_ENDING);
+      return (false);
+    }
+  }
+  for (uint8_t slot = 0; slot < SEQUENCE_SLOT_COUNT; slot++)
+  {
+    if (isSlotInFlashSequence(slot, header))
+    {
+      releaseSequenceFrames(slot);
+      led_sequence_slots[slot].deallocate();
+    }
+  }
+
+  for (uint32_t sector = address; sector < end; sector += FLASH_SECTOR_SIZE)
+  {
+    if (!flash_erase_sector(sector))
+    {
+      printError(F("ERROR (LedArray::eraseFlashSequence): Could not erase flash sector 0x%05lx%s"), sector, SERIAL_LINE_ENDING);
+      return (false);
+    }
+  }
+  return (true);
+}
+
+/* Stores the sequence in program flash under an ID (replacing the sequence stored with that ID), where it survives a
+   power cycle and is played in place after fload. */
+void LedArray::saveSequenceToFlash(uint16_t argc, char ** argv)
+{
+  if (argc != 1)
+  {
+    printError(F("ERROR (LedArray::saveSequenceToFlash): Invalid number of arguments (expected sequence ID)%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+
+  uint16_t id = strtoul(argv[0], NULL, 0);
+  if (id == 0xFFFF)
+  {
+    printError(F("ERROR (LedArray::saveSequenceToFlash): Invalid sequence ID (%d)%s"), id, SERIAL_LINE_ENDING);
+    return;
+  }
+  if (LedArray::led_sequence->number_of_patterns_assigned == 0)
+  {
+    printError(F("ERROR (LedArray::saveSequenceToFlash): Sequence is empty%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+
+  // Replace the old copy only after the new one is written, unless that is the only way to make room (and no slot plays
+  // from it)
+  uint32_t image_size = LedArray::led_sequence->getImageSize();
+  uint32_t stored_size = sizeof(FlashSequenceHeader) + image_size;
+  const FlashSequenceHeader * old_header = findFlashSequence(id);
+  uint32_t address = findFlashSpace(stored_size);
+  bool old_copy_attached = false;
+  for (uint8_t slot = 0; (slot < SEQUENCE_SLOT_COUNT) && (old_header != NULL); slot++)
+    old_copy_attached = old_copy_attached || isSlotInFlashSequence(slot, old_header);
+  if ((address == 0) && (old_header != NULL) && !old_copy_attached)
+  {
+    if (!eraseFlashSequence(old_header))
+      return;
+    old_header = NULL;
+    address = findFlashSpace(stored_size);
+  }
+  if (address == 0)
+  {
+    printError(F("ERROR (LedArray::saveSequenceToFlash): Not enough flash for %lu bytes (%lu bytes free)%s"), stored_size, getFlashStoreFree(), SERIAL_LINE_ENDING);
+    return;
+  }
+
+  // Sectors outside stored sequences may hold the rest of an interrupted save or erase
+  for (uint32_t sector = address; sector < address + stored_size; sector += FLASH_SECTOR_SIZE)
+  {
+    bool erased = true;
+    for (uint16_t word_index = 0; word_index < FLASH_SECTOR_SIZE / sizeof(uint32_t); word_index++)
+      erased = erased && (((const uint32_t *) sector)[word_index] == 0xFFFFFFFF);
+    if (!erased && !flash_erase_sector(sector))
+    {
+      printError(F("ERROR (LedArray::saveSequenceToFlash): Could not erase flash sector 0x%05lx%s"), sector, SERIAL_LINE_ENDING);
+      return;
+    }
+  }
+
+  // Program the image, then the header, which makes the sequence valid
+  uint8_t buffer[FLASH_WRITE_CHUNK_SIZE];
+  for (uint32_t image_offset = 0; image_offset < image_size; image_offset += FLASH_WRITE_CHUNK_SIZE)
+  {
+    uint32_t byte_count = min(image_size - image_offset, (uint32_t)FLASH_WRITE_CHUNK_SIZE);
+    LedArray::led_sequence->copyImage(image_offset, buffer, byte_count);
+    if (!flash_program(address + sizeof(FlashSequenceHeader) + image_offset, buffer, byte_count))
+    {
+      printError(F("ERROR (LedArray::saveSequenceToFlash): Could not program flash at 0x%05lx%s"), address + sizeof(FlashSequenceHeader) + image_offset, SERIAL_LINE_ENDING);
+      return;
+    }
+  }
+  FlashSequenceHeader header = {FLASH_SEQUENCE_MAGIC, id, LedArray::led_sequence->number_of_patterns_assigned, LedArray::led_sequence->getAssignedLedCount(),
+                                LedArray::led_sequence->array_led_count, LedArray::led_sequence->bit_depth, LedArray::led_sequence->color_channel_count, 0, image_size, LedArray::led_sequence->getHash()};
+  if (!flash_program(address, (const uint8_t *) &header, sizeof(header)))
+  {
+    printError(F("ERROR (LedArray::saveSequenceToFlash): Could not program flash at 0x%05lx%s"), address, SERIAL_LINE_ENDING);
+    return;
+  }
+
+  if (old_header != NULL)
+  {
+    // If the old copy was saved again, the slots which play it keep playing the same sequence from the new copy (slots
+    // which play a replaced sequence are dropped with it)
+    if (LedArray::led_sequence->storage == (const uint8_t *) (old_header + 1))
+    {
+      for (uint8_t slot = 0; slot < SEQUENCE_SLOT_COUNT; slot++)
+      {
+        if (led_sequence_slots[slot].storage == (const uint8_t *) (old_header + 1))
+          led_sequence_slots[slot].attach((const uint8_t *) address + sizeof(FlashSequenceHeader), header.length, header.led_count, header.bit_depth, header.hash);
       }
+    }
+    eraseFlashSequence(old_header);
+  }
+
+  if (machine_mode)
+    setResponsePayload(F("%d,%lu"), id, stored_size);
+  else
+    Serial.printf(F("Stored sequence %d in flash (%d patterns, %lu bytes)%s"), id, header.length, stored_size, SERIAL_LINE_ENDING);
+}
+
+/* Makes a sequence stored in flash the current sequence. It is played from flash, without a copy in RAM, and can not
+   be changed (ssl or sseqb start a new sequence in RAM). */
+void LedArray::loadSequenceFromFlash(uint16_t argc, char ** argv)
+{
+  if (argc != 1)
+  {
+    printError(F("ERROR (LedArray::loadSequenceFromFlash): Invalid number of arguments (expected sequence ID)%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+
+  uint16_t id = strtoul(argv[0], NULL, 0);
+  const FlashSequenceHeader * header = findFlashSequence(id);
+  if (header == NULL)
+  {
+    printError(F("ERROR (LedArray::loadSequenceFromFlash): No sequence %d in flash%s"), id, SERIAL_LINE_ENDING);
+    return;
+  }
+  if ((header->color_channel_count != LedArray::led_sequence->color_channel_count) || (header->array_led_count != LedArray::led_sequence->array_led_count))
+  {
+    printError(F("ERROR (LedArray::loadSequenceFromFlash): Sequence %d was stored for a different LED array%s"), id, SERIAL_LINE_ENDING);
+    return;
+  }
+
+  releaseSequenceFrames();
+  LedArray::led_sequence->attach((const uint8_t *) (header + 1), header->length, header->led_count, header->bit_depth, header->hash);
+
+  if (machine_mode)
+    setResponsePayload(F("%d"), header->length);
+  else
+    Serial.printf(F("Loaded sequence %d from flash (%d patterns, %d-bit)%s"), id, header->length, header->bit_depth, SERIAL_LINE_ENDING);
+}
+
+void LedArray::deleteFlashSequence(uint16_t argc, char ** argv)
+{
+  if (argc != 1)
+  {
+    printError(F("ERROR (LedArray::deleteFlashSequence): Invalid number of arguments (expected sequence ID)%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+
+  uint16_t id = strtoul(argv[0], NULL, 0);
+  const FlashSequenceHeader * header = findFlashSequence(id);
+  if (header == NULL)
+  {
+    printError(F("ERROR (LedArray::deleteFlashSequence): No sequence %d in flash%s"), id, SERIAL_LINE_ENDING);
+    return;
+  }
+  if (eraseFlashSequence(header) && !machine_mode)
+    Serial.printf(F("Deleted sequence %d from flash%s"), id, SERIAL_LINE_ENDING);
+}
+
+/* Lists the sequences stored in flash. The machine mode payload is the free flash, then the stored IDs. */
+void LedArray::printFlashSequences()
+{
+  uint32_t store_start = getFlashStoreStart();
+  uint32_t store_size = (store_start < FLASH_STORE_END) ? FLASH_STORE_END - store_start : 0;
+  uint32_t free_size = getFlashStoreFree();
+  char id_list[RESPONSE_PAYLOAD_LENGTH + 1];
+  uint16_t id_list_length = snprintf(id_list, sizeof(id_list), "%lu", free_size);
+
+  for (uint32_t address = store_start; address < FLASH_STORE_END; address = getFlashSequenceEnd(address))
+  {
+    const FlashSequenceHeader * header = getFlashSequence(address);
+    if (header == NULL)
+      continue;
+    if (machine_mode)
+    {
+      if (id_list_length < sizeof(id_list))
+        id_list_length += snprintf(id_list + id_list_length, sizeof(id_list) - id_list_length, ",%d", header->id);
+    }
+    else
+      Serial.printf(F("Sequence %d: %d patterns, %d leds, %d-bit, %lu bytes, hash 0x%08lX%s"), header->id, header->length, header->led_count, header->bit_depth, sizeof(FlashSequenceHeader) + header->image_size, header->hash, SERIAL_LINE_ENDING);
+  }
+
+  if (machine_mode)
+    setResponsePayload(F("%s"), id_list);
+  else
+    Serial.printf(F("Flash sequence store: %lu of %lu bytes free%s"), free_size, store_size, SERIAL_LINE_ENDING);
+}
+
+/* Sets the LEDs of one stored pattern. 1-bit patterns are shown at the current brightness and color. */
+void LedArray::drawSequenceEntries(uint8_t slot, uint16_t pattern_index)
+{
+  const LedSequence * sequence = &led_sequence_slots[slot];
+  uint16_t pattern_start = sequence->pattern_offsets[pattern_index];
+  uint16_t pattern_end = sequence->pattern_offsets[pattern_index + 1];
+  uint8_t encoding = sequence->pattern_encodings[pattern_index];
+
+  if (encoding == SEQUENCE_ENCODING_BITSET)
+  {
+    // Walk the set bits a word at a time
+    for (uint16_t word_index = pattern_start; word_index < pattern_end; word_index++)
+    {
+      for (uint32_t word = sequence->led_list[word_index]; word != 0; word &= word - 1)
+        led_array_interface->setLedValues((word_index - pattern_start) * 16 + __builtin_ctz(word), led_value);
+    }
+    return;
+  }
+
+  for (uint16_t led_idx = pattern_start; led_idx < pattern_end; led_idx++)
+  {
+    uint16_t led_number = sequence->led_list[led_idx];
+    if ((encoding == SEQUENCE_ENCODING_DELTA) && (led_number & SEQUENCE_DELTA_OFF))
+    {
+      led_array_interface->setLed(led_number & ~SEQUENCE_DELTA_OFF, -1, (uint8_t)0);
+      continue;
+    }
+
+    // A range entry is followed by its last LED and stride, and sets all of its LEDs to the same values
+    uint16_t last_led_number = led_number;
+    uint16_t stride = 1;
+    uint16_t value_index = led_idx * sequence->color_channel_count;
+    if ((encoding == SEQUENCE_ENCODING_RANGES) && (led_number & SEQUENCE_RANGE))
+    {
+      led_number &= ~SEQUENCE_RANGE;
+      last_led_number = sequence->led_list[led_idx + 1];
+      stride = sequence->led_list[led_idx + 2];
+      led_idx += SEQUENCE_RANGE_ENTRY_COUNT - 1;
+    }
+
+    for (; led_number <= last_led_number; led_number += stride)
+    {
+      if (sequence->bit_depth == 1)
+        led_array_interface->setLedValues(led_number, led_value);
+      else if (sequence->bit_depth == 16)
+        led_array_interface->setLedValues(led_number, (const uint16_t *) &sequence->values_16bit[value_index]);
+      else
+        led_array_interface->setLedValues(led_number, (const uint8_t *) &sequence->values[value_index]);
+    }
+  }
+}
+
+void LedArray::printSequence()
+{
+  Serial.print(F("Sequence has ")); Serial.print(LedArray::led_sequence->length); Serial.print("x "); Serial.print(LedArray::led_sequence->bit_depth); Serial.printf(F(" bit patterns:%s"), SERIAL_LINE_ENDING);
+  LedArray::led_sequence->print();
+}
+
+void LedArray::printSequenceLength()
+{
+  if (machine_mode)
+    setResponsePayload(F("%d"), LedArray::led_sequence->length);
+  else
+  {
+    Serial.print(LedArray::led_sequence->length);
+    Serial.print(SERIAL_LINE_ENDING);
+  }
+}
+
+/* Prints the hash of the current sequence, which is kept up to date as patterns are added (see LedSequence::hash). The
+   host can compare it to the hash of the sequence it is about to upload and skip the upload when they match. */
+void LedArray::printSequenceHash()
+{
+  if (machine_mode)
+    setResponsePayload(F("%08lX"), LedArray::led_sequence->getHash());
+  else
+    Serial.printf(F("Sequence hash: 0x%08lX%s"), LedArray::led_sequence->getHash(), SERIAL_LINE_ENDING);
+}
+
+/* Selects the sequence slot used by the sequence commands (ssl, ssv, sseqb, pseq, rseq, cseq, fsave, fload, gseq, ...).
+   Each slot holds its own sequence, so switching slots keeps the other sequences, and a slot can be uploaded while a
+   sequence in another slot is played. Without arguments, lists the slots. */
+void LedArray::selectSequenceSlot(uint16_t argc, char ** argv)
+{
+  if (argc == 0)
+  {
+    if (machine_mode)
+    {
+      setResponsePayload(F("%d"), sequence_slot);
+      return;
+    }
+    for (uint8_t slot = 0; slot < SEQUENCE_SLOT_COUNT; slot++)
+    {
+      Serial.printf(F("Slot %d: %d patterns (%d bit), %lu bytes"), slot, led_sequence_slots[slot].number_of_patterns_assigned, led_sequence_slots[slot].bit_depth, led_sequence_slots[slot].getHeapSize() + sequence_frames_size[slot]);
+      if (sequence_frames[slot] != NULL)
+        Serial.print(F(", compiled"));
+      if (slot == sequence_slot)
+        Serial.print(F(", selected"));
+      if (isSequenceSlotPlaying(slot))
+        Serial.print(F(", playing"));
+      Serial.print(SERIAL_LINE_ENDING);
+    }
+    return;
+  }
+
+  uint16_t slot = strtoul(argv[0], NULL, 0);
+  if ((argc != 1) || (slot >= SEQUENCE_SLOT_COUNT))
+  {
+    printError(F("ERROR (LedArray::selectSequenceSlot): Invalid sequence slot (expected one slot from 0 to %d)%s"), SEQUENCE_SLOT_COUNT - 1, SERIAL_LINE_ENDING);
+    return;
+  }
+
+  sequence_slot = slot;
+  LedArray::led_sequence = &led_sequence_slots[slot];
+  LedArray::pattern_index = 0;
+
+  if (machine_mode)
+    setResponsePayload(F("%d"), sequence_slot);
+  else
+    Serial.printf(F("Selected sequence slot %d (%d patterns)%s"), sequence_slot, LedArray::led_sequence->number_of_patterns_assigned, SERIAL_LINE_ENDING);
+}
+
+/* Sets the playlist played by rpl: pairs of a sequence slot and the number of times the slot's sequence is played.
+   Without arguments, prints the playlist. */
+void LedArray::setPlaylist(uint16_t argc, char ** argv)
+{
+  if (argc == 0)
+  {
+    if (machine_mode)
+      setResponsePayload(F("%d"), playlist_length);
+    else
+    {
+      Serial.print(F("Playlist:"));
+      for (uint8_t entry_index = 0; entry_index < playlist_length; entry_index++)
+        Serial.printf(F(" %d (x%d)"), playlist_slots[entry_index], playlist_acquisition_counts[entry_index]);
+      Serial.print(SERIAL_LINE_ENDING);
+    }
+    return;
+  }
+
+  if ((argc % 2 != 0) || (argc / 2 > PLAYLIST_LENGTH_MAX))
+  {
+    printError(F("ERROR (LedArray::setPlaylist): Expected up to %d pairs of a slot and an acquisition count%s"), PLAYLIST_LENGTH_MAX, SERIAL_LINE_ENDING);
+    return;
+  }
+  for (uint16_t argument_index = 0; argument_index < argc; argument_index += 2)
+  {
+    if (strtoul(argv[argument_index], NULL, 0) >= SEQUENCE_SLOT_COUNT)
+    {
+      printError(F("ERROR (LedArray::setPlaylist): Invalid sequence slot (%s)%s"), argv[argument_index], SERIAL_LINE_ENDING);
+      return;
+    }
+  }
+
+  playlist_length = argc / 2;
+  for (uint8_t entry_index = 0; entry_index < playlist_length; entry_index++)
+  {
+    playlist_slots[entry_index] = strtoul(argv[2 * entry_index], NULL, 0);
+    playlist_acquisition_counts[entry_index] = strtoul(argv[2 * entry_index + 1], NULL, 0);
+  }
+
+  if (machine_mode)
+    setResponsePayload(F("%d"), playlist_length);
+  else
+    Serial.printf(F("Playlist has %d entries%s"), playlist_length, SERIAL_LINE_ENDING);
+}
+
+/* Plays the sequences of the playlist in order, each the number of times set in the playlist, with the arguments of
+   rseq (the acquisition count is the number of times the whole playlist is played) */
+void LedArray::runPlaylist(uint16_t argc, char ** argv)
+{
+  if (playlist_length == 0)
+  {
+    printError(F("ERROR (LedArray::runPlaylist): Playlist is empty (set it with spl)%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+  for (uint8_t entry_index = 0; entry_index < playlist_length; entry_index++)
+  {
+    if (led_sequence_slots[playlist_slots[entry_index]].number_of_patterns_assigned == 0)
+    {
+      printError(F("ERROR (LedArray::runPlaylist): Sequence slot %d is empty%s"), playlist_slots[entry_index], SERIAL_LINE_ENDING);
+      return;
+    }
+  }
+  runSequence(argc, argv, SEQUENCE_SOURCE_PLAYLIST);
+}
+
+/* Moves the sequence task on to the next playlist entry. Returns false once the playlist has been played as many
+   times as requested. */
+bool LedArray::advancePlaylist()
+{
+  if (task_playlist_index + 1 < playlist_length)
+    task_playlist_index++;
+  else if (task_playlist_loop + 1 < task_playlist_loop_count)
+  {
+    task_playlist_index = 0;
+    task_playlist_loop++;
+  }
+  else
+    return (false);
+
+  task_slot = playlist_slots[task_playlist_index];
+  task_acquisition_count = playlist_acquisition_counts[task_playlist_index];
+  task_pattern_index = 0;
+  task_frame_index = 0;
+  return (true);
+}
+
+bool LedArray::isSequenceSlotPlaying(uint8_t slot)
+{
+  if ((task_type != TASK_SEQUENCE) || task_stream)
+    return (false);
+  else if (task_playlist_index < 0)
+    return (slot == task_slot);
+
+  for (uint8_t entry_index = 0; entry_index < playlist_length; entry_index++)
+  {
+    if (playlist_slots[entry_index] == slot)
+      return (true);
+  }
+  return (false);
+}
+
+/* Returns true if the selected slot can be changed while the current task runs */
+bool LedArray::isSequenceSlotIdle()
+{
+  return (!isSequenceSlotPlaying(sequence_slot));
+}
+
+bool LedArray::isPlaylistPlaying()
+{
+  return ((task_type == TASK_SEQUENCE) && (task_playlist_index >= 0));
+}
+
+/* Returns the bytes a pattern (an LED number list as passed to setSequenceValue) takes in the stream, or -1 if it has
+   an invalid LED range */
+int32_t LedArray::getStreamPatternSize(const int16_t * led_numbers)
+{
+  int16_t led_argc = led_numbers[0];
+  int32_t pattern_size = 2;
+  if (led_numbers[1] == -2)
+    return (pattern_size);
+
+  for (int led_argument_index = 0; led_argument_index < led_argc; led_argument_index++)
+  {
+    int16_t led_number = led_numbers[led_argument_index + 1];
+    if ((led_number <= LED_NUMBER_RANGE(0)) && (getLedNumberRange(led_numbers, led_number) == NULL))
+      return (-1);
+    pattern_size += led_stream.getEntrySize((led_number == -1) || (led_number <= LED_NUMBER_RANGE(0)));
+  }
+  return (pattern_size);
+}
+
+/* Appends a pattern (with the arguments of ssv) to the stream played by rstr. The stream buffer is allocated by the
+   first pattern, at the sequence bit depth. In machine mode, answers with the number of buffered patterns, the free
+   buffer space in bytes, the number of underruns and the index of the pattern of the last underrun. */
+void LedArray::pushStreamPattern(uint16_t argc, void ** led_values, int16_t * led_numbers)
+{
+  int16_t led_argc = led_numbers[0];
+  bool blank = (led_argc <= 0) || (led_numbers[1] == -2);
+  if (!blank && (argc != led_argc * led_array_interface->color_channel_count))
+  {
+    printError(F("ERROR (LedArray::pushStreamPattern): Invalid number of arguments (should be divisible by %d)%s"), led_array_interface->color_channel_count, SERIAL_LINE_ENDING);
+    return;
+  }
+
+  if (led_stream.buffer == NULL)
+  {
+    if (!led_stream.allocate(LedArray::led_sequence->bit_depth, led_array_interface->color_channel_count))
+    {
+      printError(F("ERROR (LedArray::pushStreamPattern): Not enough memory for the stream buffer (%d bytes)%s"), STREAM_BUFFER_SIZE, SERIAL_LINE_ENDING);
+      return;
+    }
+  }
+  else if (led_stream.bit_depth != LedArray::led_sequence->bit_depth)
+  {
+    printError(F("ERROR (LedArray::pushStreamPattern): The stream has %d bit patterns%s"), led_stream.bit_depth, SERIAL_LINE_ENDING);
+    return;
+  }
+  else if (led_stream.ended)
+  {
+    printError(F("ERROR (LedArray::pushStreamPattern): The stream has ended%s"), SERIAL_LINE_ENDING);
+    return;
+  }
 
-      if (debug >= 0)
-        LedArray::led_sequence.print(LedArray::led_sequence.number_of_patterns_assigned - 1);
-    }
+  int32_t pattern_size = getStreamPatternSize(led_numbers);
+  if (pattern_size < 0)
+  {
+    printError(F("ERROR (LedArray::pushStreamPattern): Invalid LED range%s"), SERIAL_LINE_ENDING);
+    return;
   }
-  else if (pattern_led_count == 0)
+  else if ((uint32_t)pattern_size > led_stream.getFreeSize())
   {
-    // Add blank pattern
-    LedArray::led_sequence.incriment(0);
+    printError(F("ERROR (LedArray::pushStreamPattern): Stream buffer full (%lu bytes free, pattern takes %ld)%s"), led_stream.getFreeSize(), pattern_size, SERIAL_LINE_ENDING);
+    return;
   }
-  else
+
+  led_stream.beginPattern();
+  for (int led_argument_index = 0; !blank && (led_argument_index < led_argc); led_argument_index++)
   {
-    Serial.print(F("Error (LedArray::setSequenceValue) - invalid number of arguments (should be divisible by ")); Serial.print(led_array_interface->color_channel_count); Serial.print(SERIAL_LINE_ENDING);
+    const uint8_t * values = NULL;
+    if (led_stream.bit_depth > 1)
+      values = (const uint8_t *) led_values + led_argument_index * led_stream.getLedValueSize();
+
+    int16_t led_number = led_numbers[led_argument_index + 1];
+    if (led_number == -1)
+      led_stream.appendRange(0, led_array_interface->led_count - 1, 1, values);
+    else if (led_number <= LED_NUMBER_RANGE(0))
+    {
+      const int16_t * range = getLedNumberRange(led_numbers, led_number);
+      led_stream.appendRange(range[0], range[1], range[2], values);
+    }
+    else
+      led_stream.appendValues(led_number, values);
   }
+  led_stream.endPattern();
+
+  if (machine_mode)
+    setResponsePayload(F("%lu,%lu,%lu,%lu"), led_stream.getQueuedPatternCount(), led_stream.getFreeSize(), (uint32_t)led_stream.underrun_count, (uint32_t)led_stream.underrun_pattern_index);
 }
 
-void LedArray::printSequence()
+/* Returns false while a pattern has to wait for room in the buffer of the playing stream (the command router holds it
+   back meanwhile). Patterns which can not be streamed are not held back, so their error is reported. */
+bool LedArray::hasStreamSpace(const int16_t * led_numbers)
 {
-  Serial.print(F("Sequence has ")); Serial.print(LedArray::led_sequence.length); Serial.print("x "); Serial.print(LedArray::led_sequence.bit_depth); Serial.printf(F(" bit patterns:%s"), SERIAL_LINE_ENDING);
-  LedArray::led_sequence.print();
+  if ((led_numbers == NULL) || (task_type != TASK_SEQUENCE) || !task_stream || led_stream.ended)
+    return (true);
+  int32_t pattern_size = getStreamPatternSize(led_numbers);
+  return ((pattern_size < 0) || (pattern_size > STREAM_BUFFER_SIZE) || ((uint32_t)pattern_size <= led_stream.getFreeSize()));
 }
 
-void LedArray::printSequenceLength()
+/* Plays the patterns streamed with spsh as they arrive, with the arguments of rseq. The acquisition count is the number
+   of patterns to buffer before the first one is shown. The stream ends (and the command answers) once estr has been
+   received and all patterns are played. */
+void LedArray::runStream(uint16_t argc, char ** argv)
 {
-  Serial.print(LedArray::led_sequence.length);
-  Serial.print(SERIAL_LINE_ENDING);
+  if ((led_stream.buffer == NULL) && !led_stream.allocate(LedArray::led_sequence->bit_depth, led_array_interface->color_channel_count))
+  {
+    printError(F("ERROR (LedArray::runStream): Not enough memory for the stream buffer (%d bytes)%s"), STREAM_BUFFER_SIZE, SERIAL_LINE_ENDING);
+    return;
+  }
+  runSequence(argc, argv, SEQUENCE_SOURCE_STREAM);
+}
+
+/* Marks the end of the stream: it stops once the buffered patterns have been played */
+void LedArray::endStream()
+{
+  if (led_stream.buffer == NULL)
+  {
+    printError(F("ERROR (LedArray::endStream): No stream has been started%s"), SERIAL_LINE_ENDING);
+    return;
+  }
+  led_stream.ended = true;
+
+  if (machine_mode)
+    setResponsePayload(F("%lu"), led_stream.getQueuedPatternCount());
+  else
+    Serial.printf(F("Stream ends after %lu more patterns%s"), led_stream.getQueuedPatternCount(), SERIAL_LINE_ENDING);
 }
 
+/* Draws the next pattern of the stream, and frees its space in the stream buffer */
+void LedArray::drawStreamPattern()
+{
+  uint16_t entry_values[STREAM_VALUE_SIZE_MAX / 2];
+  uint8_t value_size = led_stream.getLedValueSize();
+  uint32_t position = led_stream.read_position;
+  uint16_t entry_count = led_stream.read16(position);
+
+  led_array_interface->clear();
+  for (uint16_t entry_index = 0; entry_index < entry_count; entry_index++)
+  {
+    uint16_t led_number = led_stream.read16(position);
+    uint16_t last_led_number = led_number;
+    uint16_t stride = 1;
+    if (led_number & SEQUENCE_RANGE)
+    {
+      led_number &= ~SEQUENCE_RANGE;
+      last_led_number = led_stream.read16(position);
+      stride = led_stream.read16(position);
+    }
+    led_stream.read(position, (uint8_t *) entry_values, value_size);
+
+    for (; led_number <= last_led_number; led_number += stride)
+    {
+      if (led_stream.bit_depth == 1)
+        led_array_interface->setLedValues(led_number, led_value);
+      else if (led_stream.bit_depth == 16)
+        led_array_interface->setLedValues(led_number, (const uint16_t *) entry_values);
+      else
+        led_array_interface->setLedValues(led_number, (const uint8_t *) entry_values);
+    }
+  }
+  led_stream.finishPattern(position);
+}
 
 /* Reset stored sequence */
 void LedArray::resetSequence()
@@ -1420,7 +2905,8 @@ void LedArray::resetSequence()
   LedArray::pattern_index = 0;
 }
 
-void LedArray::runSequence(uint16_t argc, char ** argv)
+/* Plays the sequence in the selected slot, the playlist (see runPlaylist) or the stream (see runStream) */
+void LedArray::runSequence(uint16_t argc, char ** argv, uint8_t source)
 {
   if (debug)
     Serial.printf(F("Starting sequence.%s"), SERIAL_LINE_ENDING);
@@ -1445,7 +2931,7 @@ void LedArray::runSequence(uint16_t argc, char ** argv)
 
   // Print Argument syntax if no arguments are provided
   if (argc == 0)
-    Serial.printf(F("ERROR (LedArray::runSequence): Wrong number of arguments. Syntax: rseq.[frame dt,ms],[# acquisitions],[trigger output mode 0], [trigger input mode 0], ...%s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::runSequence): Wrong number of arguments. Syntax: rseq.[frame dt,ms],[# acquisitions],[trigger output mode 0], [trigger input mode 0], ...%s"), SERIAL_LINE_ENDING);
 
   for (int argc_index = 0; argc_index < argc; argc_index++)
   {
@@ -1486,12 +2972,7 @@ void LedArray::runSequence(uint16_t argc, char ** argv)
   // Check to be sure we're not trying to go faster than the hardware will allow
   if ((delay_ms < MIN_SEQUENCE_DELAY))
   {
-    Serial.print("ERROR: Sequance delay (");
-    Serial.print(delay_ms);
-    Serial.print("ms) was shorter than MIN_SEQUENCE_DELAY (");
-    Serial.print(MIN_SEQUENCE_DELAY);
-    Serial.print("ms).");
-    Serial.print(SERIAL_LINE_ENDING);
+    printError(F("ERROR: Sequance delay (%dms) was shorter than MIN_SEQUENCE_DELAY (%dms).%s"), delay_ms, MIN_SEQUENCE_DELAY, SERIAL_LINE_ENDING);
     return;
   }
 
@@ -1499,97 +2980,390 @@ void LedArray::runSequence(uint16_t argc, char ** argv)
   led_array_interface->clear();
   led_array_interface->update();
 
-  // Initialize variables
-  uint16_t led_number;
+  // Patterns are shown by runSequenceTask. A playlist is played acquisition_count times, and a stream starts once
+  // acquisition_count patterns are buffered.
+  task_delay_ms = delay_ms;
+  task_stream = (source == SEQUENCE_SOURCE_STREAM);
+  task_stream_prefill = acquisition_count;
+  task_stream_underrun = false;
+  task_playlist_index = -1;
+
+  // Without input triggers to wait for, patterns are shown by the sequence timer at a fixed period
+  task_timer_driven = true;
+  task_timer_started = false;
+  for (int trigger_index = 0; trigger_index < led_array_interface->trigger_input_count; trigger_index++)
+    task_timer_driven = task_timer_driven && (LedArray::trigger_input_mode_list[trigger_index] == 0);
 
-  elapsedMicros elapsed_us_outer;
+  if ((source == SEQUENCE_SOURCE_PLAYLIST) && (acquisition_count > 0))
+  {
+    task_playlist_index = 0;
+    task_playlist_loop = 0;
+    task_playlist_loop_count = acquisition_count;
+    task_slot = playlist_slots[0];
+    task_acquisition_count = playlist_acquisition_counts[0];
+  }
+  else
+  {
+    task_slot = sequence_slot;
+    task_acquisition_count = (source == SEQUENCE_SOURCE_SLOT) ? acquisition_count : 0;
+  }
+  startTask(TASK_SEQUENCE);
+}
 
-  for (uint16_t frame_index = 0; frame_index < acquisition_count; frame_index++)
+/* Shows the stored sequence one stage at a time. Returns to loop() while waiting for input triggers, or while
+   waiting out the pattern delay unless it ends within TASK_SPIN_US, so pattern timing is unaffected. Without input
+   triggers, each pattern is drawn as soon as the previous one is shown, and the sequence timer shows it at the start
+   of its period (see sequenceTimerTick). */
+void LedArray::runSequenceTask()
+{
+  // A tick with no frame ready is an underrun of a stream, and means the delay is too short for anything else
+  if (task_timer_driven && (sequence_timer_late_count != task_timer_late_count))
   {
-    for (uint16_t pattern_index = 0; pattern_index < LedArray::led_sequence.number_of_patterns_assigned; pattern_index++)
+    task_timer_late_count = sequence_timer_late_count;
+    if (!task_stream)
     {
-      // Return if we send any command to interrupt.
-      if (Serial.available())
-        return;
+      printError(F("Error - delay too short!%s"), SERIAL_LINE_ENDING);
+      stopSequenceTimer();
+      led_array_interface->clear();
+      led_array_interface->update();
+      finishTask();
+      return;
+    }
+    if (!task_stream_underrun)
+    {
+      task_stream_underrun = true;
+      led_stream.underrun_count = led_stream.underrun_count + 1;
+      led_stream.underrun_pattern_index = led_stream.patterns_read - (sequence_timer_frame_ready ? 1 : 0);
+      if (!machine_mode)
+        Serial.printf(F("WARNING (LedArray::runSequenceTask): Stream underrun at pattern %lu%s"), (uint32_t)led_stream.underrun_pattern_index, SERIAL_LINE_ENDING);
+    }
+  }
 
-      // Sent output trigger pulses before illuminating
-      for (int trigger_index = 0; trigger_index < led_array_interface->trigger_output_count; trigger_index++)
+  // The LED buffer holds a frame waiting for the timer
+  if (task_timer_driven && sequence_timer_frame_ready)
+    return;
+
+  // A playlist moves on to its next entry once the current one has been played
+  while (((task_frame_index >= task_acquisition_count) || (led_sequence_slots[task_slot].number_of_patterns_assigned == 0))
+         && (task_stage == TASK_STAGE_START) && (task_playlist_index >= 0) && advancePlaylist())
+    ;
+
+  const LedSequence * sequence = &led_sequence_slots[task_slot];
+  uint16_t pattern_index = task_pattern_index;
+  uint16_t frame_index = task_frame_index;
+
+  switch (task_stage)
+  {
+    case TASK_STAGE_FINISH:
+    case TASK_STAGE_START:
       {
-        if (((LedArray::trigger_output_mode_list[trigger_index] > 0) && (pattern_index % LedArray::trigger_output_mode_list[trigger_index] == 0))
-            || ((LedArray::trigger_output_mode_list[trigger_index] == TRIG_MODE_ITERATION) && (pattern_index == 0))
-            || ((LedArray::trigger_output_mode_list[trigger_index] == TRIG_MODE_START) && (frame_index == 0 && pattern_index == 0)))
+        if (task_stream)
         {
-          sendTriggerPulse(trigger_index, false);
-          if (LedArray::trigger_start_delay_list_us[trigger_index] > 0)
-            delayMicroseconds(LedArray::trigger_start_delay_list_us[trigger_index]);
+          if (led_stream.ended && !led_stream.hasPattern())
+          {
+            if (!clearSequence())
+              return;
+            if (machine_mode)
+              setResponsePayload(F("%lu,%lu"), (uint32_t)led_stream.patterns_read, (uint32_t)led_stream.underrun_count);
+            else
+              Serial.printf(F("Finished streaming %lu patterns (%lu underruns)%s"), (uint32_t)led_stream.patterns_read, (uint32_t)led_stream.underrun_count, SERIAL_LINE_ENDING);
+            finishTask();
+            return;
+          }
+
+          // Wait for the next pattern. Once the stream plays, a pattern which has not arrived in time is an underrun
+          // (the previous pattern stays on until it arrives).
+          if (!led_stream.hasPattern() || (!led_stream.ended && (led_stream.getQueuedPatternCount() < task_stream_prefill)))
+          {
+            if ((led_stream.patterns_read > 0) && !task_stream_underrun && !task_timer_driven)
+            {
+              task_stream_underrun = true;
+              led_stream.underrun_count = led_stream.underrun_count + 1;
+              led_stream.underrun_pattern_index = led_stream.patterns_read;
+              if (!machine_mode)
+                Serial.printf(F("WARNING (LedArray::runSequenceTask): Stream underrun at pattern %lu%s"), (uint32_t)led_stream.patterns_read, SERIAL_LINE_ENDING);
+            }
+            return;
+          }
+          task_stream_prefill = 0;
+          task_stream_underrun = false;
         }
-      }
+        else if ((frame_index >= task_acquisition_count) || (sequence->number_of_patterns_assigned == 0))
+        {
+          if (!clearSequence())
+            return;
 
-      // Wait for all devices to start acquiring (if input triggers are configured
-      for (int trigger_index = 0; trigger_index < led_array_interface->trigger_input_count; trigger_index++)
-      {
-        if (((LedArray::trigger_input_mode_list[trigger_index] > 0) && (pattern_index % LedArray::trigger_input_mode_list[trigger_index] == 0))
-            || ((LedArray::trigger_input_mode_list[trigger_index] == TRIG_MODE_ITERATION) && (pattern_index == 0))
-            || ((LedArray::trigger_input_mode_list[trigger_index] == TRIG_MODE_START) && (frame_index == 0 && pattern_index == 0)))
-          waitForTriggerState(trigger_index, true);
+          // Let user know we're done
+          if (!machine_mode)
+            Serial.printf("Finished sending sequence.%s", SERIAL_LINE_ENDING);
+          finishTask();
+          return;
+        }
+
+        // Shift the pattern to the drivers while the previous one is still shown. A compiled pattern is shifted from its
+        // frame as it is, without touching the LED buffer.
+        if (!task_stream && (sequence_frames[task_slot] != NULL))
+          led_array_interface->shiftFrame(sequence_frames[task_slot] + (uint32_t)pattern_index * led_array_interface->getFrameSize());
+        else
+        {
+          // Define pattern (the task has just shown the previous one, so delta patterns only change the LEDs they
+          // list). It is drawn as in a batch, so it is only shifted once it is complete (clear() would show the
+          // cleared array first).
+          led_array_interface->batch_open = true;
+          if (task_stream)
+            drawStreamPattern();
+          else
+            drawSequencePattern(task_slot, pattern_index, pattern_index > 0);
+          led_array_interface->batch_open = false;
+          led_array_interface->batch_update_pending = false;
+          led_array_interface->shift();
+        }
+
+        // Sent output trigger pulses before illuminating (the sequence timer sends them before showing the pattern)
+        sequence_timer_trigger_mask = 0;
+        for (int trigger_index = 0; trigger_index < led_array_interface->trigger_output_count; trigger_index++)
+        {
+          if (((LedArray::trigger_output_mode_list[trigger_index] > 0) && (pattern_index % LedArray::trigger_output_mode_list[trigger_index] == 0))
+              || ((LedArray::trigger_output_mode_list[trigger_index] == TRIG_MODE_ITERATION) && (pattern_index == 0))
+              || ((LedArray::trigger_output_mode_list[trigger_index] == TRIG_MODE_START) && (frame_index == 0 && pattern_index == 0)))
+          {
+            if (task_timer_driven)
+            {
+              sequence_timer_trigger_mask = sequence_timer_trigger_mask | (1 << trigger_index);
+              continue;
+            }
+            sendTriggerPulse(trigger_index, false);
+            if (LedArray::trigger_start_delay_list_us[trigger_index] > 0)
+              delayMicroseconds(LedArray::trigger_start_delay_list_us[trigger_index]);
+          }
+        }
+        task_stage = TASK_STAGE_TRIGGER_START;
+        task_trigger_elapsed_ms = 0;
       }
+    // fall through
+    case TASK_STAGE_TRIGGER_START:
+      {
+        // Wait for all devices to start acquiring (if input triggers are configured
+        if (!checkSequenceTriggerInputs(true))
+          return;
 
-      elapsedMicros elapsed_us_inner;
+        // Hand the frame to the sequence timer, which shows it at the start of the next period (the first frame is
+        // shown as the timer starts)
+        if (task_timer_driven)
+        {
+          sequence_timer_frame_ready = true;
+          if (!task_timer_started && !startSequenceTimer())
+          {
+            sequence_timer_frame_ready = false;
+            printError(F("ERROR (LedArray::runSequenceTask): No hardware timer available for the sequence%s"), SERIAL_LINE_ENDING);
+            finishTask();
+            return;
+          }
+          task_stage = TASK_STAGE_TRIGGER_END;
+          break;
+        }
 
-      // Set all LEDs to zero
-      led_array_interface->clear();
+        // Show the pattern, which has already been shifted
+        led_array_interface->latch();
+        task_stage_elapsed_us = 0;
+        task_stage = TASK_STAGE_PATTERN;
+      }
+    // fall through
+    case TASK_STAGE_PATTERN:
+      {
+        // Wait for the defined mininum amount of time (delay_ms) before checking trigger input state
+        uint32_t delay_us = 1000 * (uint32_t)task_delay_ms;
+        if ((uint32_t)task_stage_elapsed_us + TASK_SPIN_US < delay_us)
+          return;
+        while ((uint32_t)task_stage_elapsed_us < delay_us) {} // Wait until this is true
 
-      // Define pattern
-      for (uint16_t led_idx = 0; led_idx < LedArray::led_sequence.led_counts[pattern_index]; led_idx++)
+        task_stage = TASK_STAGE_TRIGGER_END;
+        task_trigger_elapsed_ms = 0;
+      }
+    // fall through
+    case TASK_STAGE_TRIGGER_END:
       {
-        led_number = LedArray::led_sequence.led_list[pattern_index][led_idx];
-        if (LedArray::led_sequence.bit_depth == 1)
-          for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-            led_array_interface->setLed(led_number, color_channel_index, led_value[color_channel_index]);
-        else
-          for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-            led_array_interface->setLed(led_number, color_channel_index, LedArray::led_sequence.values[pattern_index][led_idx]);
+        // Wait for all devices to stop acquiring (if input triggers are configured
+        if (!checkSequenceTriggerInputs(false))
+          return;
+
+        if (debug)
+        {
+          Serial.print(F("Elapsed time: "));
+          Serial.print((uint32_t)task_elapsed_ms);
+          Serial.printf(F("ms %s"), SERIAL_LINE_ENDING);
+        }
+
+        // Move on to the next pattern
+        task_pattern_index++;
+        if (!task_stream && (task_pattern_index >= sequence->number_of_patterns_assigned))
+        {
+          task_pattern_index = 0;
+          task_frame_index++;
+        }
+        task_stage = TASK_STAGE_START;
       }
+  }
+}
 
-      // Check if led_count is zero - if so, clear the array
-      if (LedArray::led_sequence.led_counts[pattern_index] == 0)
-        led_array_interface->clear();
+/* Returns true once all input triggers configured for the start (or end) of the current sequence pattern are in
+   their expected state, or after MAX_TRIGGER_WAIT_TIME_S. */
+bool LedArray::checkSequenceTriggerInputs(bool start)
+{
+  uint16_t pattern_index = task_pattern_index;
+  uint16_t frame_index = task_frame_index;
+  uint16_t pattern_count = led_sequence_slots[task_slot].number_of_patterns_assigned;
+  bool timed_out = (task_trigger_elapsed_ms > MAX_TRIGGER_WAIT_TIME_S * 1000.0);
 
-      // Update pattern
-      led_array_interface->update();
+  for (int trigger_index = 0; trigger_index < led_array_interface->trigger_input_count; trigger_index++)
+  {
+    bool enabled;
+    if (start)
+      enabled = ((LedArray::trigger_input_mode_list[trigger_index] > 0) && (pattern_index % LedArray::trigger_input_mode_list[trigger_index] == 0))
+                || ((LedArray::trigger_input_mode_list[trigger_index] == TRIG_MODE_ITERATION) && (pattern_index == 0))
+                || ((LedArray::trigger_input_mode_list[trigger_index] == TRIG_MODE_START) && (frame_index == 0 && pattern_index == 0));
+    else
+      enabled = ((LedArray::trigger_input_mode_list[trigger_index] > 0) && (pattern_index % LedArray::trigger_input_mode_list[trigger_index] == 0))
+                || ((LedArray::trigger_input_mode_list[trigger_index] == TRIG_MODE_ITERATION) && (pattern_index == pattern_count))
+                || ((LedArray::trigger_input_mode_list[trigger_index] == TRIG_MODE_START) && (frame_index == task_acquisition_count && pattern_index == pattern_count));
 
-      // Ensure that we haven't set too short of a delay
-      if ((float)elapsed_us_inner > (1000 * (float)delay_ms))
-      {
-        Serial.printf(F("Error - delay too short!%s"), SERIAL_LINE_ENDING);
-        return;
-      }
+    if (enabled && (digitalReadFast(led_array_interface->trigger_input_pin_list[trigger_index]) != start))
+    {
+      if (!timed_out)
+        return (false);
+      Serial.printf(F("WARNING (LedArray::waitForTriggerState): Exceeding max delay for trigger input %d, %s"), trigger_index, SERIAL_LINE_ENDING);
+    }
+  }
+  return (true);
+}
+
+/* Clears the array once the sequence has been played. The sequence timer shows the cleared frame at the end of the
+   last pattern's period, so returns false until it has. */
+bool LedArray::clearSequence()
+{
+  if (task_timer_started && (task_stage != TASK_STAGE_FINISH))
+  {
+    // Only clear and shift the LED buffer (clear() also shows the cleared array on TLC5955 arrays)
+    led_array_interface->batch_open = true;
+    led_array_interface->clear();
+    led_array_interface->batch_open = false;
+    led_array_interface->batch_update_pending = false;
+    led_array_interface->shift();
+    sequence_timer_trigger_mask = 0;
+    sequence_timer_frame_ready = true;
+    task_stage = TASK_STAGE_FINISH;
+    return (false);
+  }
+  stopSequenceTimer();
+  led_array_interface->clear();
+  led_array_interface->update();
+  return (true);
+}
 
-      // Wait for the defined mininum amount of time (delay_ms) before checking trigger input state
-      while ((float)elapsed_us_inner < (1000 * (float)delay_ms)) {} // Wait until this is true
+/* Starts the sequence timer at the pattern delay and shows the first frame. The timer period is kept in hardware, so
+   the start of every later pattern is set by the timer alone and errors do not add up over the sequence. */
+bool LedArray::startSequenceTimer()
+{
+  sequence_timer_interface = led_array_interface;
+  sequence_timer_late_count = 0;
+  task_timer_late_count = 0;
+  sequence_trigger_active = false;
+  sequence_trigger_pulse_high = false;
+  sequence_timer.priority(SEQUENCE_TIMER_PRIORITY);
+  sequence_trigger_timer.priority(SEQUENCE_TIMER_PRIORITY);
+  if (!sequence_timer.begin(sequenceTimerTick, 1000.0 * (float)task_delay_ms))
+    return (false);
+  task_timer_started = true;
 
-      // Wait for all devices to stop acquiring (if input triggers are configured
-      for (int trigger_index = 0; trigger_index < led_array_interface->trigger_input_count; trigger_index++)
-      {
-        if (((LedArray::trigger_input_mode_list[trigger_index] > 0) && (pattern_index % LedArray::trigger_input_mode_list[trigger_index] == 0))
-            || ((LedArray::trigger_input_mode_list[trigger_index] == TRIG_MODE_ITERATION) && (pattern_index == LedArray::led_sequence.number_of_patterns_assigned))
-            || ((LedArray::trigger_input_mode_list[trigger_index] == TRIG_MODE_START) && (frame_index == acquisition_count && pattern_index == LedArray::led_sequence.number_of_patterns_assigned)))
-          waitForTriggerState(trigger_index, false);
-      }
-      if (debug)
+  noInterrupts();
+  sequenceTimerTick();
+  interrupts();
+  return (true);
+}
+
+void LedArray::stopSequenceTimer()
+{
+  if (task_timer_started)
+  {
+    noInterrupts();
+    sequence_timer.end();
+    sequence_trigger_timer.end();
+    if (sequence_trigger_pulse_high)
+      sequence_timer_interface->setTriggerState(sequence_trigger_index, false);
+    sequence_trigger_pulse_high = false;
+    sequence_trigger_active = false;
+    interrupts();
+  }
+  task_timer_started = false;
+  sequence_timer_frame_ready = false;
+}
+
+/* Sequence timer interrupt: starts sending the output triggers of the frame the task has drawn and shifted, which is
+   latched once they are sent (see sequenceTriggerStep). A tick which finds no frame ready, or the triggers of the
+   last frame still being sent, leaves the previous pattern on and is counted, for the task to report. */
+void LedArray::sequenceTimerTick()
+{
+  if (!sequence_timer_frame_ready || sequence_trigger_active)
+  {
+    sequence_timer_late_count = sequence_timer_late_count + 1;
+    return;
+  }
+
+  sequence_trigger_active = true;
+  sequence_trigger_index = -1;
+  sequence_trigger_pulse_high = false;
+  sequenceTriggerStep();
+}
+
+/* Sends the output triggers of the frame being shown as the task does without the timer (each trigger is pulsed, then
+   its start delay passes), then latches the frame. Instead of waiting, each step arms the trigger timer for the next
+   one, so interrupts of lower priority (USB serial) are never held up for the pulse widths and start delays. */
+void LedArray::sequenceTriggerStep()
+{
+  while (true)
+  {
+    // End the pulse of the current trigger, then wait out its start delay
+    if (sequence_trigger_pulse_high)
+    {
+      sequence_timer_interface->setTriggerState(sequence_trigger_index, false);
+      sequence_trigger_pulse_high = false;
+      if (LedArray::trigger_start_delay_list_us[sequence_trigger_index] > 0)
       {
-        Serial.print(F("Elapsed time: "));
-        Serial.print((float)elapsed_us_outer);
-        Serial.printf(F("us %s"), SERIAL_LINE_ENDING);
+        waitSequenceTrigger(LedArray::trigger_start_delay_list_us[sequence_trigger_index]);
+        return;
       }
     }
+
+    // Start the pulse of the next trigger
+    do
+      sequence_trigger_index = sequence_trigger_index + 1;
+    while ((sequence_trigger_index < sequence_timer_interface->trigger_output_count) && !(sequence_timer_trigger_mask & (1 << sequence_trigger_index)));
+    if (sequence_trigger_index >= sequence_timer_interface->trigger_output_count)
+      break;
+    sequence_timer_interface->setTriggerState(sequence_trigger_index, true);
+    sequence_trigger_pulse_high = true;
+    if (LedArray::trigger_pulse_width_list_us[sequence_trigger_index] > 0)
+    {
+      waitSequenceTrigger(LedArray::trigger_pulse_width_list_us[sequence_trigger_index]);
+      return;
+    }
   }
 
-  led_array_interface->clear();
-  led_array_interface->update();
+  // All triggers are sent, so show the frame
+  sequence_trigger_timer.end();
+  sequence_timer_interface->latch();
+  sequence_trigger_active = false;
+  sequence_timer_frame_ready = false;
+}
 
-  // Let user know we're done
-  Serial.printf("Finished sending sequence.%s", SERIAL_LINE_ENDING);
+/* Runs the next trigger step after delay_us (it is run after waiting in place if no hardware timer is free) */
+void LedArray::waitSequenceTrigger(uint32_t delay_us)
+{
+  if (!sequence_trigger_timer.begin(sequenceTriggerStep, delay_us))
+  {
+    delayMicroseconds(delay_us);
+    sequenceTriggerStep();
+  }
 }
 
 void LedArray::patternIncrementFast()
@@ -1597,7 +3371,7 @@ void LedArray::patternIncrementFast()
   noInterrupts();
 
   // Display pattern
-  if (LedArray::pattern_index <  LedArray::led_sequence.number_of_patterns_assigned && LedArray::led_sequence.led_counts[LedArray::pattern_index] > 0)
+  if (LedArray::pattern_index <  LedArray::led_sequence->number_of_patterns_assigned && LedArray::led_sequence->getLedCount(LedArray::pattern_index) > 0)
   {
     digitalWriteFast(5, true);
     digitalWriteFast(6, true);
@@ -1672,12 +3446,7 @@ void LedArray::runSequenceFast(uint16_t argc, char ** argv)
   // Check to be sure we're not trying to go faster than the hardware will allow
   if ((pattern_delay_us < (float)MIN_SEQUENCE_DELAY_FAST))
   {
-    Serial.print("ERROR: Pattern delay (");
-    Serial.print(pattern_delay_us);
-    Serial.print("us) was shorter than MIN_SEQUENCE_DELAY_FAST (");
-    Serial.print(MIN_SEQUENCE_DELAY_FAST);
-    Serial.print("us).");
-    Serial.print(SERIAL_LINE_ENDING);
+    printError(F("ERROR: Pattern delay (%.2fus) was shorter than MIN_SEQUENCE_DELAY_FAST (%dus).%s"), pattern_delay_us, MIN_SEQUENCE_DELAY_FAST, SERIAL_LINE_ENDING);
     return;
   }
 
@@ -1690,7 +3459,7 @@ void LedArray::runSequenceFast(uint16_t argc, char ** argv)
     else if (LedArray::trigger_output_mode_list[trigger_pin_index] == TRIG_MODE_START)
       trigger_count += 1;
     else
-      trigger_count += ceil(acquisition_count * LedArray::led_sequence.number_of_patterns_assigned / LedArray::trigger_output_mode_list[trigger_pin_index]);
+      trigger_count += ceil(acquisition_count * LedArray::led_sequence->number_of_patterns_assigned / LedArray::trigger_output_mode_list[trigger_pin_index]);
   }
 
   if (debug >= 2)
@@ -1805,7 +3574,7 @@ void LedArray::runSequenceFast(uint16_t argc, char ** argv)
           }
           if (((float)elapsed_us_outer - elapsed_us_trigger) > 5000000)
           {
-            Serial.println(F("ERROR (LedArray::runSequenceFast): Dropping out output trigger loop"));
+            printError(F("ERROR (LedArray::runSequenceFast): Dropping out output trigger loop%s"), SERIAL_LINE_ENDING);
             return;
           }
         }
@@ -1842,7 +3611,7 @@ void LedArray::runSequenceFast(uint16_t argc, char ** argv)
           }
           if (((float)elapsed_us_outer - elapsed_us_trigger) > 5000000)
           {
-            Serial.println(F("ERROR (LedArray::runSequenceFast): Dropping out of acquiring state wait loop"));
+            printError(F("ERROR (LedArray::runSequenceFast): Dropping out of acquiring state wait loop%s"), SERIAL_LINE_ENDING);
             return;
           }
         }
@@ -1858,10 +3627,10 @@ void LedArray::runSequenceFast(uint16_t argc, char ** argv)
       itimer.begin(patternIncrementFast, pattern_delay_us);
       itimer.priority(0);
 
-      if (LedArray::pattern_index > LedArray::led_sequence.number_of_patterns_assigned)
+      if (LedArray::pattern_index > LedArray::led_sequence->number_of_patterns_assigned)
         return;
       else
-        while (LedArray::pattern_index <= LedArray::led_sequence.number_of_patterns_assigned) {}
+        while (LedArray::pattern_index <= LedArray::led_sequence->number_of_patterns_assigned) {}
 
       // Stop sequence
       itimer.end();
@@ -1872,7 +3641,7 @@ void LedArray::runSequenceFast(uint16_t argc, char ** argv)
       // Check to ensure we haven't exceeded the time between frames. If we have, return which will cause errors downstream.
       if (((float) elapsed_us_outer - elapsed_us_start) >= (float)(LedArray::frame_index + 1) * frame_delay_us)
       {
-        Serial.printf(F("ERROR (LedArray::runSequenceFast) Trigger process time (%f) exceeded frame delay (%f) for frame %d %s"),
+        printError(F("ERROR (LedArray::runSequenceFast) Trigger process time (%f) exceeded frame delay (%f) for frame %d %s"),
                       ((float) elapsed_us_outer - elapsed_us_start), (float)(LedArray::frame_index + 1) * frame_delay_us, LedArray::frame_index, SERIAL_LINE_ENDING);
         return;
       }
@@ -1881,12 +3650,14 @@ void LedArray::runSequenceFast(uint16_t argc, char ** argv)
       LedArray::frame_index++;
     }
   }
-  Serial.printf(F("Finished fast Sequence %s"), SERIAL_LINE_ENDING);
+  if (!machine_mode)
+    Serial.printf(F("Finished fast Sequence %s"), SERIAL_LINE_ENDING);
 }
 
 void LedArray::stepSequence(uint16_t argc, char ** argv)
 {
-  Serial.printf(F("Stepping sequence %s"), SERIAL_LINE_ENDING);
+  if (!machine_mode)
+    Serial.printf(F("Stepping sequence %s"), SERIAL_LINE_ENDING);
 
   /* Format for argv:
      0: trigger output 1 setting
@@ -1933,11 +3704,9 @@ void LedArray::stepSequence(uint16_t argc, char ** argv)
   LedArray::trigger_output_mode_list[1] = 0;
 
   // Loop sequence counter if it's at the end
-  if (LedArray::pattern_index >= LedArray::led_sequence.number_of_patterns_assigned)
+  if (LedArray::pattern_index >= LedArray::led_sequence->number_of_patterns_assigned)
     LedArray::pattern_index = 0;
 
-  uint16_t led_number;
-
   // Sent output trigger pulses before illuminating
   for (int trigger_index = 0; trigger_index < led_array_interface->trigger_output_count; trigger_index++)
   {
@@ -1963,16 +3732,8 @@ void LedArray::stepSequence(uint16_t argc, char ** argv)
 
   elapsedMicros elapsed_us_inner;
 
-  // Clear the array
-  led_array_interface->clear();
-
   // Send LEDs
-  for (uint16_t led_idx = 0; led_idx < LedArray::led_sequence.led_counts[LedArray::pattern_index]; led_idx++)
-  {
-    led_number = LedArray::led_sequence.led_list[LedArray::pattern_index][led_idx];
-    for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-      led_array_interface->setLed(led_number, color_channel_index, LedArray::led_sequence.values[LedArray::pattern_index][led_idx]);
-  }
+  drawSequencePattern(sequence_slot, LedArray::pattern_index, false);
 
   // Update pattern
   led_array_interface->update();
@@ -1992,11 +3753,16 @@ void LedArray::stepSequence(uint16_t argc, char ** argv)
   LedArray::pattern_index++;
 
   // Print user feedback
-  Serial.print(F("Displayed pattern # "));
-  Serial.print(LedArray::pattern_index);
-  Serial.print(F(" of "));
-  Serial.print( LedArray::led_sequence.number_of_patterns_assigned);
-  Serial.print(SERIAL_LINE_ENDING);
+  if (machine_mode)
+    setResponsePayload(F("%d"), LedArray::pattern_index);
+  else
+  {
+    Serial.print(F("Displayed pattern # "));
+    Serial.print(LedArray::pattern_index);
+    Serial.print(F(" of "));
+    Serial.print( LedArray::led_sequence->number_of_patterns_assigned);
+    Serial.print(SERIAL_LINE_ENDING);
+  }
 }
 
 /* A function to set the distance from the sample to the LED array. Used for calculating the NA of each LED.*/
@@ -2013,14 +3779,19 @@ void LedArray::setDistanceZ(int argc, char ** argv)
       buildNaList(led_array_distance_z);
     }
     else
-      Serial.printf(F("ERROR (LedArray::setDistanceZ): invalid z-distance.%s"), SERIAL_LINE_ENDING);
+      printError(F("ERROR (LedArray::setDistanceZ): invalid z-distance.%s"), SERIAL_LINE_ENDING);
   }
   else
-    Serial.printf(F("ERROR (LedArray::setDistanceZ): wrong number of arguments.%s"), SERIAL_LINE_ENDING);
+    printError(F("ERROR (LedArray::setDistanceZ): wrong number of arguments.%s"), SERIAL_LINE_ENDING);
 
-  Serial.print(F("Current array to sample distance (z) is: "));
-  Serial.print(led_array_distance_z);
-  Serial.printf(F("mm%s"), SERIAL_LINE_ENDING);
+  if (machine_mode)
+    setResponsePayload(F("%.2f"), led_array_distance_z);
+  else
+  {
+    Serial.print(F("Current array to sample distance (z) is: "));
+    Serial.print(led_array_distance_z);
+    Serial.printf(F("mm%s"), SERIAL_LINE_ENDING);
+  }
 }
 
 void LedArray::toggleAutoClear(uint16_t argc, char ** argv)
@@ -2030,7 +3801,9 @@ void LedArray::toggleAutoClear(uint16_t argc, char ** argv)
   else
     auto_clear_flag = (bool)atoi(argv[0]);
 
-  if (auto_clear_flag)
+  if (machine_mode)
+    setResponsePayload(F("%d"), auto_clear_flag);
+  else if (auto_clear_flag)
     Serial.printf(F("Auto clear bit is now 1 (The LED array will clear before and after each new command) %s"), SERIAL_LINE_ENDING);
   else
     Serial.printf(F("Auto clear bit is now 0 (The LED array will NOT clear before and after each new command) %s"), SERIAL_LINE_ENDING);
@@ -2047,7 +3820,8 @@ void LedArray::setDebug(uint16_t new_debug_level)
     debug = new_debug_level;
 
   // User feedback
-  Serial.printf(F("(LedArray::setDebug): Set debug level to %d \n"), debug);
+  if (!machine_mode)
+    Serial.printf(F("(LedArray::setDebug): Set debug level to %d \n"), debug);
 
   // Set debug level for interface
   led_array_interface->setDebug((int) (new_debug_level % 10));
@@ -2105,22 +3879,31 @@ void LedArray::setup()
   for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
     led_color[color_channel_index] = (uint8_t)(round((float)UINT8_MAX / led_array_interface->color_channel_count)) ; // TODO: make this respect bit depth
 
-  // Reset sequence
-  LedArray::led_sequence.deallocate();
+  // Reset all sequence slots (with one value per color channel for each LED) and select the first one
+  for (uint8_t slot = SEQUENCE_SLOT_COUNT; slot-- > 0;)
+  {
+    sequence_slot = slot;
+    LedArray::led_sequence = &led_sequence_slots[slot];
+    releaseSequenceFrames();
+    LedArray::led_sequence->deallocate();
+    LedArray::led_sequence->color_channel_count = led_array_interface->color_channel_count;
+    LedArray::led_sequence->array_led_count = led_array_interface->led_count;
+  }
+  playlist_length = 0;
 
   // Initialize sequences at every bit depth so these are defined
-  LedArray::led_sequence.allocate(7);
-  LedArray::led_sequence.incriment(1);
-  LedArray::led_sequence.append(0, 127);
-  LedArray::led_sequence.incriment(0);
-  LedArray::led_sequence.incriment(1);
-  LedArray::led_sequence.append(1, 127);
-  LedArray::led_sequence.incriment(0);
-  LedArray::led_sequence.incriment(1);
-  LedArray::led_sequence.append(2, 127);
-  LedArray::led_sequence.incriment(0);
-  LedArray::led_sequence.incriment(1);
-  LedArray::led_sequence.append(3, 127);
+  LedArray::led_sequence->allocate(7, 4);
+  LedArray::led_sequence->incriment(1);
+  LedArray::led_sequence->append(0, 127);
+  LedArray::led_sequence->incriment(0);
+  LedArray::led_sequence->incriment(1);
+  LedArray::led_sequence->append(1, 127);
+  LedArray::led_sequence->incriment(0);
+  LedArray::led_sequence->incriment(1);
+  LedArray::led_sequence->append(2, 127);
+  LedArray::led_sequence->incriment(0);
+  LedArray::led_sequence->incriment(1);
+  LedArray::led_sequence->append(3, 127);
 
   // Build list of LED NA coordinates
   buildNaList(led_array_distance_z);
@@ -2132,117 +3915,62 @@ void LedArray::setup()
   initial_setup = false;
 }
 
+/* Runs a demo of the patterns above as a task until stopped */
 void LedArray::demo()
 {
-  while (!Serial.available())
-  {
-
-    //    // Demo fill array
-    //    for (int color_channel_index_outer = 0; color_channel_index_outer < led_array_interface->color_channel_count; color_channel_index_outer++)
-    //    {
-    //      for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-    //        led_value[color_channel_index] = 0;
-    //
-    //      led_value[color_channel_index_outer] = 10;
-    //      led_array_interface->clear();
-    //
-    //      for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-    //        led_array_interface->setLed(-1, color_channel_index_outer, led_value[color_channel_index_outer]);
-    //
-    //      led_array_interface->update();
-    //      delay(250);
-    //    }
-
-    // Demo Brightfield patterns
-    for (int color_channel_index_outer = 0; color_channel_index_outer < led_array_interface->color_channel_count; color_channel_index_outer++)
-    {
-      for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-        led_value[color_channel_index] = 0;
+  task_delay_ms = 0;
+  startTask(TASK_DEMO);
+}
 
-      led_value[color_channel_index_outer] = 64;
-      led_array_interface->clear();
-      drawCircle(0, objective_na);
-      led_array_interface->update();
-      delay(250);
+/* Draws the next demo frame once the previous one has been shown for its delay. Frames are: brightfield and annulus
+   for each color channel, four DPC patterns for each color channel, each LED forwards and backwards, then a pause. */
+void LedArray::runDemoTask()
+{
+  if (task_stage_elapsed_us < 1000 * (uint32_t)task_delay_ms)
+    return;
 
-      if (Serial.available())
-      {
-        clear();
-        return;
-      }
-    }
+  int16_t color_channel_count = led_array_interface->color_channel_count;
+  int16_t frame_index = task_pattern_index;
 
-    // Demo Annulus patterns
-    for (int color_channel_index_outer = 0; color_channel_index_outer < led_array_interface->color_channel_count; color_channel_index_outer++)
-    {
-      for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-        led_value[color_channel_index] = 0;
+  if (frame_index < 6 * color_channel_count)
+  {
+    // Demo Brightfield, Annulus and DPC patterns
+    int16_t color_channel_index_outer = (frame_index < 2 * color_channel_count) ? (frame_index % color_channel_count) : ((frame_index - 2 * color_channel_count) / 4);
+    for (int color_channel_index = 0; color_channel_index < color_channel_count; color_channel_index++)
+      led_value[color_channel_index] = 0;
 
-      led_value[color_channel_index_outer] = 64;
-      led_array_interface->clear();
+    led_value[color_channel_index_outer] = (frame_index < 2 * color_channel_count) ? 64 : 127;
+    led_array_interface->clear();
+    if (frame_index < color_channel_count)
+      drawCircle(0, objective_na);
+    else if (frame_index < 2 * color_channel_count)
       drawCircle(objective_na, objective_na + 0.2);
-      led_array_interface->update();
-      delay(250);
-
-      if (Serial.available())
-      {
-        clear();
-        return;
-      }
-    }
-
-    // Demo DPC Patterns
-    for (int color_channel_index_outer = 0; color_channel_index_outer < led_array_interface->color_channel_count; color_channel_index_outer++)
-    {
-      for (int dpc_index = 0; dpc_index < 4; dpc_index++)
-      {
-        for (int color_channel_index = 0; color_channel_index < led_array_interface->color_channel_count; color_channel_index++)
-          led_value[color_channel_index] = 0;
-
-        led_value[color_channel_index_outer] = 127;
-        led_array_interface->clear();
-        drawHalfCircle(dpc_index, 0, objective_na);
-        led_array_interface->update();
-        delay(250);
-        if (Serial.available())
-        {
-          clear();
-          return;
-        }
-
-      }
-    }
-
-    for ( int16_t led_index = 0; led_index <  led_array_interface->led_count; led_index++)
-    {
-      led_array_interface->setLed(-1, -1, (uint8_t)0);
-      led_array_interface->setLed(led_index, -1, (uint8_t)127);
-      led_array_interface->update();
-      delay(1);
-
-      if (Serial.available())
-      {
-        clear();
-        return;
-      }
-    }
-
-    for ( int16_t led_index = led_array_interface->led_count - 1; led_index >= 0; led_index--)
-    {
-      led_array_interface->setLed(-1, -1, (uint8_t)0);
-      led_array_interface->setLed(led_index, -1, (uint8_t)127);
-      led_array_interface->update();
-      delay(1);
-
-      if (Serial.available())
-      {
-        clear();
-        return;
-      }
-    }
+    else
+      drawHalfCircle((frame_index - 2 * color_channel_count) % 4, 0, objective_na);
+    led_array_interface->update();
+    task_delay_ms = 250;
+  }
+  else if (frame_index < 6 * color_channel_count + 2 * led_array_interface->led_count)
+  {
+    // Scan each LED forwards, then backwards
+    int16_t led_index = frame_index - 6 * color_channel_count;
+    if (led_index >= led_array_interface->led_count)
+      led_index = 2 * led_array_interface->led_count - 1 - led_index;
 
-    delay(100);
+    led_array_interface->setLed(-1, -1, (uint8_t)0);
+    led_array_interface->setLed(led_index, -1, (uint8_t)127);
+    led_array_interface->update();
+    task_delay_ms = 1;
   }
+  else
+  {
+    // Pause before starting over
+    task_delay_ms = 100;
+    frame_index = -1;
+  }
+
+  task_pattern_index = frame_index + 1;
+  task_stage_elapsed_us = 0;
 }
 
 void LedArray::notImplemented(const char * command_name)
@@ -30,6 +30,7 @@
 
 #include "ledarrayinterface.h"
 #include "ledsequence.h"
+#include "ledstream.h"
 #include "illuminate.h"
 #include "src/T3Mac/T3Mac.h"
 
@@ -56,6 +57,46 @@
 #define DELAY_MAX 2000        // Global maximum amount to wait inside loop
 #define INVALID_NA -2000.0    // Represents an invalid NA
 #define DEFAULT_NA 0.25         // 100 * default NA, int
+#define HEAP_SIZE_MAX 65536     // Upper bound when probing the heap (RAM of the Teensy 3.2)
+#define FLASH_STORE_END 0x40000 // End of program flash (Teensy 3.2), where the flash sequence store ends
+#define FLASH_WRITE_CHUNK_SIZE 256 // Sequence image bytes copied to the stack per flash write
+
+// LED number lists passed to setSequenceValue hold -1 for all LEDs and LED_NUMBER_RANGE(i) for LED range i (first LED,
+// last LED and stride), which is stored at led_numbers[led_numbers[led count + 1] + 3 * i]
+#define LED_NUMBER_RANGE(range_index) (-3 - (int16_t)(range_index))
+
+// Sequence slots, each holding an independently allocated sequence (see LedArray::selectSequenceSlot)
+#define SEQUENCE_SLOT_COUNT 4
+#define PLAYLIST_LENGTH_MAX 16   // Entries (slot and repeat count) of the playlist played by rpl
+
+// Sources of the patterns played by the sequence task (see LedArray::runSequence)
+#define SEQUENCE_SOURCE_SLOT 0       // The selected sequence slot (rseq)
+#define SEQUENCE_SOURCE_PLAYLIST 1   // The sequence slots of the playlist (rpl)
+#define SEQUENCE_SOURCE_STREAM 2     // Patterns streamed by the host (rstr)
+
+// Long-running tasks, which run a step at a time from loop() (see LedArray::runTask)
+#define TASK_NONE 0
+#define TASK_DISCO 1
+#define TASK_WATER_DROP 2
+#define TASK_DEMO 3
+#define TASK_SCAN 4
+#define TASK_SEQUENCE 5
+#define TASK_TRIGGER_TEST 6
+
+// Sequence generators (see LedArray::generateSequence)
+#define SEQUENCE_GENERATOR_SCAN 0      // One LED per pattern, over an NA range
+#define SEQUENCE_GENERATOR_DPC 1       // Top, bottom, left and right half circles up to the objective NA
+#define SEQUENCE_GENERATOR_ANNULUS 2   // Annuli of a fixed NA width, over an NA range
+
+// Stages of the scan and sequence tasks
+#define TASK_STAGE_START 0           // Sending output triggers before a pattern
+#define TASK_STAGE_TRIGGER_START 1   // Waiting for input triggers before a pattern
+#define TASK_STAGE_PATTERN 2         // Showing a pattern for the pattern delay
+#define TASK_STAGE_TRIGGER_END 3     // Waiting for input triggers after a pattern
+#define TASK_STAGE_FINISH 4          // Showing the last pattern before clearing the array
+
+#define TASK_SPIN_US 1000            // Pattern delays ending within this time are waited out instead of returning to loop()
+#define SEQUENCE_TIMER_PRIORITY 64   // Interrupt priority of the sequence and trigger timers (above USB serial, so frames are shown on time)
 
 #define LED_BRIGHTNESS_DEFAULT 63
 #define LED_COLOR_DEFAULT 255
@@ -68,6 +109,12 @@ class LedArray {
 
     // Pattern commands
     void drawLedList(uint16_t argc, char ** argv);          // Draw a list of LEDs (or just 1)
+    static bool parseLedRange(const char * argument, int16_t * range);
+    bool isLedRangeValid(const int16_t * range);           // Check an LED range (first, last, stride) against the array
+    void drawLedList(uint16_t led_count, uint16_t * led_numbers);  // Draw a list of LEDs from a binary frame
+    void setImageValue(uint16_t value_index, uint16_t value);      // Write one value of an image to the array buffer
+    void drawImage(uint8_t bit_depth, uint16_t value_count);       // Show an image written with setImageValue
+    void discardImage();                                           // Clear the values of a failed image from the buffer
     void scanBrightfieldLeds(uint16_t argc, char ** argv);  // Scan brightfield LEDs
     void scanAllLeds(uint16_t argc, char ** argv);
     void drawDpc(uint16_t argc, char ** argv);
@@ -109,19 +156,57 @@ class LedArray {
     void setMaxCurrentEnforcement(int argc, char ** argv);
     void setMaxCurrentLimit(int argc, char ** argv);
 
+    // Batches
+    void beginBatch();
+    void commitBatch();
+    bool isBatchOpen();
+
+    // Long-running tasks
+    bool isTaskRunning();
+    void runTask();
+    void stopTask();
+    void printTaskStatus();
+
+    // Machine response mode
+    void setMachineMode(bool enabled);
+    bool getMachineMode();
+    void beginResponse();
+    void setResponseStatus(uint8_t status);
+    uint8_t getResponseStatus();
+    void setResponsePayload(const __FlashStringHelper * format, ...);
+    const char * getResponsePayload();
+    void printError(const __FlashStringHelper * format, ...);
+
     // Sequencing
     int getSequenceBitDepth();
-    void runSequence(uint16_t argc, char ** argv);
+    void runSequence(uint16_t argc, char ** argv, uint8_t source = SEQUENCE_SOURCE_SLOT);
     void runSequenceFast(uint16_t argc, char ** argv);
     void stepSequence(uint16_t argc, char ** argv);
     void setSequenceValue(uint16_t argc, void ** led_values, int16_t * led_numbers);
+    bool setSequencePatterns(uint16_t length, const uint8_t * patterns);
     void printSequence();
     void printSequenceLength();
+    void printSequenceHash();
     void resetSequence();
-    void setSequenceLength(uint16_t new_seq_length, bool quiet);
+    void setSequenceLength(uint16_t new_seq_length, uint16_t led_capacity, bool delta_encoding, bool quiet);
     int getSequenceLength();
     void setSequenceBitDepth(uint8_t bit_depth, bool quiet);
     void setSequenceZeros(uint16_t argc, char ** argv);
+    void generateSequence(uint16_t argc, char ** argv);
+    void compileSequence();
+    void saveSequenceToFlash(uint16_t argc, char ** argv);
+    void loadSequenceFromFlash(uint16_t argc, char ** argv);
+    void deleteFlashSequence(uint16_t argc, char ** argv);
+    void printFlashSequences();
+    void selectSequenceSlot(uint16_t argc, char ** argv);
+    void setPlaylist(uint16_t argc, char ** argv);
+    void runPlaylist(uint16_t argc, char ** argv);
+    bool isSequenceSlotIdle();
+    bool isPlaylistPlaying();
+    void pushStreamPattern(uint16_t argc, void ** led_values, int16_t * led_numbers);
+    bool hasStreamSpace(const int16_t * led_numbers);
+    void runStream(uint16_t argc, char ** argv);
+    void endStream();
 
     // Printing system state and information
     void printLedPositions(bool print_na);
@@ -137,6 +222,8 @@ class LedArray {
     void setInterface(LedArrayInterface * interface);
     void notImplemented(const char * command_name);
     void drawChannel(int argc, char * *argv);
+    bool isLedInNaRange(int16_t led_index, float start_na, float end_na);
+    bool isLedInHalfCircle(int16_t led_index, int8_t half_circle_type, float start_na, float end_na);
     void setPinOrder(int argc, char * *argv);
     void notFinished(const char * command_name);
     int getColorChannelCount();
@@ -147,6 +234,8 @@ class LedArray {
     void setPartNumber(uint16_t part_number);
     void setSerialNumber(uint16_t serial_number);
     void printMacAddress();
+    void printMemory(uint16_t argc, char ** argv);
+    uint32_t getLargestFreeBlock();
 
     // Device-specific commands
     uint8_t getDeviceCommandCount();
@@ -178,8 +267,18 @@ class LedArray {
     // LED array control object
     LedArrayInterface * led_array_interface;
 
-    // LED sequence object for storage and retreival
-    static LedSequence led_sequence;
+    // LED sequence objects for storage and retreival. Sequence commands (ssl, ssv, pseq, ...) use the selected slot.
+    static LedSequence led_sequence_slots[SEQUENCE_SLOT_COUNT];
+    static LedSequence * led_sequence;
+    uint8_t sequence_slot = 0;
+
+    // Playlist (slot and number of acquisitions of each entry)
+    uint8_t playlist_slots[PLAYLIST_LENGTH_MAX];
+    uint16_t playlist_acquisition_counts[PLAYLIST_LENGTH_MAX];
+    uint8_t playlist_length = 0;
+
+    // Patterns streamed by the host, played as they arrive (see runStream)
+    LedStream led_stream;
 
     // LED Controller Parameters
     boolean auto_clear_flag = true;
@@ -191,6 +290,11 @@ class LedArray {
     char * device_name;
     int8_t default_brightness = 63;
 
+    // Machine response mode (one status line per command instead of messages and terminator)
+    bool machine_mode = false;
+    uint8_t response_status = RESPONSE_STATUS_OK;
+    char response_payload[RESPONSE_PAYLOAD_LENGTH + 1];
+
     // Trigger Input (feedback) Settings
     static volatile float trigger_feedback_timeout_ms;
     static volatile uint32_t * trigger_pulse_width_list_us;
@@ -210,10 +314,87 @@ class LedArray {
     // Sequence stepping index
     uint16_t sequence_number_displayed = 0;
 
+    // Compiled sequence of each slot (a copy of the LED buffer for each pattern, see compileSequence)
+    uint8_t * sequence_frames[SEQUENCE_SLOT_COUNT] = {};
+    uint32_t sequence_frames_size[SEQUENCE_SLOT_COUNT] = {};
+
+    // Long-running task state
+    void startTask(uint8_t new_task_type);
+    void finishTask();
+    void runDiscoTask();
+    void runWaterDropTask();
+    void runDemoTask();
+    void runScanTask();
+    void runSequenceTask();
+    void runTriggerTestTask();
+    void drawSequencePattern(uint8_t slot, uint16_t pattern_index, bool incremental);
+    void releaseSequenceFrames();
+    void releaseSequenceFrames(uint8_t slot);
+    uint16_t runSequenceGenerator(uint8_t generator, float start_na, float end_na, float step_na, const uint8_t * values, uint32_t * led_total);
+    uint32_t getFlashStoreStart();
+    const FlashSequenceHeader * getFlashSequence(uint32_t address);
+    uint32_t getFlashSequenceEnd(uint32_t address);
+    const FlashSequenceHeader * findFlashSequence(uint16_t id);
+    uint32_t findFlashSpace(uint32_t byte_count);
+    uint32_t getFlashStoreFree();
+    bool eraseFlashSequence(const FlashSequenceHeader * header);
+    bool isSlotInFlashSequence(uint8_t slot, const FlashSequenceHeader * header);
+    void drawSequenceEntries(uint8_t slot, uint16_t pattern_index);
+    bool isSequenceSlotPlaying(uint8_t slot);
+    bool advancePlaylist();
+    const int16_t * getLedNumberRange(const int16_t * led_numbers, int16_t led_number);
+    int32_t getStreamPatternSize(const int16_t * led_numbers);
+    void drawStreamPattern();
+    bool checkSequenceTriggerInputs(bool start);
+    bool clearSequence();
+    bool startSequenceTimer();
+    void stopSequenceTimer();
+    static void sequenceTimerTick();
+    static void sequenceTriggerStep();
+    static void waitSequenceTrigger(uint32_t delay_us);
+    uint8_t task_type = TASK_NONE;
+    uint8_t task_stage = TASK_STAGE_START;
+    uint16_t task_delay_ms = 0;
+    uint16_t task_acquisition_count = 0;
+    uint16_t task_pattern_index = 0;   // Pattern (sequence), LED (scan) or frame (demo, water drop) index
+    uint16_t task_frame_index = 0;     // Acquisition index of a sequence
+    uint8_t task_slot = 0;             // Sequence slot being played
+    int8_t task_playlist_index = -1;   // Playlist entry being played (-1 if a single slot is played)
+    uint16_t task_playlist_loop = 0;
+    uint16_t task_playlist_loop_count = 0;
+    bool task_stream = false;          // Playing the stream instead of a slot
+    uint16_t task_stream_prefill = 0;  // Patterns to buffer before the stream starts playing
+    bool task_stream_underrun = false;
+    bool task_timer_driven = false;    // Patterns are shown by the sequence timer (see sequenceTimerTick)
+    bool task_timer_started = false;
+    uint32_t task_timer_late_count = 0; // Late ticks already reported
+    float task_start_na = 0;
+    float task_end_na = 0;
+    bool task_print_indicies = false;
+    int task_trigger_index = 0;
+    bool task_trigger_state = false;
+    elapsedMillis task_elapsed_ms;
+    elapsedMicros task_stage_elapsed_us;
+    elapsedMillis task_trigger_elapsed_ms;
+
     // timer variable
     static volatile uint16_t pattern_index;
     static volatile uint16_t frame_index;
 
+    // Timer-driven sequence playback: the task draws the next frame into the LED buffer while the current one is shown,
+    // and the timer interrupt shows it at the start of the next period
+    static IntervalTimer sequence_timer;
+    static LedArrayInterface * sequence_timer_interface;
+    static volatile bool sequence_timer_frame_ready;    // A frame is drawn and waits for the timer (the task keeps off the LED buffer)
+    static volatile uint8_t sequence_timer_trigger_mask; // Output triggers pulsed before the ready frame is shown
+    static volatile uint32_t sequence_timer_late_count;  // Ticks at which no frame was ready
+
+    // Output triggers of the frame being shown, pulsed one step at a time from a one-shot timer (see sequenceTriggerStep)
+    static IntervalTimer sequence_trigger_timer;
+    static volatile bool sequence_trigger_active;        // Triggers are being sent, and the frame is latched after them
+    static volatile int8_t sequence_trigger_index;       // Trigger being pulsed (or whose start delay is passing)
+    static volatile bool sequence_trigger_pulse_high;    // The pulse of that trigger has not ended yet
+
 };
 #endif
 
@@ -45,6 +45,27 @@ class LedArrayInterface {
     void setLed(int16_t led_number, int16_t color_channel_index, uint8_t value);      // LED brightness (8-bit)
     void setLed(int16_t led_number, int16_t color_channel_index, bool value);         // LED brightness (boolean)
 
+    // Sets every color channel of an LED (one value per color channel) in a single driver call
+    void setLedValues(int16_t led_number, const uint16_t * values);   // 16-bit values
+    void setLedValues(int16_t led_number, const uint8_t * values);    // 8-bit values
+
+    // Image value (value_index is led_number * color_channel_count + color channel), written straight to the LED buffer
+    void setImageValue(uint16_t value_index, uint16_t value);
+
+    // Copies of the whole LED buffer (kept while compiling a sequence)
+    uint32_t getBufferSize();
+    void saveBuffer(uint8_t * buffer);
+    void loadBuffer(const uint8_t * buffer);
+
+    // Frames: the LED buffer serialized as the drivers take it, for compiled sequences. packFrame() fails if the
+    // frame would exceed the current limit; shiftFrame() sends a frame for latch() to show.
+    uint32_t getFrameSize();
+    bool packFrame(uint8_t * frame);
+    void shiftFrame(const uint8_t * frame);
+
+    // Static memory used by the LED driver buffers
+    uint32_t getDriverMemorySize();
+
     // Fast LED update
     void setLedFast(int16_t led_number, int color_channel_index, bool value);
 
@@ -62,6 +83,11 @@ class LedArrayInterface {
     // Update array
     void update();
 
+    // Update array in two steps: shift() sends the LED buffer to the drivers while they keep showing the previous
+    // values, and latch() then shows it at once
+    void shift();
+    void latch();
+
     // Debug
     bool getDebug();
     void setDebug(int state);
@@ -105,6 +131,10 @@ class LedArrayInterface {
     // Debug flag
     static int debug;
 
+    // Batch flags (while a batch is open, update() only records that the array changed)
+    static bool batch_open;
+    static bool batch_update_pending;
+
     // Triggering Variables
     static const int trigger_output_pin_list[];
     static const int trigger_input_pin_list[];
@@ -29,131 +29,548 @@
 #define LED_ARRAY_SEQUENCE_H
 #include "Arduino.h"
 #include "illuminate.h"
+#include "xxhash32.h"
 
-// Define LED Sequence Object
+// Pattern encodings
+#define SEQUENCE_ENCODING_LIST 0     // LED numbers (and values) of the lit LEDs
+#define SEQUENCE_ENCODING_BITSET 1   // One bit per LED of the array, packed into 16-bit led_list words (1-bit sequences only)
+#define SEQUENCE_ENCODING_DELTA 2    // LEDs turned on (with their values) or off since the previous pattern
+#define SEQUENCE_ENCODING_RANGES 3   // LED numbers, where a range (first LED flagged with SEQUENCE_RANGE, last LED, stride) takes three entries
+#define SEQUENCE_DELTA_OFF 0x8000    // Set on the LED number of a delta entry which turns the LED off
+#define SEQUENCE_RANGE 0x4000        // Set on the first LED number of a range entry
+#define SEQUENCE_RANGE_ENTRY_COUNT 3 // Entries taken by a range
+#define SEQUENCE_HASH_PATTERN_MARKER 0xFFFF // Hashed at the start of each pattern (no LED has this number)
+
+// Header of a sequence image stored in program flash (the image follows it, see LedSequence::copyImage)
+#define FLASH_SEQUENCE_MAGIC 0x51455346   // "FSEQ"
+struct FlashSequenceHeader
+{
+  uint32_t magic;
+  uint16_t id;
+  uint16_t length;                // Number of patterns
+  uint16_t led_count;             // Number of LED entries (over all patterns)
+  uint16_t array_led_count;
+  uint8_t bit_depth;
+  uint8_t color_channel_count;
+  uint16_t reserved;
+  uint32_t image_size;
+  uint32_t hash;                  // Sequence hash when it was saved (see LedSequence::getHash)
+};
+
+// Define LED Sequence Object. Patterns are stored in compressed sparse row form in a single heap block: an offsets array
+// (the LEDs of pattern i are entries pattern_offsets[i] to pattern_offsets[i + 1] - 1), followed by a flat LED number
+// array and a flat value array (8 or 16-bit) which hold the LEDs of all patterns back-to-back. Each LED has one value
+// per color channel, interleaved (the values of LED entry i start at values[i * color_channel_count]). A 1-bit pattern
+// which lights more LEDs than its bitset has words is stored as a bitset in its led_list entries instead, and (if
+// delta_encoding is set) a pattern which differs from the previous one in fewer LEDs than it lights is stored as those
+// changes (see endPattern). LED ranges (e.g. every third LED from 0 to 1528) are stored as a first LED, last LED and
+// stride (see appendRange).
 struct LedSequence
 {
-  uint16_t length = 0;                      // Length of values
-  volatile uint16_t * led_counts;           // Number of LEDs in each values
-  volatile uint16_t * * led_list;           // LED numbers used in each entry
-  volatile uint8_t * * values;                     // Actual LED values (will be assigned to one of the other variables
+  uint16_t length = 0;                      // Number of patterns
+  uint16_t led_capacity = 0;                // Number of LEDs (over all patterns) which fit in storage
+  uint8_t * storage = NULL;                 // Single allocation holding the arrays below
+  bool storage_attached = false;            // Storage is a read-only image (e.g. in flash) which is not ours to free
+  volatile uint16_t * pattern_offsets;      // Start of each pattern in led_list and values (length + 1 entries)
+  volatile uint16_t * led_list;             // LED numbers of all patterns
+  volatile uint8_t * values;                // Actual LED values of all patterns (8-bit)
+  volatile uint16_t * values_16bit;         // Actual LED values of all patterns (16-bit, same storage as values)
+  volatile uint8_t * pattern_encodings;     // Encoding of each pattern (SEQUENCE_ENCODING_*)
   volatile uint16_t number_of_patterns_assigned = 0; // Number of patterns which have been assigned
-  volatile uint16_t current_pattern_led_index = 0;   // Current led index within current pattern
-  uint8_t color_channel_count = 1;
+  uint8_t color_channel_count = 1;          // Values per LED (set before allocating)
+  uint16_t array_led_count = 0;             // Bits per bitset pattern (set before allocating)
   uint8_t bit_depth = 8;
+  bool delta_encoding = false;              // Store patterns as the changes from the previous one (set before allocating)
   int debug = 1;
 
+  // Hash of the patterns as they were added: a marker per pattern, then the LED number (as stored, with SEQUENCE_RANGE)
+  // and values of each LED appended to it. getHash adds the sequence parameters.
+  XxHash32 hash;
+  uint32_t attached_hash = 0;               // Hash of an attached image (saved with it)
+
+  // Scratch allocated with the sequence and released once it is full (see getScratchSize), and the sorted LED numbers
+  // and values of the last finished pattern in it, kept while patterns are added (see endPattern)
+  uint8_t * scratch = NULL;
+  uint8_t * delta_state = NULL;
+  uint16_t delta_state_led_count = 0;
+  int32_t delta_state_pattern_index = -1;
+
   void reset()
   {
     deallocate();
   }
 
-  void allocate(uint16_t values_length)
+  // Allocates storage for values_length patterns with up to new_led_capacity LEDs in total (more are allocated as needed).
+  // Returns false if there is no memory for it (the caller reports the error).
+  bool allocate(uint16_t values_length, uint16_t new_led_capacity)
   {
-    // Allocate sequence with desired bit_depth
-    if (bit_depth == 1)
-      ; // Don't allocate anything - any LED in the LED list is considered "on" or true.
-    else if (bit_depth == 8)
-      values = new volatile uint8_t * [values_length];
-    else if (bit_depth == 16)
-      Serial.printf(F("16bit sequences not yet supported %s"), SERIAL_LINE_ENDING);
-    else
+    if ((bit_depth != 1) && (bit_depth != 8) && (bit_depth != 16))
+      return (false);
+
+    uint8_t * new_storage = new uint8_t[getStorageSize(values_length, new_led_capacity)];
+    if (new_storage == NULL)
+      return (false);
+
+    // Scratch for encoding patterns as they are added (allocated once, not per pattern)
+    if (getScratchSize(delta_encoding, bit_depth) > 0)
     {
-      Serial.printf(F("ERROR - invalid bit depth!%s"), SERIAL_LINE_ENDING);
-      return;
+      scratch = new uint8_t[getScratchSize(delta_encoding, bit_depth)];
+      if (scratch == NULL)
+      {
+        delete[] new_storage;
+        return (false);
+      }
     }
 
-    led_list = new volatile uint16_t * [values_length];
-    led_counts = new volatile uint16_t [values_length];
-
     // Assign new vector length
+    storage = new_storage;
     length = values_length;
+    led_capacity = new_led_capacity;
+    assignArrays();
+    pattern_offsets[0] = 0;
+    return (true);
+  }
+
+  uint32_t getStorageSize(uint16_t pattern_count, uint16_t capacity)
+  {
+    return (getStorageSize(pattern_count, capacity, bit_depth));
+  }
+
+  // Storage needed for a sequence at any bit depth (used to plan sequences before they are allocated)
+  uint32_t getStorageSize(uint16_t pattern_count, uint32_t capacity, uint8_t sequence_bit_depth)
+  {
+    return ((pattern_count + 1 + capacity) * sizeof(uint16_t) + capacity * (sequence_bit_depth / 8) * color_channel_count + pattern_count);
+  }
+
+  // Scratch needed while patterns are added: two sorted pattern copies (the last pattern and the one before it) for
+  // delta encoding, each of which fits every LED of the array once, then the bitset of a 1-bit pattern
+  uint32_t getScratchSize(bool delta, uint8_t sequence_bit_depth)
+  {
+    return ((delta ? 2 * getDeltaStateSize(sequence_bit_depth) : 0) + ((sequence_bit_depth == 1) ? getBitsetWordCount() * sizeof(uint16_t) : 0));
+  }
+
+  // Bytes of a sorted pattern copy (kept even, so the LED numbers of the second copy stay aligned)
+  uint32_t getDeltaStateSize(uint8_t sequence_bit_depth)
+  {
+    return (((uint32_t)array_led_count * (sizeof(uint16_t) + (sequence_bit_depth / 8) * color_channel_count) + 1) & ~(uint32_t)1);
+  }
+
+  // Heap used by the sequence, including its scratch
+  uint32_t getHeapSize()
+  {
+    return ((((storage != NULL) && !storage_attached) ? getStorageSize(length, led_capacity) : 0) + ((scratch != NULL) ? getScratchSize(delta_encoding, bit_depth) : 0));
+  }
+
+  // Bytes per value. 1-bit sequences don't store values - any LED in the LED list is considered "on" or true.
+  uint8_t getValueSize()
+  {
+    return (bit_depth / 8);
+  }
+
+  // Bytes of values per LED (all color channels)
+  uint8_t getLedValueSize()
+  {
+    return (getValueSize() * color_channel_count);
+  }
+
+  void assignArrays()
+  {
+    pattern_offsets = (volatile uint16_t *) storage;
+    led_list = pattern_offsets + length + 1;
+    values = (volatile uint8_t *) (led_list + led_capacity);
+    values_16bit = (volatile uint16_t *) values;
+    pattern_encodings = values + led_capacity * getLedValueSize();
+  }
+
+  // Size of the sequence image: the storage of the assigned patterns and LEDs only
+  uint32_t getImageSize()
+  {
+    return (getStorageSize(number_of_patterns_assigned, getAssignedLedCount()));
   }
 
-  void setBitDepth(uint16_t new_bit_depth)
+  // Copies part of the sequence image, which is laid out like storage for a sequence of exactly the assigned patterns
+  // and LEDs (so it can be attached without changes)
+  void copyImage(uint32_t image_offset, uint8_t * buffer, uint32_t byte_count)
   {
+    const uint8_t * sections[4] = {(const uint8_t *) pattern_offsets, (const uint8_t *) led_list, (const uint8_t *) values, (const uint8_t *) pattern_encodings};
+    uint32_t section_sizes[4] = {(number_of_patterns_assigned + 1) * sizeof(uint16_t), getAssignedLedCount() * sizeof(uint16_t), (uint32_t)getAssignedLedCount() * getLedValueSize(), number_of_patterns_assigned};
+    for (uint8_t section_index = 0; (section_index < 4) && (byte_count > 0); section_index++)
+    {
+      if (image_offset >= section_sizes[section_index])
+      {
+        image_offset -= section_sizes[section_index];
+        continue;
+      }
+      uint32_t copy_count = min(section_sizes[section_index] - image_offset, byte_count);
+      memcpy(buffer, sections[section_index] + image_offset, copy_count);
+      buffer += copy_count;
+      byte_count -= copy_count;
+      image_offset = 0;
+    }
+  }
+
+  // Plays a sequence image in place (e.g. from program flash) instead of copying it. The sequence is full, so it is
+  // never written; the next allocation replaces it.
+  void attach(const uint8_t * image, uint16_t pattern_count, uint16_t led_count, uint8_t image_bit_depth, uint32_t image_hash)
+  {
+    deallocate();
+    bit_depth = image_bit_depth;
+    attached_hash = image_hash;
+    storage = (uint8_t *) image;
+    storage_attached = true;
+    length = pattern_count;
+    led_capacity = led_count;
+    assignArrays();
+    number_of_patterns_assigned = pattern_count;
+  }
+
+  // Grows storage (at least doubling it) so led_count more LEDs fit after the assigned patterns. Returns false if there
+  // is no memory for it (the caller reports the error).
+  bool reserve(uint16_t led_count)
+  {
+    uint32_t required_capacity = (uint32_t)getAssignedLedCount() + led_count;
+    if (required_capacity <= led_capacity)
+      return (true);
+
+    uint32_t new_capacity = min(max(required_capacity, (uint32_t)led_capacity * 2), (uint32_t)UINT16_MAX);
+    uint8_t * new_storage = (required_capacity <= new_capacity) ? new uint8_t[getStorageSize(length, new_capacity)] : NULL;
+    if ((new_storage == NULL) && (required_capacity < new_capacity))
+    {
+      // No room to double the storage, so grow it just enough
+      new_capacity = required_capacity;
+      new_storage = new uint8_t[getStorageSize(length, new_capacity)];
+    }
+    if (new_storage == NULL)
+      return (false);
+
+    // Offsets and LED numbers start at the same place in the new storage, values and encodings move back
+    uint16_t assigned_led_count = getAssignedLedCount();
+    uint8_t * new_values = new_storage + (length + 1 + new_capacity) * sizeof(uint16_t);
+    memcpy(new_storage, storage, (length + 1 + assigned_led_count) * sizeof(uint16_t));
+    memcpy(new_values, (const uint8_t *) values, assigned_led_count * getLedValueSize());
+    memcpy(new_values + new_capacity * getLedValueSize(), (const uint8_t *) pattern_encodings, length);
+    delete[] storage;
+    storage = new_storage;
+    led_capacity = new_capacity;
+    assignArrays();
+    return (true);
+  }
+
+  // Replaces the sequence with an empty one of the same size at a new bit depth. Returns false if the bit depth is
+  // invalid (the sequence is kept) or there is no memory for it (the caller reports the error).
+  bool setBitDepth(uint16_t new_bit_depth)
+  {
+    if ((new_bit_depth != 1) && (new_bit_depth != 8) && (new_bit_depth != 16))
+      return (false);
+
     // Deallocate arrays with old bit depth
+    uint16_t old_length = length;
+    uint16_t old_led_capacity = led_capacity;
     deallocate();
+    bit_depth = new_bit_depth;
+
+    // Allocate new arrays with new bit depth (and same size as before)
+    return (allocate(old_length, old_led_capacity));
+  }
+
+  // Appends an LED with the same value on every color channel
+  void append(uint16_t led_number, uint16_t value)
+  {
+    uint16_t led_index = pattern_offsets[number_of_patterns_assigned];
+    if (led_index >= led_capacity)
+      return;
 
-    // Set new bit depth
-    if ((new_bit_depth == 1) || (new_bit_depth == 8))
+    for (uint16_t color_channel_index = 0; color_channel_index < color_channel_count; color_channel_index++)
     {
-      bit_depth = new_bit_depth;
-      // Allocate new arrays with new bit depth (and same length as before)
-      allocate(length);
+      if (bit_depth == 8)
+        values[led_index * color_channel_count + color_channel_index] = value;
+      else if (bit_depth == 16)
+        values_16bit[led_index * color_channel_count + color_channel_index] = value;
     }
-    else
-      Serial.printf(F("ERROR - invalid bit depth! (allowed values are 1 or 8) %s"), SERIAL_LINE_ENDING);
+    appendValues(led_number, NULL);
   }
 
-  void append(uint16_t led_number, uint8_t value)
+  // Appends an LED with one value per color channel (led_values holds them at the sequence bit depth, NULL keeps the
+  // values already in place)
+  void appendValues(uint16_t led_number, const void * led_values)
   {
-    if (bit_depth == 8)
-      // Assign value (only if 8-bit)
-      values[number_of_patterns_assigned - 1][current_pattern_led_index] = value;
+    // LEDs are added to the end of the last pattern, which has room for the LED count passed to incriment
+    uint16_t led_index = pattern_offsets[number_of_patterns_assigned];
+    if (led_index >= led_capacity)
+      return;
 
     // Assign led number
-    led_list[number_of_patterns_assigned - 1][current_pattern_led_index] = led_number;
+    led_list[led_index] = led_number;
+
+    if (led_values != NULL)
+      memcpy((uint8_t *) values + led_index * getLedValueSize(), led_values, getLedValueSize());
+    hash.update(&led_number, sizeof(led_number));
+    hash.update((const uint8_t *) values + led_index * getLedValueSize(), getLedValueSize());
 
     // Increment number of LEDs stored in this pattern
-    current_pattern_led_index += 1;
+    pattern_offsets[number_of_patterns_assigned] = led_index + 1;
+  }
+
+  // Appends every stride-th LED from first_led_number to last_led_number, all with the same values, as one range entry.
+  // The pattern is then kept as given (it is not sorted or re-encoded).
+  void appendRange(uint16_t first_led_number, uint16_t last_led_number, uint16_t stride, const void * led_values)
+  {
+    if (pattern_offsets[number_of_patterns_assigned] + SEQUENCE_RANGE_ENTRY_COUNT > led_capacity)
+      return;
+
+    appendValues(first_led_number | SEQUENCE_RANGE, led_values);
+    appendValues(last_led_number, led_values);
+    appendValues(stride, led_values);
+    pattern_encodings[number_of_patterns_assigned - 1] = SEQUENCE_ENCODING_RANGES;
   }
 
   bool incriment(uint16_t led_count)
   {
-    if (number_of_patterns_assigned < length)
+    if ((number_of_patterns_assigned < length) && reserve(led_count))
     {
+      // Start an empty pattern after the last one
+      pattern_offsets[number_of_patterns_assigned + 1] = pattern_offsets[number_of_patterns_assigned];
+      pattern_encodings[number_of_patterns_assigned] = SEQUENCE_ENCODING_LIST;
+      uint16_t pattern_marker = SEQUENCE_HASH_PATTERN_MARKER;
+      hash.update(&pattern_marker, sizeof(pattern_marker));
+
       // Incriment number of patterns assigned
       number_of_patterns_assigned++;
 
-      // store the number of leds in this pattern
-      led_counts[number_of_patterns_assigned - 1] = led_count;
+      // Let user know we haven't reached capacity
+      return (true);
+    }
+    else
+      return (false); // Sequence length reached
+  }
 
-      if (led_count > 0)
-      {
-        if (bit_depth == 8)
-          // Initialize the array for this pattern (only if 8-bit)
-          values[number_of_patterns_assigned - 1] = new uint8_t[led_count * (uint16_t)color_channel_count];
+  // Picks the smallest encoding for the last pattern: its LED list, a bitset (1-bit sequences only) or the LEDs changed
+  // since the previous pattern. The LED list is sorted by LED number first.
+  void endPattern()
+  {
+    if (number_of_patterns_assigned == 0)
+      return;
+    if (pattern_encodings[number_of_patterns_assigned - 1] != SEQUENCE_ENCODING_LIST)
+    {
+      if (number_of_patterns_assigned == length)
+        releaseScratch();
+      return;
+    }
 
-        // Initialize the led number list for this pattern
-        led_list[number_of_patterns_assigned - 1] = new uint16_t[led_count];
-      }
+    uint16_t pattern_index = number_of_patterns_assigned - 1;
+    sortPattern();
+    uint16_t list_led_count = pattern_offsets[pattern_index + 1] - pattern_offsets[pattern_index];
+    uint16_t bitset_word_count = (bit_depth == 1) ? getBitsetWordCount() : UINT16_MAX;
 
-      // Reset the pattern led index
-      current_pattern_led_index = 0;
+    // Keep a copy of this pattern (in the half of the scratch the previous copy is not in) to delta-encode the next one
+    uint8_t * previous_state = delta_state;
+    uint16_t previous_led_count = delta_state_led_count;
+    bool has_previous = (previous_state != NULL) && (delta_state_pattern_index == (int32_t)pattern_index - 1);
+    delta_state = NULL;
+    delta_state_pattern_index = -1;
+    if (delta_encoding && (scratch != NULL) && (list_led_count <= array_led_count))
+    {
+      delta_state = (previous_state == scratch) ? scratch + getDeltaStateSize(bit_depth) : scratch;
+      memcpy(delta_state, (const uint16_t *) led_list + pattern_offsets[pattern_index], list_led_count * sizeof(uint16_t));
+      memcpy(delta_state + list_led_count * sizeof(uint16_t), (const uint8_t *) values + pattern_offsets[pattern_index] * getLedValueSize(), list_led_count * getLedValueSize());
+      delta_state_led_count = list_led_count;
+      delta_state_pattern_index = pattern_index;
+    }
 
-      // Let user know we haven't reached capacity
-      return (true);
+    uint16_t delta_led_count = (has_previous && (delta_state != NULL)) ? mergeDelta(previous_state, previous_led_count, false) : UINT16_MAX;
+    if ((delta_led_count > 0) && (delta_led_count < list_led_count) && (delta_led_count < bitset_word_count))
+    {
+      mergeDelta(previous_state, previous_led_count, true);
+      pattern_offsets[pattern_index + 1] = pattern_offsets[pattern_index] + delta_led_count;
+      pattern_encodings[pattern_index] = SEQUENCE_ENCODING_DELTA;
     }
-    else
+    else if (bitset_word_count < list_led_count)
+      encodeBitset();
+
+    // The scratch is not needed once the sequence is full
+    if (number_of_patterns_assigned == length)
+      releaseScratch();
+  }
+
+  // Sorts the LEDs of the last pattern by LED number, keeping only the last entry of a repeated LED (the one shown)
+  void sortPattern()
+  {
+    uint16_t pattern_start = pattern_offsets[number_of_patterns_assigned - 1];
+    uint16_t pattern_end = pattern_offsets[number_of_patterns_assigned];
+    for (uint16_t led_index = pattern_start + 1; led_index < pattern_end; led_index++)
     {
-      Serial.print(F("Sequence length (")); Serial.print(length); Serial.printf(F(") reached. %s"), SERIAL_LINE_ENDING);
-      return (false);
+      for (uint16_t sort_index = led_index; (sort_index > pattern_start) && (led_list[sort_index - 1] > led_list[sort_index]); sort_index--)
+        swapEntries(sort_index - 1, sort_index);
     }
+
+    uint16_t unique_end = pattern_start;
+    for (uint16_t led_index = pattern_start; led_index < pattern_end; led_index++)
+    {
+      if ((unique_end > pattern_start) && (led_list[unique_end - 1] == led_list[led_index]))
+        unique_end--;
+      if (unique_end != led_index)
+      {
+        led_list[unique_end] = led_list[led_index];
+        memcpy((uint8_t *) values + unique_end * getLedValueSize(), (const uint8_t *) values + led_index * getLedValueSize(), getLedValueSize());
+      }
+      unique_end++;
+    }
+    pattern_offsets[number_of_patterns_assigned] = unique_end;
   }
 
-  void deallocate()
+  void swapEntries(uint16_t first_index, uint16_t second_index)
   {
-    for (uint16_t values_index = 0; values_index < number_of_patterns_assigned; values_index++)
+    uint16_t led_number = led_list[first_index];
+    led_list[first_index] = led_list[second_index];
+    led_list[second_index] = led_number;
+    for (uint16_t byte_index = 0; byte_index < getLedValueSize(); byte_index++)
+    {
+      uint8_t value = values[first_index * getLedValueSize() + byte_index];
+      values[first_index * getLedValueSize() + byte_index] = values[second_index * getLedValueSize() + byte_index];
+      values[second_index * getLedValueSize() + byte_index] = value;
+    }
+  }
+
+  // Counts (or writes over the last pattern) the delta entries between the previous pattern and the last one (both in
+  // sorted copies): LEDs turned off, and LEDs turned on or given new values
+  uint16_t mergeDelta(const uint8_t * previous_state, uint16_t previous_led_count, bool write)
+  {
+    const uint16_t * previous_leds = (const uint16_t *) previous_state;
+    const uint8_t * previous_values = previous_state + previous_led_count * sizeof(uint16_t);
+    const uint16_t * current_leds = (const uint16_t *) delta_state;
+    const uint8_t * current_values = delta_state + delta_state_led_count * sizeof(uint16_t);
+    uint16_t delta_start = pattern_offsets[number_of_patterns_assigned - 1];
+    uint16_t delta_led_count = 0;
+    uint16_t previous_index = 0;
+    uint16_t current_index = 0;
+    while ((previous_index < previous_led_count) || (current_index < delta_state_led_count))
     {
-      if (led_counts[values_index] > 0)
+      bool previous_only = (current_index >= delta_state_led_count) || ((previous_index < previous_led_count) && (previous_leds[previous_index] < current_leds[current_index]));
+      bool current_only = !previous_only && ((previous_index >= previous_led_count) || (current_leds[current_index] < previous_leds[previous_index]));
+      if (previous_only)
       {
-        if (bit_depth == 8)
-          delete[] values[values_index];
-        delete[] led_list[values_index];
+        if (write)
+          led_list[delta_start + delta_led_count] = previous_leds[previous_index] | SEQUENCE_DELTA_OFF;
+        delta_led_count++;
+        previous_index++;
+      }
+      else
+      {
+        if (current_only || (memcmp(previous_values + previous_index * getLedValueSize(), current_values + current_index * getLedValueSize(), getLedValueSize()) != 0))
+        {
+          if (write)
+          {
+            led_list[delta_start + delta_led_count] = current_leds[current_index];
+            memcpy((uint8_t *) values + (delta_start + delta_led_count) * getLedValueSize(), current_values + current_index * getLedValueSize(), getLedValueSize());
+          }
+          delta_led_count++;
+        }
+        if (!current_only)
+          previous_index++;
+        current_index++;
       }
     }
+    return (delta_led_count);
+  }
+
+  // Converts the last pattern (a list of LED numbers) to a bitset
+  void encodeBitset()
+  {
+    uint16_t pattern_start = pattern_offsets[number_of_patterns_assigned - 1];
+    uint16_t list_led_count = pattern_offsets[number_of_patterns_assigned] - pattern_start;
+    uint16_t word_count = getBitsetWordCount();
 
-    if (number_of_patterns_assigned > 0)
+    // The bitset is built in the scratch, after the delta copies (the list is kept if there is no scratch)
+    if (scratch == NULL)
+      return;
+    uint16_t * bitset = (uint16_t *) (scratch + (delta_encoding ? 2 * getDeltaStateSize(bit_depth) : 0));
+    memset(bitset, 0, word_count * sizeof(uint16_t));
+    for (uint16_t led_index = pattern_start; led_index < pattern_start + list_led_count; led_index++)
     {
-      if (bit_depth == 8)
-        delete[] values;
-      delete[] led_list;
-      delete[] led_counts;
+      if (led_list[led_index] < array_led_count)
+        bitset[led_list[led_index] / 16] |= (uint16_t)1 << (led_list[led_index] % 16);
     }
+    memcpy((uint16_t *) led_list + pattern_start, bitset, word_count * sizeof(uint16_t));
 
+    pattern_offsets[number_of_patterns_assigned] = pattern_start + word_count;
+    pattern_encodings[number_of_patterns_assigned - 1] = SEQUENCE_ENCODING_BITSET;
+  }
+
+  void releaseScratch()
+  {
+    if (scratch != NULL)
+      delete[] scratch;
+    scratch = NULL;
+    delta_state = NULL;
+    delta_state_led_count = 0;
+    delta_state_pattern_index = -1;
+  }
+
+  uint16_t getBitsetWordCount()
+  {
+    return ((array_led_count + 15) / 16);
+  }
+
+  uint16_t getLedCount(uint16_t values_index)
+  {
+    uint16_t entry_count = pattern_offsets[values_index + 1] - pattern_offsets[values_index];
+    if (pattern_encodings[values_index] == SEQUENCE_ENCODING_RANGES)
+    {
+      uint16_t led_count = 0;
+      for (uint16_t led_index = pattern_offsets[values_index]; led_index < pattern_offsets[values_index + 1]; led_index++)
+      {
+        if (led_list[led_index] & SEQUENCE_RANGE)
+        {
+          led_count += ((led_list[led_index + 1] - (led_list[led_index] & ~SEQUENCE_RANGE)) / led_list[led_index + 2] + 1);
+          led_index += SEQUENCE_RANGE_ENTRY_COUNT - 1;
+        }
+        else
+          led_count++;
+      }
+      return (led_count);
+    }
+    if (pattern_encodings[values_index] != SEQUENCE_ENCODING_BITSET)
+      return (entry_count);
+
+    uint16_t led_count = 0;
+    for (uint16_t word_index = pattern_offsets[values_index]; word_index < pattern_offsets[values_index + 1]; word_index++)
+      led_count += __builtin_popcount(led_list[word_index]);
+    return (led_count);
+  }
+
+  uint16_t getAssignedLedCount()
+  {
+    return ((storage != NULL) ? pattern_offsets[number_of_patterns_assigned] : 0);
+  }
+
+  void deallocate()
+  {
+    if ((storage != NULL) && !storage_attached)
+      delete[] storage;
+    storage = NULL;
+    storage_attached = false;
+    releaseScratch();
+    length = 0;
+    led_capacity = 0;
     number_of_patterns_assigned = 0; // Number of patterns which have been assigned
-    current_pattern_led_index = 0;
+    hash.reset(0);
+    attached_hash = 0;
+  }
+
+  // Hash of the sequence contents and parameters, available at any time without reading the patterns (see hash)
+  uint32_t getHash()
+  {
+    if (storage_attached)
+      return (attached_hash);
+
+    XxHash32 sequence_hash = hash;
+    uint16_t pattern_count = length;
+    uint16_t patterns_assigned = number_of_patterns_assigned;
+    sequence_hash.update(&bit_depth, sizeof(bit_depth));
+    sequence_hash.update(&color_channel_count, sizeof(color_channel_count));
+    sequence_hash.update(&pattern_count, sizeof(pattern_count));
+    sequence_hash.update(&patterns_assigned, sizeof(patterns_assigned));
+    return (sequence_hash.digest());
   }
 
   void print()
@@ -170,16 +587,51 @@ struct LedSequence
     Serial.print("Pattern ");
     Serial.print(values_index);
     Serial.print(" (");
-    Serial.print(led_counts[values_index]);
-    Serial.printf(" leds): %s", SERIAL_LINE_ENDING);
-    for (uint16_t led_index = 0; led_index < led_counts[values_index]; led_index++)
+    Serial.print(getLedCount(values_index));
+    if (pattern_encodings[values_index] == SEQUENCE_ENCODING_DELTA)
+      Serial.printf(" leds changed): %s", SERIAL_LINE_ENDING);
+    else
+      Serial.printf(" leds): %s", SERIAL_LINE_ENDING);
+    if (pattern_encodings[values_index] == SEQUENCE_ENCODING_BITSET)
+    {
+      Serial.print(F(" LED #s (bitset): "));
+      for (uint16_t word_index = pattern_offsets[values_index]; word_index < pattern_offsets[values_index + 1]; word_index++)
+      {
+        for (uint32_t word = led_list[word_index]; word != 0; word &= word - 1)
+        {
+          Serial.print((word_index - pattern_offsets[values_index]) * 16 + __builtin_ctz(word));
+          Serial.print(F(" "));
+        }
+      }
+      Serial.print(SERIAL_LINE_ENDING);
+      return;
+    }
+    for (uint16_t led_index = pattern_offsets[values_index]; led_index < pattern_offsets[values_index + 1]; led_index++)
     {
       Serial.print(F(" LED #: "));
-      Serial.print(led_list[values_index][led_index]);
-      Serial.print(F(", value="));
-      if (bit_depth == 8)
-        Serial.print(values[values_index][led_index]);
+      if ((pattern_encodings[values_index] == SEQUENCE_ENCODING_RANGES) && (led_list[led_index] & SEQUENCE_RANGE))
+      {
+        Serial.printf(F("%d:%d:%d"), led_list[led_index] & ~SEQUENCE_RANGE, led_list[led_index + 1], led_list[led_index + 2]);
+        led_index += SEQUENCE_RANGE_ENTRY_COUNT - 1;
+      }
       else
+        Serial.print(led_list[led_index] & ~SEQUENCE_DELTA_OFF);
+      if ((pattern_encodings[values_index] == SEQUENCE_ENCODING_DELTA) && (led_list[led_index] & SEQUENCE_DELTA_OFF))
+      {
+        Serial.printf(F(", off%s"), SERIAL_LINE_ENDING);
+        continue;
+      }
+      Serial.print(F(", value="));
+      for (uint16_t color_channel_index = 0; (color_channel_index < color_channel_count) && (bit_depth > 1); color_channel_index++)
+      {
+        if (color_channel_index > 0)
+          Serial.print(F(","));
+        if (bit_depth == 8)
+          Serial.print(values[led_index * color_channel_count + color_channel_index]);
+        else
+          Serial.print(values_16bit[led_index * color_channel_count + color_channel_index]);
+      }
+      if (bit_depth == 1)
         Serial.print(true);
       Serial.print(F(" (bit depth="));
       Serial.print(bit_depth);
@@ -0,0 +1,185 @@
+/*
+  Copyright (c) 2018, Zachary Phillips (UC Berkeley)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+      Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+      Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#ifndef LED_ARRAY_STREAM_H
+#define LED_ARRAY_STREAM_H
+#include "Arduino.h"
+#include "illuminate.h"
+#include "ledsequence.h"
+
+#define STREAM_BUFFER_SIZE 8192      // Bytes of patterns buffered ahead of playback (a power of two)
+#define STREAM_VALUE_SIZE_MAX 8      // Bytes of values per LED (up to four 16-bit color channels)
+
+// Patterns streamed by the host (spsh) and played as they arrive (rstr). The buffer is a single-producer,
+// single-consumer ring: the command router writes a pattern and then publishes it by counting it in patterns_written,
+// and playback reads a pattern and then frees its space by advancing read_position. Each side only writes its own
+// counters, so neither side needs a lock, and playback could run from an interrupt. Positions count bytes and are
+// wrapped to the buffer when it is accessed. A pattern is a uint16 entry count followed by its entries: an LED number
+// (flagged with SEQUENCE_RANGE for a range, which is followed by its last LED and stride) and one value per color channel
+// at the bit depth of the stream (no values for 1-bit streams).
+struct LedStream
+{
+  uint8_t * buffer = NULL;
+  volatile uint32_t write_position = 0;     // End of the published patterns (written by the producer)
+  volatile uint32_t read_position = 0;      // Start of the unread patterns (written by the consumer)
+  volatile uint32_t patterns_written = 0;   // Written by the producer
+  volatile uint32_t patterns_read = 0;      // Written by the consumer
+  volatile bool ended = false;              // No patterns follow the buffered ones
+  volatile uint32_t underrun_count = 0;     // Patterns which were not buffered in time to be played (consumer)
+  volatile uint32_t underrun_pattern_index = 0; // Index of the last of these patterns (consumer)
+  uint32_t pattern_position = 0;            // Producer position in the pattern being written
+  uint16_t pattern_entry_count = 0;
+  uint8_t bit_depth = 8;
+  uint8_t color_channel_count = 1;
+
+  bool allocate(uint8_t new_bit_depth, uint8_t new_color_channel_count)
+  {
+    deallocate();
+    buffer = new uint8_t[STREAM_BUFFER_SIZE];
+    if (buffer == NULL)
+      return (false);
+    bit_depth = new_bit_depth;
+    color_channel_count = new_color_channel_count;
+    return (true);
+  }
+
+  void deallocate()
+  {
+    if (buffer != NULL)
+      delete[] buffer;
+    buffer = NULL;
+    write_position = 0;
+    read_position = 0;
+    patterns_written = 0;
+    patterns_read = 0;
+    ended = false;
+    underrun_count = 0;
+    underrun_pattern_index = 0;
+  }
+
+  uint8_t getLedValueSize()
+  {
+    if (bit_depth == 1)
+      return (0);
+    return (color_channel_count * ((bit_depth == 16) ? 2 : 1));
+  }
+
+  // Bytes taken by an LED (or a range) of a pattern
+  uint16_t getEntrySize(bool range)
+  {
+    return ((range ? 6 : 2) + getLedValueSize());
+  }
+
+  uint32_t getFreeSize()
+  {
+    return (STREAM_BUFFER_SIZE - (write_position - read_position));
+  }
+
+  uint32_t getQueuedPatternCount()
+  {
+    return (patterns_written - patterns_read);
+  }
+
+  // Producer: patterns are written with beginPattern, appendValues / appendRange and endPattern, after checking that
+  // getFreeSize() has room for them
+  void beginPattern()
+  {
+    pattern_position = write_position + 2;
+    pattern_entry_count = 0;
+  }
+
+  void appendValues(uint16_t led_number, const void * led_values)
+  {
+    write16(pattern_position, led_number);
+    write(pattern_position, (const uint8_t *) led_values, getLedValueSize());
+    pattern_entry_count++;
+  }
+
+  void appendRange(uint16_t first_led_number, uint16_t last_led_number, uint16_t stride, const void * led_values)
+  {
+    write16(pattern_position, first_led_number | SEQUENCE_RANGE);
+    write16(pattern_position, last_led_number);
+    write16(pattern_position, stride);
+    write(pattern_position, (const uint8_t *) led_values, getLedValueSize());
+    pattern_entry_count++;
+  }
+
+  void endPattern()
+  {
+    uint32_t position = write_position;
+    write16(position, pattern_entry_count);
+
+    // Publish the pattern only once all of its bytes are in the buffer
+    __sync_synchronize();
+    write_position = pattern_position;
+    patterns_written = patterns_written + 1;
+  }
+
+  // Consumer: a pattern is read from read_position with read16 / read, then freed with finishPattern
+  bool hasPattern()
+  {
+    return (patterns_read != patterns_written);
+  }
+
+  void finishPattern(uint32_t position)
+  {
+    __sync_synchronize();
+    read_position = position;
+    patterns_read = patterns_read + 1;
+  }
+
+  uint16_t read16(uint32_t & position)
+  {
+    uint16_t value = buffer[position & (STREAM_BUFFER_SIZE - 1)] | ((uint16_t)buffer[(position + 1) & (STREAM_BUFFER_SIZE - 1)] << 8);
+    position += 2;
+    return (value);
+  }
+
+  void read(uint32_t & position, uint8_t * data, uint16_t byte_count)
+  {
+    for (uint16_t byte_index = 0; byte_index < byte_count; byte_index++)
+      data[byte_index] = buffer[(position + byte_index) & (STREAM_BUFFER_SIZE - 1)];
+    position += byte_count;
+  }
+
+  void write16(uint32_t & position, uint16_t value)
+  {
+    buffer[position & (STREAM_BUFFER_SIZE - 1)] = value & 0xFF;
+    buffer[(position + 1) & (STREAM_BUFFER_SIZE - 1)] = value >> 8;
+    position += 2;
+  }
+
+  void write(uint32_t & position, const uint8_t * data, uint16_t byte_count)
+  {
+    for (uint16_t byte_index = 0; byte_index < byte_count; byte_index++)
+      buffer[(position + byte_index) & (STREAM_BUFFER_SIZE - 1)] = data[byte_index];
+    position += byte_count;
+  }
+};
+
+#endif
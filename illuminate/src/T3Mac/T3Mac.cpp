@@ -29,3 +29,50 @@ void print_mac()  {
                 count += Serial.print(*(mac+i) & 0x0F, 16);
         }
 }
+
+// Launches the command in the FCCOB registers and waits for it. Runs from RAM with interrupts off, since program
+// flash can not be read while it is erased or programmed. Returns false on an access or protection error.
+FASTRUN static bool run_flash_command() {
+        __disable_irq();
+        FTFL_FSTAT = FTFL_FSTAT_CCIF;
+        while(!(FTFL_FSTAT & FTFL_FSTAT_CCIF)) ;
+        __enable_irq();
+
+        // drop stale flash cache lines
+        FMC_PFB0CR |= FMC_PFB0CR_CINV_WAY(15) | FMC_PFB0CR_S_B_INV;
+        return !(FTFL_FSTAT & (FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL | FTFL_FSTAT_MGSTAT0));
+}
+
+static void set_flash_address(uint32_t address) {
+        FTFL_FSTAT = FTFL_FSTAT_ACCERR | FTFL_FSTAT_FPVIOL; // clear errors of the last command
+        FTFL_FCCOB1 = address >> 16;
+        FTFL_FCCOB2 = address >> 8;
+        FTFL_FCCOB3 = address;
+}
+
+bool flash_erase_sector(uint32_t address) {
+        set_flash_address(address);
+        FTFL_FCCOB0 = 0x09;       // Selects the ERSSCR command
+        return run_flash_command();
+}
+
+bool flash_program_word(uint32_t address, uint32_t word) {
+        set_flash_address(address);
+        FTFL_FCCOB0 = 0x06;       // Selects the PGM4 command
+        FTFL_FCCOB4 = word >> 24; // FCCOB7 holds the byte at the lowest address
+        FTFL_FCCOB5 = word >> 16;
+        FTFL_FCCOB6 = word >> 8;
+        FTFL_FCCOB7 = word;
+        return run_flash_command();
+}
+
+// Programs byte_count bytes at a word-aligned address of erased flash (the last word is padded with 0xFF)
+bool flash_program(uint32_t address, const uint8_t *data, uint32_t byte_count) {
+        for (uint32_t offset = 0; offset < byte_count; offset += 4) {
+                uint32_t word = 0xFFFFFFFF;
+                memcpy(&word, data + offset, min(byte_count - offset, (uint32_t)4));
+                if (!flash_program_word(address + offset, word))
+                        return false;
+        }
+        return true;
+}
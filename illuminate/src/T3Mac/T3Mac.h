@@ -8,4 +8,11 @@ extern uint8_t mac[6];
 void read_mac();
 void print_mac();
 
+// Program flash is erased a sector at a time (to 0xFF) and programmed a 32-bit word at a time
+#define FLASH_SECTOR_SIZE 2048
+
+bool flash_erase_sector(uint32_t address);
+bool flash_program_word(uint32_t address, uint32_t word);
+bool flash_program(uint32_t address, const uint8_t * data, uint32_t byte_count);
+
 #endif
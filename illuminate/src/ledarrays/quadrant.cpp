@@ -64,6 +64,10 @@ const int LedArrayInterface::trigger_input_pin_list[] = {TRIGGER_INPUT_PIN_0, TR
 bool LedArrayInterface::trigger_input_state[] = {false, false};
 
 int LedArrayInterface::debug = 0;
+
+// Batch flags
+bool LedArrayInterface::batch_open = false;
+bool LedArrayInterface::batch_update_pending = false;
 bool digital_mode = true;
 
 /**** Device-specific commands ****/
@@ -83,6 +87,8 @@ const int16_t PROGMEM LedArrayInterface::led_positions[][5] = {
 /* Device-specific variables */
 int pin_numbers[4] = {Q1_PIN, Q2_PIN, Q3_PIN, Q4_PIN};
 uint8_t led_values[4] = {0, 0, 0, 0};
+uint8_t shifted_pin_values[4] = {0, 0, 0, 0};   // Pin values staged by shift(), by channel
+volatile bool frame_shifted = false;
 
 /**** Part number and Serial number addresses in EEPROM ****/
 uint16_t pn_address = 100;
@@ -142,7 +148,8 @@ bool LedArrayInterface::getDebug()
 void LedArrayInterface::setDebug(int state)
 {
   debug = state;
-  Serial.printf(F("(LedArrayInterface::setDebug): Set debug level to %d \n"), debug);
+  if (debug > 0)
+    Serial.printf(F("(LedArrayInterface::setDebug): Set debug level to %d \n"), debug);
 }
 
 void LedArrayInterface::setChannel(int16_t channel_number, int16_t color_channel_index, uint8_t value)
@@ -212,6 +219,64 @@ void LedArrayInterface::setPinOrder(int16_t led_number, int16_t color_channel_in
   notImplemented("SetPinOrder");
 }
 
+void LedArrayInterface::setLedValues(int16_t led_number, const uint16_t * values)
+{
+  setLed(led_number, (int16_t)0, values[0]);
+}
+
+void LedArrayInterface::setLedValues(int16_t led_number, const uint8_t * values)
+{
+  setLed(led_number, (int16_t)0, values[0]);
+}
+
+void LedArrayInterface::setImageValue(uint16_t value_index, uint16_t value)
+{
+  // Single color channel, so the value index is the LED number
+  led_values[value_index] = value >> 8;
+}
+
+uint32_t LedArrayInterface::getBufferSize()
+{
+  return (sizeof(led_values));
+}
+
+void LedArrayInterface::saveBuffer(uint8_t * buffer)
+{
+  memcpy(buffer, led_values, sizeof(led_values));
+}
+
+void LedArrayInterface::loadBuffer(const uint8_t * buffer)
+{
+  memcpy(led_values, buffer, sizeof(led_values));
+}
+
+// Frames are the pin values, by channel
+uint32_t LedArrayInterface::getFrameSize()
+{
+  return (sizeof(shifted_pin_values));
+}
+
+bool LedArrayInterface::packFrame(uint8_t * frame)
+{
+  for (uint16_t led_index = 0; led_index < 4; led_index++)
+  {
+    int16_t channel_number = (int16_t)pgm_read_word(&(led_positions[led_index][1]));
+    frame[channel_number] = led_values[led_index];
+  }
+  return (true);
+}
+
+void LedArrayInterface::shiftFrame(const uint8_t * frame)
+{
+  memcpy(shifted_pin_values, frame, sizeof(shifted_pin_values));
+  frame_shifted = true;
+}
+
+uint32_t LedArrayInterface::getDriverMemorySize()
+{
+  return (sizeof(led_values));
+}
+
 void LedArrayInterface::setLedFast(int16_t led_number, int color_channel_index, bool value)
 {
   if (led_number < 0)
@@ -324,6 +389,13 @@ int LedArrayInterface::sendTriggerPulse(int trigger_index, uint16_t delay_us, bo
 
 void LedArrayInterface::update()
 {
+  // Inside a batch, defer writing the pins until the batch is committed
+  if (batch_open)
+  {
+    batch_update_pending = true;
+    return;
+  }
+
   // Indicate we are now in analog mode, and will need to re-call pinMode to use setLedFast again
   digital_mode = false;
 
@@ -337,10 +409,38 @@ void LedArrayInterface::update()
     digitalWriteFast(pin_numbers[channel_number], led_values[led_index]);
 //    analogWrite(pin_numbers[channel_number], led_values[led_index]);
   }
+  frame_shifted = false;
+}
+
+// The pins are written directly, so shift() only stages their values and latch() writes them. latch() does no other
+// work, as the sequence timer calls it from its interrupt.
+void LedArrayInterface::shift()
+{
+  packFrame(shifted_pin_values);
+  frame_shifted = true;
+}
+
+void LedArrayInterface::latch()
+{
+  if (!frame_shifted)
+    return;
+
+  digital_mode = false;
+  for (uint16_t channel_number = 0; channel_number < 4; channel_number++)
+    digitalWriteFast(pin_numbers[channel_number], shifted_pin_values[channel_number]);
+  frame_shifted = false;
 }
 
 void LedArrayInterface::clear()
 {
+  // Inside a batch, only clear the stored values so the pins are written once at commit
+  if (batch_open)
+  {
+    setLed(-1, -1, (uint8_t)0);
+    update();
+    return;
+  }
+
   digital_mode = false; // ensure pin mode gets configured
   setLedFast(-1, -1, false);
   //  for (uint16_t led_index = 0; led_index < 4; led_index++)
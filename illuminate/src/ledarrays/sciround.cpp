@@ -28,6 +28,7 @@
  #ifdef USE_SCI_ROUND_ARRAY
  #include "../../ledarrayinterface.h"
  #include "../TLC5955/TLC5955.h"
+ #include "tlc5955shift.h"
  #include <EEPROM.h>
  
 // Pin definitions (used internally)
@@ -62,6 +63,10 @@ bool LedArrayInterface::trigger_input_state[] = {false};
 
 int LedArrayInterface::debug = 0;
 
+// Batch flags
+bool LedArrayInterface::batch_open = false;
+bool LedArrayInterface::batch_update_pending = false;
+
 const uint8_t TLC5955::_tlc_count = 52;          // Change to reflect number of TLC chips
 float TLC5955::max_current_amps = 8.0;      // Maximum current output, amps
 bool TLC5955::enforce_max_current = true;   // Whether to enforce max current limit
@@ -72,7 +77,7 @@ uint8_t TLC5955::_rgb_order[TLC5955::_tlc_count][TLC5955::LEDS_PER_CHIP][TLC5955
 uint16_t TLC5955::_grayscale_data[TLC5955::_tlc_count][TLC5955::LEDS_PER_CHIP][TLC5955::COLOR_CHANNEL_COUNT];
 
 /**** Device-specific variables ****/
-TLC5955 tlc; // TLC5955 object
+TLC5955Shift tlc; // TLC5955 object (with split shift and latch)
 uint32_t gsclk_frequency = 1000000;
 
 /**** Device-specific commands ****/
@@ -383,6 +388,64 @@ void LedArrayInterface::setPinOrder(int16_t led_number, int16_t color_channel_in
         notImplemented("SetPinOrder");
 }
 
+void LedArrayInterface::setLedValues(int16_t led_number, const uint16_t * values)
+{
+        int16_t channel_number = (int16_t)pgm_read_word(&(led_positions[led_number][1]));
+        if (channel_number >= 0)
+                tlc.setChannel(channel_number, values[0]);
+}
+
+void LedArrayInterface::setLedValues(int16_t led_number, const uint8_t * values)
+{
+        int16_t channel_number = (int16_t)pgm_read_word(&(led_positions[led_number][1]));
+        if (channel_number >= 0)
+                tlc.setChannel(channel_number, (uint16_t) (values[0] * UINT16_MAX / UINT8_MAX));
+}
+
+void LedArrayInterface::setImageValue(uint16_t value_index, uint16_t value)
+{
+        // Bypasses setLed and setChannel, so no debug output or checks (see LedArray::setImageValue). Channels
+        // are numbered sequentially across the color channels of each chip, as in tlc.setChannel.
+        int16_t channel_number = (int16_t)pgm_read_word(&(led_positions[value_index][1]));
+        if (channel_number >= 0)
+                (&TLC5955::_grayscale_data[0][0][0])[channel_number] = value;
+}
+
+uint32_t LedArrayInterface::getBufferSize()
+{
+        return (sizeof(TLC5955::_grayscale_data));
+}
+
+void LedArrayInterface::saveBuffer(uint8_t * buffer)
+{
+        memcpy(buffer, TLC5955::_grayscale_data, sizeof(TLC5955::_grayscale_data));
+}
+
+void LedArrayInterface::loadBuffer(const uint8_t * buffer)
+{
+        memcpy(TLC5955::_grayscale_data, buffer, sizeof(TLC5955::_grayscale_data));
+}
+
+uint32_t LedArrayInterface::getFrameSize()
+{
+        return (TLC5955Shift::getFrameSize());
+}
+
+bool LedArrayInterface::packFrame(uint8_t * frame)
+{
+        return (tlc.packFrame(frame));
+}
+
+void LedArrayInterface::shiftFrame(const uint8_t * frame)
+{
+        tlc.shiftFrame(frame);
+}
+
+uint32_t LedArrayInterface::getDriverMemorySize()
+{
+        return (sizeof(TLC5955::_grayscale_data) + sizeof(TLC5955::_dc_data) + sizeof(TLC5955::_rgb_order));
+}
+
 void LedArrayInterface::setLedFast(int16_t led_number, int color_channel_index, bool value)
 {
         notImplemented("setLedFast");
@@ -397,7 +460,8 @@ bool LedArrayInterface::getDebug()
 void LedArrayInterface::setDebug(int state)
 {
         debug = state;
-        Serial.printf(F("(LedArrayInterface::setDebug): Set debug level to %d \n"), debug);
+        if (debug > 0)
+                Serial.printf(F("(LedArrayInterface::setDebug): Set debug level to %d \n"), debug);
 }
 
 int LedArrayInterface::setTriggerState(int trigger_index, bool state)
@@ -455,13 +519,29 @@ int LedArrayInterface::sendTriggerPulse(int trigger_index, uint16_t delay_us, bo
 }
 void LedArrayInterface::update()
 {
+        // Inside a batch, defer the shift until the batch is committed
+        if (batch_open)
+        {
+                batch_update_pending = true;
+                return;
+        }
         tlc.updateLeds();
 }
 
+void LedArrayInterface::shift()
+{
+        tlc.shiftLeds();
+}
+
+void LedArrayInterface::latch()
+{
+        tlc.latch();
+}
+
 void LedArrayInterface::clear()
 {
         tlc.setAllLed(0);
-        tlc.updateLeds();
+        update();
 }
 
 void LedArrayInterface::setChannel(int16_t channel_number, int16_t color_channel_number, uint16_t value)
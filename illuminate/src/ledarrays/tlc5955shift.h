@@ -0,0 +1,142 @@
+/*
+  Copyright (c) 2018, Zachary Phillips (UC Berkeley)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+      Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+      Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef TLC5955_SHIFT_H
+#define TLC5955_SHIFT_H
+#include <SPI.h>
+#include "../TLC5955/TLC5955.h"
+
+#define TLC5955_SHIFT_BIT_COUNT 769     // Shift register bits per chip (latch select bit and 48 grayscale values)
+
+// TLC5955 chain (shared by the TLC5955 array backends) with the grayscale update split in two: shiftLeds() sends the
+// grayscale buffer while the outputs keep showing the previous values, and latch() then shows it at once. The
+// serialized buffer can also be kept as a frame (packFrame) and sent later as it is (shiftFrame).
+class TLC5955Shift : public TLC5955
+{
+  public:
+    // Shifts and latches the grayscale buffer
+    void updateLeds()
+    {
+      TLC5955::updateLeds();
+      frame_shifted = false;
+    }
+
+    // Shifts the grayscale buffer into the chain without latching it. Checks the current limit like updateLeds().
+    bool shiftLeds()
+    {
+      frame_shifted = false;
+      if (!checkCurrent())
+        return (false);
+
+      SPI.beginTransaction(SPISettings(getSpiBaudRate(), MSBFIRST, SPI_MODE0));
+      serialize(NULL);
+      SPI.endTransaction();
+      frame_shifted = true;
+      return (true);
+    }
+
+    // Bytes in a frame (the chain is not a whole number of bytes long, so frames start with padding bits)
+    static uint32_t getFrameSize()
+    {
+      return (((uint32_t)_tlc_count * TLC5955_SHIFT_BIT_COUNT + 7) / 8);
+    }
+
+    // Serializes the grayscale buffer into a frame of getFrameSize() bytes. Checks the current limit like updateLeds().
+    bool packFrame(uint8_t * frame)
+    {
+      if (!checkCurrent())
+        return (false);
+      serialize(frame);
+      return (true);
+    }
+
+    // Shifts a frame from packFrame() into the chain without latching it
+    void shiftFrame(const uint8_t * frame)
+    {
+      uint32_t frame_size = getFrameSize();
+      SPI.beginTransaction(SPISettings(getSpiBaudRate(), MSBFIRST, SPI_MODE0));
+      for (uint32_t byte_index = 0; byte_index < frame_size; byte_index++)
+        SPI.transfer(frame[byte_index]);
+      SPI.endTransaction();
+      frame_shifted = true;
+    }
+
+    // Shows the values shifted in by shiftLeds() or shiftFrame() (once; safe to call from an interrupt)
+    void latch()
+    {
+      if (!frame_shifted)
+        return;
+      TLC5955::latch();
+      frame_shifted = false;
+    }
+
+  private:
+    volatile bool frame_shifted = false;
+
+    bool checkCurrent()
+    {
+      if (enforce_max_current && (getTotalCurrent() > max_current_amps))
+      {
+        Serial.printf(F("ERROR (TLC5955Shift::checkCurrent): Output current (%.2f A) exceeds the limit (%.2f A)%s"), (float)getTotalCurrent(), max_current_amps, SERIAL_LINE_ENDING);
+        return (false);
+      }
+      return (true);
+    }
+
+    /* Serializes the grayscale buffer as updateLeds() does: for each chip from the last, the latch select bit (0 for
+       grayscale data) and then its values from the last channel and color, in RGB pin order. The chain is not a
+       whole number of bytes long, so padding bits come first; they fall off the end of the chain. Bytes go to frame,
+       or straight to SPI if frame is NULL. */
+    static void serialize(uint8_t * frame)
+    {
+      uint32_t bits = 0;
+      uint8_t bit_count = (8 - ((uint32_t)_tlc_count * TLC5955_SHIFT_BIT_COUNT) % 8) % 8;
+      for (int16_t chip = _tlc_count - 1; chip >= 0; chip--)
+      {
+        bits <<= 1;
+        bit_count++;
+        for (int8_t led_channel_index = LEDS_PER_CHIP - 1; led_channel_index >= 0; led_channel_index--)
+        {
+          for (int8_t color_channel_index = COLOR_CHANNEL_COUNT - 1; color_channel_index >= 0; color_channel_index--)
+          {
+            bits = (bits << 16) | _grayscale_data[chip][led_channel_index][_rgb_order[chip][led_channel_index][color_channel_index]];
+            bit_count += 16;
+            while (bit_count >= 8)
+            {
+              bit_count -= 8;
+              if (frame != NULL)
+                *frame++ = (uint8_t)(bits >> bit_count);
+              else
+                SPI.transfer((uint8_t)(bits >> bit_count));
+            }
+          }
+        }
+      }
+    }
+};
+
+#endif
@@ -0,0 +1,136 @@
+/*
+  Copyright (c) 2018, Zachary Phillips (UC Berkeley)
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+      Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+      Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+      Neither the name of the <organization> nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL <COPYRIGHT HOLDER> BE LIABLE FOR ANY
+  DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef XXHASH32_H
+#define XXHASH32_H
+#include "Arduino.h"
+
+#define XXHASH32_PRIME_1 2654435761U
+#define XXHASH32_PRIME_2 2246822519U
+#define XXHASH32_PRIME_3 3266489917U
+#define XXHASH32_PRIME_4 668265263U
+#define XXHASH32_PRIME_5 374761393U
+
+// Streaming xxHash32 (https://github.com/Cyan4973/xxHash). Data is hashed as it is added, so the digest of everything
+// added so far is available at any time without reading it again.
+struct XxHash32
+{
+  uint32_t seed;
+  uint32_t accumulators[4];
+  uint32_t total_length;
+  uint8_t buffer[16];             // Input not yet hashed (less than one 16-byte stripe)
+  uint8_t buffer_size;
+
+  XxHash32()
+  {
+    reset(0);
+  }
+
+  void reset(uint32_t new_seed)
+  {
+    seed = new_seed;
+    accumulators[0] = seed + XXHASH32_PRIME_1 + XXHASH32_PRIME_2;
+    accumulators[1] = seed + XXHASH32_PRIME_2;
+    accumulators[2] = seed;
+    accumulators[3] = seed - XXHASH32_PRIME_1;
+    total_length = 0;
+    buffer_size = 0;
+  }
+
+  static uint32_t rotateLeft(uint32_t value, uint8_t bits)
+  {
+    return ((value << bits) | (value >> (32 - bits)));
+  }
+
+  static uint32_t readWord(const uint8_t * data)
+  {
+    return ((uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+  }
+
+  static uint32_t mixLane(uint32_t accumulator, uint32_t input)
+  {
+    return (rotateLeft(accumulator + input * XXHASH32_PRIME_2, 13) * XXHASH32_PRIME_1);
+  }
+
+  void processStripe(const uint8_t * stripe)
+  {
+    for (uint8_t lane_index = 0; lane_index < 4; lane_index++)
+      accumulators[lane_index] = mixLane(accumulators[lane_index], readWord(stripe + lane_index * 4));
+  }
+
+  void update(const void * data, uint32_t byte_count)
+  {
+    const uint8_t * input = (const uint8_t *) data;
+    total_length += byte_count;
+
+    // Complete a buffered stripe first
+    if (buffer_size > 0)
+    {
+      uint8_t copy_count = min(byte_count, (uint32_t)(sizeof(buffer) - buffer_size));
+      memcpy(buffer + buffer_size, input, copy_count);
+      buffer_size += copy_count;
+      input += copy_count;
+      byte_count -= copy_count;
+      if (buffer_size < sizeof(buffer))
+        return;
+      processStripe(buffer);
+      buffer_size = 0;
+    }
+
+    for (; byte_count >= sizeof(buffer); byte_count -= sizeof(buffer), input += sizeof(buffer))
+      processStripe(input);
+
+    memcpy(buffer, input, byte_count);
+    buffer_size = byte_count;
+  }
+
+  // Hash of everything added so far (the state is not changed, so more data can be added afterwards)
+  uint32_t digest() const
+  {
+    uint32_t hash;
+    if (total_length >= sizeof(buffer))
+      hash = rotateLeft(accumulators[0], 1) + rotateLeft(accumulators[1], 7) + rotateLeft(accumulators[2], 12) + rotateLeft(accumulators[3], 18);
+    else
+      hash = seed + XXHASH32_PRIME_5;
+    hash += total_length;
+
+    uint8_t byte_index = 0;
+    for (; byte_index + 4 <= buffer_size; byte_index += 4)
+      hash = rotateLeft(hash + readWord(buffer + byte_index) * XXHASH32_PRIME_3, 17) * XXHASH32_PRIME_4;
+    for (; byte_index < buffer_size; byte_index++)
+      hash = rotateLeft(hash + buffer[byte_index] * XXHASH32_PRIME_5, 11) * XXHASH32_PRIME_1;
+
+    hash ^= hash >> 15;
+    hash *= XXHASH32_PRIME_2;
+    hash ^= hash >> 13;
+    hash *= XXHASH32_PRIME_3;
+    hash ^= hash >> 16;
+    return (hash);
+  }
+};
+
+#endif